@@ -1,7 +1,10 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cfloat>
+#include <cmath>
 #include <cassert>
 #include <vector>
+#include <array>
 #include <stack>
 #include <string>
 #include <algorithm>
@@ -9,13 +12,28 @@
 #include <filesystem>
 #include <tuple>
 #include <numbers>
+#include <span>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <bit>
+#include <unordered_map>
+#include <random>
 using namespace std::literals;
 
+#define NOMINMAX
 #include <shellscalingapi.h>
 #define _XM_SSE4_INTRINSICS_
 #include <directxmath.h>
 #include <directxcolors.h>
+#include <directxpackedvector.h>
 using namespace DirectX;
+#include <intrin.h>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_syswm.h>
@@ -79,6 +97,479 @@ std::vector<char> readFile(const std::filesystem::path& path) {
 	return data;
 }
 
+struct TaskGraph;
+
+struct Task {
+	std::function<void()> function;
+	TaskGraph* graph;
+	std::atomic<uint32> dependencyCount;
+	std::vector<Task*> dependents;
+	bool finished;
+};
+
+struct JobSystem {
+	struct WorkerQueue {
+		std::mutex mutex;
+		std::deque<Task*> tasks;
+	};
+
+	std::vector<std::thread> threads;
+	std::unique_ptr<WorkerQueue[]> queues;
+	uint32 queueCount;
+	std::atomic<uint64> queuedTaskCount;
+	std::atomic<bool> quit;
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+	static inline thread_local uint32 queueIndex = 0;
+
+	static JobSystem* create(uint32 threadCount = std::max(std::thread::hardware_concurrency(), 2u) - 1) {
+		JobSystem* jobSystem = new JobSystem();
+		jobSystem->queueCount = threadCount + 1;
+		jobSystem->queues = std::make_unique<WorkerQueue[]>(jobSystem->queueCount);
+		for (uint32 i = 0; i < threadCount; i++) {
+			jobSystem->threads.emplace_back([jobSystem, i] { jobSystem->workerLoop(i + 1); });
+		}
+		return jobSystem;
+	}
+
+	void destroy() {
+		{
+			std::lock_guard lock(sleepMutex);
+			quit = true;
+		}
+		sleepCondition.notify_all();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+
+	void workerLoop(uint32 index) {
+		queueIndex = index;
+		while (!quit) {
+			if (!runTask()) {
+				std::unique_lock lock(sleepMutex);
+				sleepCondition.wait(lock, [this] { return quit || queuedTaskCount > 0; });
+			}
+		}
+	}
+
+	void schedule(Task* task) {
+		WorkerQueue& queue = queues[queueIndex];
+		{
+			std::lock_guard lock(queue.mutex);
+			queue.tasks.push_back(task);
+		}
+		{
+			std::lock_guard lock(sleepMutex);
+			queuedTaskCount++;
+		}
+		sleepCondition.notify_one();
+	}
+
+	Task* popTask() {
+		{
+			WorkerQueue& queue = queues[queueIndex];
+			std::lock_guard lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				Task* task = queue.tasks.back();
+				queue.tasks.pop_back();
+				queuedTaskCount--;
+				return task;
+			}
+		}
+		for (uint32 i = 1; i < queueCount; i++) {
+			WorkerQueue& queue = queues[(queueIndex + i) % queueCount];
+			std::lock_guard lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				Task* task = queue.tasks.front();
+				queue.tasks.pop_front();
+				queuedTaskCount--;
+				return task;
+			}
+		}
+		return nullptr;
+	}
+
+	bool runTask();
+};
+
+struct TaskGraph {
+	JobSystem* jobSystem;
+	std::deque<Task> tasks;
+	std::mutex mutex;
+	std::atomic<uint32> unfinishedTaskCount = 0;
+
+	TaskGraph(JobSystem* jobSystem) : jobSystem(jobSystem) {}
+
+	Task* add(std::function<void()> function, const std::vector<Task*>& dependencies = {}) {
+		Task* task = nullptr;
+		{
+			std::lock_guard lock(mutex);
+			task = &tasks.emplace_back();
+			task->function = std::move(function);
+			task->graph = this;
+			task->dependencyCount = 1;
+			task->finished = false;
+			for (Task* dependency : dependencies) {
+				if (!dependency->finished) {
+					dependency->dependents.push_back(task);
+					task->dependencyCount++;
+				}
+			}
+		}
+		unfinishedTaskCount++;
+		release(task);
+		return task;
+	}
+
+	void release(Task* task) {
+		if (--task->dependencyCount == 0) {
+			jobSystem->schedule(task);
+		}
+	}
+
+	void finish(Task* task) {
+		std::vector<Task*> dependents;
+		{
+			std::lock_guard lock(mutex);
+			task->finished = true;
+			dependents.swap(task->dependents);
+		}
+		for (Task* dependent : dependents) {
+			release(dependent);
+		}
+		unfinishedTaskCount--;
+	}
+
+	void wait() {
+		while (unfinishedTaskCount > 0) {
+			if (!jobSystem->runTask()) {
+				std::this_thread::yield();
+			}
+		}
+	}
+};
+
+bool JobSystem::runTask() {
+	Task* task = popTask();
+	if (!task) {
+		return false;
+	}
+	task->function();
+	task->graph->finish(task);
+	return true;
+}
+
+void parallelMemcpy(JobSystem* jobSystem, void* dst, const void* src, uint64 size, uint64 blockSize = 1_mb) {
+	if (size <= blockSize) {
+		memcpy(dst, src, size);
+		return;
+	}
+	TaskGraph graph(jobSystem);
+	for (uint64 offset = 0; offset < size; offset += blockSize) {
+		graph.add([=] { memcpy((uint8*)dst + offset, (const uint8*)src + offset, std::min(blockSize, size - offset)); });
+	}
+	graph.wait();
+}
+
+// Two-level segregated fit allocator over an abstract [0, capacity) range, O(1) allocate and free.
+// Allocations are tagged linear (buffers) or optimal (images) so neighbours of different kinds
+// never share a bufferImageGranularity page.
+struct TLSFAllocator {
+	static constexpr uint32 slLog2 = 5;
+	static constexpr uint32 slCount = 1 << slLog2;
+	static constexpr uint32 flCount = 64 - slLog2 + 1;
+	static constexpr uint32 nullBlock = UINT32_MAX;
+	static constexpr uint64 invalidOffset = UINT64_MAX;
+
+	struct Block {
+		uint64 offset;
+		uint64 size;
+		uint32 prevPhysical;
+		uint32 nextPhysical;
+		uint32 prevFree;
+		uint32 nextFree;
+		bool free;
+		bool linear;
+	};
+	struct Stats {
+		uint64 capacity;
+		uint64 usedSize;
+		uint64 freeSize;
+		uint64 largestFreeBlock;
+		uint32 allocationCount;
+		uint32 freeBlockCount;
+		double fragmentation() const { return freeSize == 0 ? 0.0 : 1.0 - (double)largestFreeBlock / freeSize; }
+	};
+
+	uint64 capacity;
+	uint64 granularity;
+	std::vector<Block> blocks;
+	std::vector<uint32> unusedBlocks;
+	std::unordered_map<uint64, uint32> allocations;
+	uint32 firstBlock;
+	uint64 flBitmap;
+	uint32 slBitmaps[flCount];
+	uint32 freeLists[flCount][slCount];
+	uint64 usedSize;
+	uint32 freeBlockCount;
+	uint32 linearCount;
+	uint32 optimalCount;
+
+	void init(uint64 capacity, uint64 granularity = 1) {
+		assert(capacity > 0 && granularity > 0 && std::has_single_bit(granularity));
+		this->capacity = capacity;
+		this->granularity = granularity;
+		blocks.clear();
+		unusedBlocks.clear();
+		allocations.clear();
+		flBitmap = 0;
+		std::fill(std::begin(slBitmaps), std::end(slBitmaps), 0);
+		std::fill(&freeLists[0][0], &freeLists[0][0] + flCount * slCount, nullBlock);
+		usedSize = 0;
+		freeBlockCount = 0;
+		linearCount = 0;
+		optimalCount = 0;
+		firstBlock = newBlock();
+		blocks[firstBlock] = { .offset = 0, .size = capacity, .prevPhysical = nullBlock, .nextPhysical = nullBlock };
+		insertFreeBlock(firstBlock);
+	}
+
+	static void mapping(uint64 size, uint32* fl, uint32* sl) {
+		if (size < slCount) {
+			*fl = 0;
+			*sl = (uint32)size;
+		}
+		else {
+			uint32 msb = 63 - std::countl_zero(size);
+			*fl = msb - slLog2 + 1;
+			*sl = (uint32)(size >> (msb - slLog2)) ^ slCount;
+		}
+	}
+
+	uint32 newBlock() {
+		if (unusedBlocks.empty()) {
+			blocks.push_back({});
+			return (uint32)blocks.size() - 1;
+		}
+		uint32 index = unusedBlocks.back();
+		unusedBlocks.pop_back();
+		return index;
+	}
+
+	void insertFreeBlock(uint32 index) {
+		Block& block = blocks[index];
+		uint32 fl, sl;
+		mapping(block.size, &fl, &sl);
+		block.free = true;
+		block.prevFree = nullBlock;
+		block.nextFree = freeLists[fl][sl];
+		if (block.nextFree != nullBlock) {
+			blocks[block.nextFree].prevFree = index;
+		}
+		freeLists[fl][sl] = index;
+		flBitmap |= 1ull << fl;
+		slBitmaps[fl] |= 1u << sl;
+		freeBlockCount += 1;
+	}
+
+	void removeFreeBlock(uint32 index) {
+		Block& block = blocks[index];
+		uint32 fl, sl;
+		mapping(block.size, &fl, &sl);
+		if (block.prevFree != nullBlock) {
+			blocks[block.prevFree].nextFree = block.nextFree;
+		}
+		else {
+			freeLists[fl][sl] = block.nextFree;
+			if (block.nextFree == nullBlock) {
+				slBitmaps[fl] &= ~(1u << sl);
+				if (slBitmaps[fl] == 0) {
+					flBitmap &= ~(1ull << fl);
+				}
+			}
+		}
+		if (block.nextFree != nullBlock) {
+			blocks[block.nextFree].prevFree = block.prevFree;
+		}
+		block.free = false;
+		freeBlockCount -= 1;
+	}
+
+	// Any block in the returned list is at least size bytes: round the request up to the next list boundary.
+	uint32 findFreeBlock(uint64 size) {
+		if (size >= slCount) {
+			uint32 msb = 63 - std::countl_zero(size);
+			uint64 roundedSize = size + (1ull << (msb - slLog2)) - 1;
+			if (roundedSize < size) {
+				return nullBlock;
+			}
+			size = roundedSize;
+		}
+		uint32 fl, sl;
+		mapping(size, &fl, &sl);
+		uint32 slMap = slBitmaps[fl] & (~0u << sl);
+		if (slMap == 0) {
+			uint64 flMap = fl + 1 < 64 ? flBitmap & (~0ull << (fl + 1)) : 0;
+			if (flMap == 0) {
+				return nullBlock;
+			}
+			fl = std::countr_zero(flMap);
+			slMap = slBitmaps[fl];
+		}
+		sl = std::countr_zero(slMap);
+		return freeLists[fl][sl];
+	}
+
+	bool onSamePage(uint64 a, uint64 b) const {
+		return (a & ~(granularity - 1)) == (b & ~(granularity - 1));
+	}
+
+	uint64 allocate(uint64 size, uint64 alignment, bool linear) {
+		assert(size > 0 && alignment > 0 && std::has_single_bit(alignment));
+		bool granularityConflict = granularity > 1 && (linear ? optimalCount > 0 : linearCount > 0);
+		uint64 padding = alignment - 1;
+		if (granularityConflict) {
+			padding += 2 * (granularity - 1);
+		}
+		uint32 index = findFreeBlock(size + padding);
+		if (index == nullBlock) {
+			return invalidOffset;
+		}
+		removeFreeBlock(index);
+		uint64 blockOffset = blocks[index].offset;
+		uint64 blockEnd = blockOffset + blocks[index].size;
+		uint32 prev = blocks[index].prevPhysical;
+		uint32 next = blocks[index].nextPhysical;
+		uint64 offset = align(blockOffset, alignment);
+		if (granularityConflict && prev != nullBlock && blocks[prev].linear != linear && onSamePage(blocks[prev].offset + blocks[prev].size - 1, offset)) {
+			offset = align(offset, granularity);
+		}
+		uint64 end = offset + size;
+		if (granularityConflict && next != nullBlock && blocks[next].linear != linear && onSamePage(end - 1, blocks[next].offset)) {
+			end = align(end, granularity);
+		}
+		assert(end <= blockEnd);
+		if (offset > blockOffset) {
+			uint32 front = newBlock();
+			blocks[front] = { .offset = blockOffset, .size = offset - blockOffset, .prevPhysical = prev, .nextPhysical = index };
+			if (prev != nullBlock) {
+				blocks[prev].nextPhysical = front;
+			}
+			else {
+				firstBlock = front;
+			}
+			blocks[index].prevPhysical = front;
+			insertFreeBlock(front);
+		}
+		if (end < blockEnd) {
+			uint32 back = newBlock();
+			blocks[back] = { .offset = end, .size = blockEnd - end, .prevPhysical = index, .nextPhysical = next };
+			if (next != nullBlock) {
+				blocks[next].prevPhysical = back;
+			}
+			blocks[index].nextPhysical = back;
+			insertFreeBlock(back);
+		}
+		Block& block = blocks[index];
+		block.offset = offset;
+		block.size = end - offset;
+		block.linear = linear;
+		allocations[offset] = index;
+		usedSize += block.size;
+		(linear ? linearCount : optimalCount) += 1;
+		return offset;
+	}
+
+	void free(uint64 offset) {
+		auto allocation = allocations.find(offset);
+		assert(allocation != allocations.end());
+		uint32 index = allocation->second;
+		allocations.erase(allocation);
+		usedSize -= blocks[index].size;
+		(blocks[index].linear ? linearCount : optimalCount) -= 1;
+		uint32 prev = blocks[index].prevPhysical;
+		if (prev != nullBlock && blocks[prev].free) {
+			removeFreeBlock(prev);
+			blocks[prev].size += blocks[index].size;
+			mergeNextPhysical(prev, index);
+			index = prev;
+		}
+		uint32 next = blocks[index].nextPhysical;
+		if (next != nullBlock && blocks[next].free) {
+			removeFreeBlock(next);
+			blocks[index].size += blocks[next].size;
+			mergeNextPhysical(index, next);
+		}
+		insertFreeBlock(index);
+	}
+
+	void mergeNextPhysical(uint32 index, uint32 next) {
+		blocks[index].nextPhysical = blocks[next].nextPhysical;
+		if (blocks[next].nextPhysical != nullBlock) {
+			blocks[blocks[next].nextPhysical].prevPhysical = index;
+		}
+		unusedBlocks.push_back(next);
+	}
+
+	Stats stats() const {
+		Stats stats = {
+			.capacity = capacity,
+			.usedSize = usedSize,
+			.freeSize = capacity - usedSize,
+			.largestFreeBlock = 0,
+			.allocationCount = (uint32)allocations.size(),
+			.freeBlockCount = freeBlockCount
+		};
+		if (flBitmap != 0) {
+			uint32 fl = 63 - std::countl_zero(flBitmap);
+			uint32 sl = 31 - std::countl_zero(slBitmaps[fl]);
+			for (uint32 index = freeLists[fl][sl]; index != nullBlock; index = blocks[index].nextFree) {
+				stats.largestFreeBlock = std::max(stats.largestFreeBlock, blocks[index].size);
+			}
+		}
+		return stats;
+	}
+
+	// Walks the physical block list and the free lists, for the stress test.
+	bool validate() const {
+		uint64 offset = 0;
+		uint64 used = 0;
+		uint32 freeCount = 0;
+		uint32 prev = nullBlock;
+		for (uint32 index = firstBlock; index != nullBlock; index = blocks[index].nextPhysical) {
+			const Block& block = blocks[index];
+			if (block.offset != offset || block.size == 0 || block.prevPhysical != prev) return false;
+			if (block.free) {
+				if (prev != nullBlock && blocks[prev].free) return false;
+				uint32 fl, sl;
+				mapping(block.size, &fl, &sl);
+				if (!(slBitmaps[fl] & (1u << sl))) return false;
+				freeCount += 1;
+			}
+			else {
+				auto allocation = allocations.find(block.offset);
+				if (allocation == allocations.end() || allocation->second != index) return false;
+				used += block.size;
+			}
+			offset += block.size;
+			prev = index;
+		}
+		uint32 listedCount = 0;
+		for (uint32 fl = 0; fl < flCount; fl++) {
+			for (uint32 sl = 0; sl < slCount; sl++) {
+				for (uint32 index = freeLists[fl][sl]; index != nullBlock; index = blocks[index].nextFree) {
+					uint32 blockFl, blockSl;
+					mapping(blocks[index].size, &blockFl, &blockSl);
+					if (!blocks[index].free || blockFl != fl || blockSl != sl) return false;
+					listedCount += 1;
+				}
+			}
+		}
+		return offset == capacity && used == usedSize && freeCount == freeBlockCount && listedCount == freeBlockCount;
+	}
+};
+
 VkBool32 vulkanDebugCallBack(VkDebugUtilsMessageSeverityFlagBitsEXT severity, VkDebugUtilsMessageTypeFlagsEXT types, const VkDebugUtilsMessengerCallbackDataEXT* cbData, void* userData) {
 	const char* msg = cbData->pMessage;
 	__debugbreak();
@@ -108,9 +599,22 @@ PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelines = nullptr;
 PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandles = nullptr;
 PFN_vkCmdTraceRaysKHR vkCmdTraceRays = nullptr;
 PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructure = nullptr;
+PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructure = nullptr;
 PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizes = nullptr;
 PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddress = nullptr;
 PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructures = nullptr;
+PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresProperties = nullptr;
+PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructure = nullptr;
+PFN_vkCmdCopyAccelerationStructureToMemoryKHR vkCmdCopyAccelerationStructureToMemory = nullptr;
+PFN_vkCmdCopyMemoryToAccelerationStructureKHR vkCmdCopyMemoryToAccelerationStructure = nullptr;
+PFN_vkGetDeviceAccelerationStructureCompatibilityKHR vkGetDeviceAccelerationStructureCompatibility = nullptr;
+PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructures = nullptr;
+PFN_vkWriteAccelerationStructuresPropertiesKHR vkWriteAccelerationStructuresProperties = nullptr;
+PFN_vkCreateDeferredOperationKHR vkCreateDeferredOperation = nullptr;
+PFN_vkDestroyDeferredOperationKHR vkDestroyDeferredOperation = nullptr;
+PFN_vkDeferredOperationJoinKHR vkDeferredOperationJoin = nullptr;
+PFN_vkGetDeferredOperationResultKHR vkGetDeferredOperationResult = nullptr;
+PFN_vkGetDeferredOperationMaxConcurrencyKHR vkGetDeferredOperationMaxConcurrency = nullptr;
 
 void loadVkDeviceProcs(VkDevice device) {
 #define getDeviceProcAddrKHR(name) name = (PFN_##name##KHR)vkGetDeviceProcAddr(device, #name "KHR"); assert(name);
@@ -118,14 +622,36 @@ void loadVkDeviceProcs(VkDevice device) {
 	getDeviceProcAddrKHR(vkGetRayTracingShaderGroupHandles);
 	getDeviceProcAddrKHR(vkCmdTraceRays);
 	getDeviceProcAddrKHR(vkCreateAccelerationStructure);
+	getDeviceProcAddrKHR(vkDestroyAccelerationStructure);
 	getDeviceProcAddrKHR(vkGetAccelerationStructureBuildSizes);
 	getDeviceProcAddrKHR(vkGetAccelerationStructureDeviceAddress);
 	getDeviceProcAddrKHR(vkCmdBuildAccelerationStructures);
+	getDeviceProcAddrKHR(vkCmdWriteAccelerationStructuresProperties);
+	getDeviceProcAddrKHR(vkCmdCopyAccelerationStructure);
+	getDeviceProcAddrKHR(vkCmdCopyAccelerationStructureToMemory);
+	getDeviceProcAddrKHR(vkCmdCopyMemoryToAccelerationStructure);
+	getDeviceProcAddrKHR(vkGetDeviceAccelerationStructureCompatibility);
+	getDeviceProcAddrKHR(vkBuildAccelerationStructures);
+	getDeviceProcAddrKHR(vkWriteAccelerationStructuresProperties);
+	getDeviceProcAddrKHR(vkCreateDeferredOperation);
+	getDeviceProcAddrKHR(vkDestroyDeferredOperation);
+	getDeviceProcAddrKHR(vkDeferredOperationJoin);
+	getDeviceProcAddrKHR(vkGetDeferredOperationResult);
+	getDeviceProcAddrKHR(vkGetDeferredOperationMaxConcurrency);
 #undef getDeviceProcAddr
 }
 
 const int vkSwapChainImageCount = 2;
 const int vkMaxFrameInFlight = 2;
+const uint64 vkAccelerationStructureAlignment = 256;
+
+// Heaps start with a small chunk and double the chunk size as they grow, up to the max chunk size.
+const uint64 vkStagingBufferSize = 128_mb;
+const uint64 vkTexturesMemoryMinChunkSize = 8_mb;
+const uint64 vkTexturesMemoryMaxChunkSize = 256_mb;
+const uint64 vkBuffersMemoryMinChunkSize = 4_mb;
+const uint64 vkBuffersMemoryMaxChunkSize = 128_mb;
+const uint64 vkUniformBuffersMemoryChunkSize = 4_mb;
 
 struct Vulkan {
 	VkInstance instance;
@@ -155,14 +681,76 @@ struct Vulkan {
 	struct Memory {
 		VkDeviceMemory memory;
 		uint64 capacity;
+	};
+	struct MemoryHeap {
+		struct Chunk {
+			VkDeviceMemory memory;
+			uint64 capacity;
+			uint8* mappedPtr;
+			TLSFAllocator allocator;
+		};
+		const char* name;
+		uint32 memoryType;
+		VkMemoryAllocateFlags allocateFlags;
+		bool hostMapped;
+		uint64 minChunkSize;
+		uint64 maxChunkSize;
+		uint64 maxSize;
+		std::vector<Chunk> chunks;
+		uint32 chunkCount;
+		uint64 committedSize;
+		uint64 peakCommittedSize;
+	};
+	struct MemoryAllocation {
+		MemoryHeap* heap;
+		uint32 chunkIndex;
 		uint64 offset;
 	};
+	VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
 	Memory stagingBuffersMemory;
 	Memory gpuColorBuffersMemory;
-	Memory gpuTexturesMemory;
-	Memory gpuBuffersMemory;
-
+	MemoryHeap gpuTexturesMemory;
+	MemoryHeap gpuBuffersMemory;
+	MemoryHeap uniformBuffersMemory;
+	MemoryHeap hostAccelerationStructuresMemory;
+	uint64 bufferImageGranularity;
+	float timestampPeriod;
+	std::unordered_map<void*, MemoryAllocation> memoryAllocations;
+
+	struct StagingAllocation {
+		uint8* ptr;
+		uint64 offset;
+	};
+	struct StagingRegion {
+		uint64 end;
+		uint64 semaphoreValue;
+	};
+	struct TimelineCmdBuf {
+		VkCommandBuffer cmdBuf;
+		uint64 semaphoreValue;
+		uint64 waitUploadSemaphoreValue;
+	};
+	struct Timeline {
+		VkQueue queue;
+		VkCommandPool cmdPool;
+		VkSemaphore semaphore;
+		uint64 semaphoreValue;
+		std::vector<TimelineCmdBuf> cmdBufs;
+	};
 	VkBuffer stagingBuffer;
+	uint8* stagingBufferPtr;
+	uint64 stagingRingHead;
+	uint64 stagingRingTail;
+	uint64 stagingRingSubmittedHead;
+	std::deque<StagingRegion> stagingRingRegions;
+	Timeline uploadTimeline;
+	Timeline graphicsTimeline;
+	std::vector<VkImageMemoryBarrier> pendingAcquireImageBarriers;
+	std::vector<VkBufferMemoryBarrier> pendingAcquireBufferBarriers;
+	bool uploadsReleased;
+	std::vector<VkImageMemoryBarrier> acquireImageBarriers;
+	std::vector<VkBufferMemoryBarrier> acquireBufferBarriers;
+	uint64 acquireUploadSemaphoreValue;
 
 	std::pair<VkImage, VkImageView> blankTexture;
 	std::pair<VkImage, VkImageView> imguiTexture;
@@ -179,16 +767,17 @@ struct Vulkan {
 		VkSemaphore queueSemaphore;
 		VkFence queueFence;
 		VkDescriptorPool descriptorPool;
-		Memory uniformBuffersMemory;
-		uint8* uniformBuffersMappedPtr;
+		VkQueryPool pathTraceQueryPool;
+		bool pathTraceTimestampsWritten;
+		bool pathTraceAlphaMask;
 		VkBuffer rayTracingConstantBuffer;
-		uint64 rayTracingConstantBufferMemoryOffset;
+		uint8* rayTracingConstantBufferMappedPtr;
 		uint64 rayTracingConstantBufferMemorySize;
 		VkBuffer imguiVertBuffer;
-		uint64 imguiVertBufferMemoryOffset;
+		uint8* imguiVertBufferMappedPtr;
 		uint64 imguiVertBufferMemorySize;
 		VkBuffer imguiIndexBuffer;
-		uint64 imguiIndexBufferMemoryOffset;
+		uint8* imguiIndexBufferMappedPtr;
 		uint64 imguiIndexBufferMemorySize;
 	} frames[vkMaxFrameInFlight];
 	uint64 frameCount;
@@ -204,6 +793,9 @@ struct Vulkan {
 	VkPipeline imguiPipeline;
 
 	VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties;
+	VkPhysicalDeviceIDProperties physicalDeviceIDProperties;
+	bool accelerationStructureHostCommands;
+	bool textureCompressionBC;
 	VkPhysicalDeviceRayTracingPipelinePropertiesKHR pathTracePipelineProps;
 	VkDescriptorSetLayout pathTraceDescriptorSet0Layout;
 	uint32 pathTraceDescriptorSet0TextureCount;
@@ -329,9 +921,13 @@ struct Vulkan {
 			const char* enabledDeviceExtensions[] = {
 				"VK_KHR_swapchain", "VK_KHR_acceleration_structure", "VK_KHR_ray_tracing_pipeline", "VK_KHR_deferred_host_operations"
 			};
+			VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures = {
+				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+				.pNext = nullptr
+			};
 			VkPhysicalDevice16BitStorageFeatures Storage16BitsFeatures = {
 				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES,
-				.pNext = nullptr
+				.pNext = &timelineSemaphoreFeatures
 			};
 			VkPhysicalDeviceDescriptorIndexingFeatures descriptorIndexFeatures = {
 				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
@@ -359,10 +955,17 @@ struct Vulkan {
 			};
 			vkGetPhysicalDeviceFeatures2(vk->physicalDevice, &features);
 			assert(features.features.shaderSampledImageArrayDynamicIndexing);
+			assert(timelineSemaphoreFeatures.timelineSemaphore);
+			vk->accelerationStructureHostCommands = accelerationStructureFeatures.accelerationStructureHostCommands;
+			vk->textureCompressionBC = features.features.textureCompressionBC;
 
+			vk->physicalDeviceIDProperties = {
+				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+				.pNext = nullptr
+			};
 			vk->accelerationStructureProperties = {
 				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR,
-				.pNext = nullptr
+				.pNext = &vk->physicalDeviceIDProperties
 			};
 			vk->pathTracePipelineProps = {
 				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR,
@@ -374,6 +977,8 @@ struct Vulkan {
 			};
 			vkGetPhysicalDeviceProperties2(vk->physicalDevice, &properties);
 			assert(properties.properties.limits.maxDescriptorSetSampledImages > 10000);
+			vk->bufferImageGranularity = properties.properties.limits.bufferImageGranularity;
+			vk->timestampPeriod = properties.properties.limits.timestampPeriod;
 
 			float queuePriorities[3] = { 1.0f, 0.5f, 0.5f };
 			VkDeviceQueueCreateInfo queueCreateInfos[2] = {
@@ -549,7 +1154,7 @@ struct Vulkan {
 			}
 		}
 		{
-			VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
+			VkPhysicalDeviceMemoryProperties& physicalDeviceMemoryProperties = vk->physicalDeviceMemoryProperties;
 			vkGetPhysicalDeviceMemoryProperties(vk->physicalDevice, &physicalDeviceMemoryProperties);
 
 			vk->hostVisibleCoherentMemoryType = UINT32_MAX;
@@ -570,7 +1175,7 @@ struct Vulkan {
 			{
 				VkBufferCreateInfo bufferCreateInfo = {
 					.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-					.size = 512_mb,
+					.size = vkStagingBufferSize,
 					.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
 				};
 				vkCreateBuffer(vk->device, &bufferCreateInfo, nullptr, &vk->stagingBuffer);
@@ -584,35 +1189,33 @@ struct Vulkan {
 				vkAllocateMemory(vk->device, &memoryAllocateInfo, nullptr, &vk->stagingBuffersMemory.memory);
 				vkBindBufferMemory(vk->device, vk->stagingBuffer, vk->stagingBuffersMemory.memory, 0);
 				vk->stagingBuffersMemory.capacity = memoryAllocateInfo.allocationSize;
-				vk->stagingBuffersMemory.offset = memoryAllocateInfo.allocationSize;
+				vkMapMemory(vk->device, vk->stagingBuffersMemory.memory, 0, VK_WHOLE_SIZE, 0, (void**)&vk->stagingBufferPtr);
 			}
 			{
-				vk->createColorBuffers(windowWidth, windowHeight);
+				VkSemaphoreTypeCreateInfo semaphoreTypeCreateInfo = {
+					.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+					.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+					.initialValue = 0
+				};
+				VkSemaphoreCreateInfo semaphoreCreateInfo = {
+					.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+					.pNext = &semaphoreTypeCreateInfo
+				};
+				vk->uploadTimeline.queue = vk->transferQueue;
+				vk->uploadTimeline.cmdPool = vk->transferCmdPool;
+				vkCreateSemaphore(vk->device, &semaphoreCreateInfo, nullptr, &vk->uploadTimeline.semaphore);
+				vk->graphicsTimeline.queue = vk->graphicsQueue;
+				vk->graphicsTimeline.cmdPool = vk->graphicsComputeCmdPool;
+				vkCreateSemaphore(vk->device, &semaphoreCreateInfo, nullptr, &vk->graphicsTimeline.semaphore);
 			}
 			{
-				VkMemoryAllocateInfo memoryAllocateInfo = {
-					.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-					.allocationSize = 4_gb,
-					.memoryTypeIndex = vk->deviceLocalMemoryType
-				};
-				vkAllocateMemory(vk->device, &memoryAllocateInfo, nullptr, &vk->gpuTexturesMemory.memory);
-				vk->gpuTexturesMemory.capacity = memoryAllocateInfo.allocationSize;
-				vk->gpuTexturesMemory.offset = 0;
+				vk->createColorBuffers(windowWidth, windowHeight);
 			}
 			{
-				VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo = {
-					.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO,
-					.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT
-				};
-				VkMemoryAllocateInfo memoryAllocateInfo = {
-						.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-						.pNext = &memoryAllocateFlagsInfo,
-						.allocationSize = 1_gb,
-						.memoryTypeIndex = vk->deviceLocalMemoryType
-				};
-				vkAllocateMemory(vk->device, &memoryAllocateInfo, nullptr, &vk->gpuBuffersMemory.memory);
-				vk->gpuBuffersMemory.capacity = memoryAllocateInfo.allocationSize;
-				vk->gpuBuffersMemory.offset = 0;
+				vk->initMemoryHeap(&vk->gpuTexturesMemory, "gpu textures", vk->deviceLocalMemoryType, vkTexturesMemoryMinChunkSize, vkTexturesMemoryMaxChunkSize, 0);
+				vk->initMemoryHeap(&vk->gpuBuffersMemory, "gpu buffers", vk->deviceLocalMemoryType, vkBuffersMemoryMinChunkSize, vkBuffersMemoryMaxChunkSize, VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT);
+				vk->initMemoryHeap(&vk->uniformBuffersMemory, "uniform buffers", vk->hostVisibleCoherentMemoryType, vkUniformBuffersMemoryChunkSize, vkUniformBuffersMemoryChunkSize, 0);
+				vk->initMemoryHeap(&vk->hostAccelerationStructuresMemory, "host acceleration structures", vk->hostVisibleCoherentMemoryType, vkBuffersMemoryMinChunkSize, vkBuffersMemoryMaxChunkSize, VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT);
 			}
 		}
 		{
@@ -620,7 +1223,8 @@ struct Vulkan {
 				.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
 				.magFilter = VK_FILTER_LINEAR,
 				.minFilter = VK_FILTER_LINEAR,
-				.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR
+				.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+				.maxLod = VK_LOD_CLAMP_NONE
 			};
 			vkCreateSampler(vk->device, &samplerCreateInfo, nullptr, &vk->trilinearSampler);
 		}
@@ -662,28 +1266,25 @@ struct Vulkan {
 				};
 				vkCreateDescriptorPool(vk->device, &descriptorPoolCreateInfo, nullptr, &frame.descriptorPool);
 
-				VkMemoryAllocateInfo memoryAllocateInfo = {
-					.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-					.allocationSize = 64_mb,
-					.memoryTypeIndex = vk->hostVisibleCoherentMemoryType
+				VkQueryPoolCreateInfo queryPoolCreateInfo = {
+					.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+					.queryType = VK_QUERY_TYPE_TIMESTAMP,
+					.queryCount = 2
 				};
-				vkAllocateMemory(vk->device, &memoryAllocateInfo, nullptr, &frame.uniformBuffersMemory.memory);
-				frame.uniformBuffersMemory.capacity = memoryAllocateInfo.allocationSize;
-				frame.uniformBuffersMemory.offset = 0;
-
-				vkMapMemory(vk->device, frame.uniformBuffersMemory.memory, 0, VK_WHOLE_SIZE, 0, (void**)&frame.uniformBuffersMappedPtr);
+				vkCreateQueryPool(vk->device, &queryPoolCreateInfo, nullptr, &frame.pathTraceQueryPool);
+				frame.pathTraceTimestampsWritten = false;
 
 				frame.rayTracingConstantBufferMemorySize = 1_kb;
-				std::tie(frame.rayTracingConstantBuffer, frame.rayTracingConstantBufferMemoryOffset) =
-					vk->createBuffer(&frame.uniformBuffersMemory, frame.rayTracingConstantBufferMemorySize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+				std::tie(frame.rayTracingConstantBuffer, frame.rayTracingConstantBufferMappedPtr) =
+					vk->createBuffer(&vk->uniformBuffersMemory, frame.rayTracingConstantBufferMemorySize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
 
 				frame.imguiVertBufferMemorySize = 2_mb;
-				std::tie(frame.imguiVertBuffer, frame.imguiVertBufferMemoryOffset) =
-					vk->createBuffer(&frame.uniformBuffersMemory, frame.imguiVertBufferMemorySize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+				std::tie(frame.imguiVertBuffer, frame.imguiVertBufferMappedPtr) =
+					vk->createBuffer(&vk->uniformBuffersMemory, frame.imguiVertBufferMemorySize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
 
 				frame.imguiIndexBufferMemorySize = 1_mb;
-				std::tie(frame.imguiIndexBuffer, frame.imguiIndexBufferMemoryOffset) =
-					vk->createBuffer(&frame.uniformBuffersMemory, frame.imguiIndexBufferMemorySize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+				std::tie(frame.imguiIndexBuffer, frame.imguiIndexBufferMappedPtr) =
+					vk->createBuffer(&vk->uniformBuffersMemory, frame.imguiIndexBufferMemorySize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
 			}
 		}
 		{
@@ -702,118 +1303,73 @@ struct Vulkan {
 				VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT
 			);
 
-			uint64 stagingBufferSize = 4 * 16 + 4 * imguiTextureWidth * imguiTextureHeight;
-			uint8* stagingBufferPtr = nullptr;
-			vkMapMemory(vk->device, vk->stagingBuffersMemory.memory, 0, stagingBufferSize, 0, (void**)&stagingBufferPtr);
-			memset(stagingBufferPtr, UINT8_MAX, 4 * 16);
-			memcpy(stagingBufferPtr + 4 * 16, imguiTextureData, imguiTextureWidth * imguiTextureHeight * 4);
-			vkUnmapMemory(vk->device, vk->stagingBuffersMemory.memory);
-
-			auto& cmdBuf = vk->frames[vk->frameIndex].graphicsCmdBuf;
-			VkCommandBufferBeginInfo cmdBufBeginInfo = {
-				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-				.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
-			};
-			vkResetCommandBuffer(cmdBuf, 0);
-			vkBeginCommandBuffer(cmdBuf, &cmdBufBeginInfo);
+			Vulkan::StagingAllocation staging = vk->stagingAlloc(4 * 16 + 4 * imguiTextureWidth * imguiTextureHeight);
+			assert(staging.ptr);
+			memset(staging.ptr, UINT8_MAX, 4 * 16);
+			memcpy(staging.ptr + 4 * 16, imguiTextureData, imguiTextureWidth * imguiTextureHeight * 4);
 
-			VkImageMemoryBarrier imageBarriers0[] = {
-				{
+			VkCommandBuffer cmdBuf = vk->beginUploadCmdBuf();
+			VkImage uploadImages[] = { vk->blankTexture.first, vk->imguiTexture.first };
+			VkImageMemoryBarrier imageBarriers0[countof(uploadImages)];
+			for (size_t i = 0; i < countof(uploadImages); i++) {
+				imageBarriers0[i] = {
 					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
 					.srcAccessMask = 0,
 					.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
 					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 					.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-					.srcQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.dstQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.image = vk->blankTexture.first,
-					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-				},
-				{
-					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-					.srcAccessMask = 0,
-					.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-					.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-					.srcQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.dstQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.image = vk->imguiTexture.first,
-					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-				},
-				{
-					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-					.srcAccessMask = 0,
-					.dstAccessMask = 0,
-					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-					.newLayout = VK_IMAGE_LAYOUT_GENERAL,
-					.srcQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.dstQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.image = vk->accumulationColorBuffer.first,
-					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-				},
-				{
-					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-					.srcAccessMask = 0,
-					.dstAccessMask = 0,
-					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-					.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-					.srcQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.dstQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.image = vk->colorBuffer.first,
+					.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.image = uploadImages[i],
 					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-				},
-			};
+				};
+			}
 			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, countof(imageBarriers0), imageBarriers0);
 
 			VkBufferImageCopy bufferImageCopys[] = {
 				{
-					.bufferOffset = 0,
+					.bufferOffset = staging.offset,
 					.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
 					.imageExtent = { 4, 4, 1 }
 				},
 				{
-					.bufferOffset = 4 * 16,
+					.bufferOffset = staging.offset + 4 * 16,
 					.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
 					.imageExtent = { (uint32)imguiTextureWidth, (uint32)imguiTextureHeight, 1 }
 				},
 			};
 			vkCmdCopyBufferToImage(cmdBuf, vk->stagingBuffer, vk->blankTexture.first, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &bufferImageCopys[0]);
 			vkCmdCopyBufferToImage(cmdBuf, vk->stagingBuffer, vk->imguiTexture.first, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &bufferImageCopys[1]);
+			vk->releaseUploads(cmdBuf, uploadImages, {});
+			vk->submitUploadCmdBuf(cmdBuf);
 
-			VkImageMemoryBarrier ImageBarriers1[] = {
+			cmdBuf = vk->beginGraphicsCmdBuf();
+			VkImageMemoryBarrier imageBarriers1[] = {
 				{
 					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-					.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
-					.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-					.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-					.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+					.srcAccessMask = 0,
+					.dstAccessMask = 0,
+					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+					.newLayout = VK_IMAGE_LAYOUT_GENERAL,
 					.srcQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
 					.dstQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.image = vk->blankTexture.first,
+					.image = vk->accumulationColorBuffer.first,
 					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
 				},
 				{
 					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-					.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
-					.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-					.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+					.srcAccessMask = 0,
+					.dstAccessMask = 0,
+					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 					.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
 					.srcQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
 					.dstQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.image = vk->imguiTexture.first,
+					.image = vk->colorBuffer.first,
 					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
 				},
 			};
-			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT, 0, 0, nullptr, 0, nullptr, countof(ImageBarriers1), ImageBarriers1);
-
-			vkEndCommandBuffer(cmdBuf);
-			VkSubmitInfo queueSubmitInfo = {
-				.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-				.commandBufferCount = 1,
-				.pCommandBuffers = &cmdBuf
-			};
-			vkQueueSubmit(vk->graphicsQueue, 1, &queueSubmitInfo, nullptr);
-			vkQueueWaitIdle(vk->graphicsQueue);
+			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, countof(imageBarriers1), imageBarriers1);
+			vk->submitGraphicsCmdBuf(cmdBuf);
 		}
 		{
 			VkShaderModuleCreateInfo shaderModuleCreateInfo{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
@@ -966,18 +1522,21 @@ struct Vulkan {
 		}
 		{
 			vk->pathTraceDescriptorSet0TextureCount = 1024;
+			VkShaderStageFlags hitShaderStages = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_ANY_HIT_BIT_KHR;
 			VkDescriptorSetLayoutBinding descriptorSetBindings[] = {
 				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR },
-				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
-				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
-				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = hitShaderStages },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = hitShaderStages },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = hitShaderStages },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = hitShaderStages },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = hitShaderStages },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
-				{.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER, .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
-				{.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, .descriptorCount = vk->pathTraceDescriptorSet0TextureCount, .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER, .stageFlags = hitShaderStages },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, .descriptorCount = vk->pathTraceDescriptorSet0TextureCount, .stageFlags = hitShaderStages },
 			};
 			for (uint32 i = 0; i < countof(descriptorSetBindings); i++) {
 				descriptorSetBindings[i].binding = (uint32)i;
@@ -1006,11 +1565,13 @@ struct Vulkan {
 			VkPipelineShaderStageCreateInfo shaderStageCreateInfos[] = {
 				{.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR, .pName = "main" },
 				{.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_MISS_BIT_KHR, .pName = "main" },
-				{.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, .pName = "main" }
+				{.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, .pName = "main" },
+				{.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_ANY_HIT_BIT_KHR, .pName = "main" }
 			};
 			std::vector<char> rayGenShaderCode = readFile("pathTrace_rgen.spv");
 			std::vector<char> rayMissShaderCode = readFile("pathTrace_rmiss.spv");
 			std::vector<char> rayChitShaderCode = readFile("pathTrace_primary_rchit.spv");
+			std::vector<char> rayAlphaMaskAhitShaderCode = readFile("pathTrace_alphaMask_rahit.spv");
 			//std::vector<char> rayChitShaderCode = readFile("pathTrace_rchit.spv");
 
 			shaderModuleCreateInfo.codeSize = rayGenShaderCode.size();
@@ -1022,6 +1583,9 @@ struct Vulkan {
 			shaderModuleCreateInfo.codeSize = rayChitShaderCode.size();
 			shaderModuleCreateInfo.pCode = (uint32*)rayChitShaderCode.data();
 			vkCreateShaderModule(vk->device, &shaderModuleCreateInfo, nullptr, &shaderStageCreateInfos[2].shaderModule);
+			shaderModuleCreateInfo.codeSize = rayAlphaMaskAhitShaderCode.size();
+			shaderModuleCreateInfo.pCode = (uint32*)rayAlphaMaskAhitShaderCode.data();
+			vkCreateShaderModule(vk->device, &shaderModuleCreateInfo, nullptr, &shaderStageCreateInfos[3].shaderModule);
 
 			VkRayTracingShaderGroupCreateInfoKHR shaderGroups[] = {
 				{
@@ -1047,6 +1611,14 @@ struct Vulkan {
 					.closestHitShader = 2,
 					.anyHitShader = VK_SHADER_UNUSED_KHR,
 					.intersectionShader = VK_SHADER_UNUSED_KHR
+				},
+				{
+					.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+					.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR,
+					.generalShader = VK_SHADER_UNUSED_KHR,
+					.closestHitShader = 2,
+					.anyHitShader = 3,
+					.intersectionShader = VK_SHADER_UNUSED_KHR
 				}
 			};
 
@@ -1070,41 +1642,31 @@ struct Vulkan {
 				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
 			).first;
 
-			uint8* stagingBufferMappedMemory = nullptr;
-			vkMapMemory(vk->device, vk->stagingBuffersMemory.memory, 0, sbtBufferSize, 0, (void**)&stagingBufferMappedMemory);
+			Vulkan::StagingAllocation staging = vk->stagingAlloc(sbtBufferSize);
+			assert(staging.ptr);
 			for (size_t i = 0; i < countof(shaderGroups); i++) {
 				memcpy(
-					stagingBufferMappedMemory + i * alignedGroupSize,
+					staging.ptr + i * alignedGroupSize,
 					shaderGroupHandles.data() + i * vk->pathTracePipelineProps.shaderGroupHandleSize,
 					vk->pathTracePipelineProps.shaderGroupHandleSize
 				);
 			}
-			vkUnmapMemory(vk->device, vk->stagingBuffersMemory.memory);
-			VkCommandBufferBeginInfo beginInfo = {
-				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
-			};
-
-			auto& cmdBuf = vk->frames[vk->frameIndex].graphicsCmdBuf;
-			vkResetCommandBuffer(cmdBuf, 0);
-			vkBeginCommandBuffer(cmdBuf, &beginInfo);
+			VkCommandBuffer cmdBuf = vk->beginUploadCmdBuf();
 			VkBufferCopy bufferCopy = {
-				.srcOffset = 0, .dstOffset = 0, .size = sbtBufferSize
+				.srcOffset = staging.offset, .dstOffset = 0, .size = sbtBufferSize
 			};
 			vkCmdCopyBuffer(cmdBuf, vk->stagingBuffer, vk->pathTraceSBTBuffer, 1, &bufferCopy);
-			vkEndCommandBuffer(cmdBuf);
-			VkSubmitInfo submitInfo = {
-				.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO, .commandBufferCount = 1, .pCommandBuffers = &cmdBuf
-			};
-			vkQueueSubmit(vk->graphicsQueue, 1, &submitInfo, nullptr);
-			vkQueueWaitIdle(vk->graphicsQueue);
+			vk->releaseUploads(cmdBuf, {}, std::span(&vk->pathTraceSBTBuffer, 1));
+			vk->submitUploadCmdBuf(cmdBuf);
 
 			VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
 				.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, .buffer = vk->pathTraceSBTBuffer
 			};
 			VkDeviceAddress sbtBasedAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
-			vk->pathTraceSBTBufferRayGenDeviceAddress = { sbtBasedAddress, 0, 0 };
-			vk->pathTraceSBTBufferMissDeviceAddress = { sbtBasedAddress + alignedGroupSize, 0, 0 };
-			vk->pathTraceSBTBufferHitGroupDeviceAddress = { sbtBasedAddress + alignedGroupSize * 2, 0, 0 };
+			vk->pathTraceSBTBufferRayGenDeviceAddress = { sbtBasedAddress, alignedGroupSize, alignedGroupSize };
+			vk->pathTraceSBTBufferMissDeviceAddress = { sbtBasedAddress + alignedGroupSize, alignedGroupSize, alignedGroupSize };
+			// Hit group 0 is opaque only, hit group 1 adds the alpha mask any-hit and is selected per instance through the SBT record offset.
+			vk->pathTraceSBTBufferHitGroupDeviceAddress = { sbtBasedAddress + alignedGroupSize * 2, alignedGroupSize, alignedGroupSize * 2 };
 			vk->pathTraceSBTBufferCallableDeviceAddress = { 0, 0, 0 };
 		}
 
@@ -1152,10 +1714,7 @@ struct Vulkan {
 		gpuColorBuffersMemory.capacity = memoryAllocateInfo.allocationSize;
 
 		vkBindImageMemory(device, accumulationColorBuffer.first, gpuColorBuffersMemory.memory, 0);
-		gpuColorBuffersMemory.offset = align(MemoryRequirements[0].size, MemoryRequirements[1].alignment);
-		vkBindImageMemory(device, colorBuffer.first, gpuColorBuffersMemory.memory, gpuColorBuffersMemory.offset);
-		gpuColorBuffersMemory.offset += MemoryRequirements[1].size;
-		assert(gpuColorBuffersMemory.offset == gpuColorBuffersMemory.capacity);
+		vkBindImageMemory(device, colorBuffer.first, gpuColorBuffersMemory.memory, align(MemoryRequirements[0].size, MemoryRequirements[1].alignment));
 
 		VkImageViewCreateInfo imageViewCreateInfos[2] = {
 			{
@@ -1189,7 +1748,101 @@ struct Vulkan {
 		vkCreateImageView(device, &imageViewCreateInfos[1], nullptr, &colorBuffer.second);
 	}
 
-	std::pair<VkBuffer, uint64> createBuffer(Vulkan::Memory* memory, uint64 size, VkBufferUsageFlags usageFlags) {
+	void initMemoryHeap(MemoryHeap* heap, const char* name, uint32 memoryType, uint64 minChunkSize, uint64 maxChunkSize, VkMemoryAllocateFlags allocateFlags) {
+		VkMemoryType& type = physicalDeviceMemoryProperties.memoryTypes[memoryType];
+		*heap = {
+			.name = name,
+			.memoryType = memoryType,
+			.allocateFlags = allocateFlags,
+			.hostMapped = (type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0,
+			.minChunkSize = minChunkSize,
+			.maxChunkSize = maxChunkSize,
+			.maxSize = physicalDeviceMemoryProperties.memoryHeaps[type.heapIndex].size
+		};
+	}
+
+	MemoryAllocation allocateMemory(MemoryHeap* heap, const VkMemoryRequirements& requirements, bool linear) {
+		assert(requirements.memoryTypeBits & (1 << heap->memoryType));
+		for (uint32 chunkIndex = 0; chunkIndex < heap->chunks.size(); chunkIndex++) {
+			auto& chunk = heap->chunks[chunkIndex];
+			if (chunk.memory) {
+				uint64 offset = chunk.allocator.allocate(requirements.size, requirements.alignment, linear);
+				if (offset != TLSFAllocator::invalidOffset) {
+					return { heap, chunkIndex, offset };
+				}
+			}
+		}
+		uint64 chunkSize = std::min(heap->minChunkSize << std::min(heap->chunkCount, 16u), heap->maxChunkSize);
+		chunkSize = std::max(chunkSize, align(requirements.size, heap->minChunkSize));
+		assert(heap->committedSize + chunkSize <= heap->maxSize);
+		uint32 chunkIndex = 0;
+		while (chunkIndex < heap->chunks.size() && heap->chunks[chunkIndex].memory) {
+			chunkIndex += 1;
+		}
+		if (chunkIndex == heap->chunks.size()) {
+			heap->chunks.emplace_back();
+		}
+		auto& chunk = heap->chunks[chunkIndex];
+		VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO,
+			.flags = heap->allocateFlags
+		};
+		VkMemoryAllocateInfo memoryAllocateInfo = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.pNext = heap->allocateFlags ? &memoryAllocateFlagsInfo : nullptr,
+			.allocationSize = chunkSize,
+			.memoryTypeIndex = heap->memoryType
+		};
+		assert(vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &chunk.memory) == VK_SUCCESS);
+		chunk.capacity = chunkSize;
+		chunk.mappedPtr = nullptr;
+		if (heap->hostMapped) {
+			vkMapMemory(device, chunk.memory, 0, VK_WHOLE_SIZE, 0, (void**)&chunk.mappedPtr);
+		}
+		chunk.allocator.init(chunkSize, bufferImageGranularity);
+		heap->chunkCount += 1;
+		heap->committedSize += chunkSize;
+		heap->peakCommittedSize = std::max(heap->peakCommittedSize, heap->committedSize);
+		uint64 offset = chunk.allocator.allocate(requirements.size, requirements.alignment, linear);
+		assert(offset != TLSFAllocator::invalidOffset);
+		return { heap, chunkIndex, offset };
+	}
+
+	// Empty chunks go back to the driver, except the last one so a heap does not thrash around zero.
+	void freeMemory(const MemoryAllocation& allocation) {
+		MemoryHeap* heap = allocation.heap;
+		auto& chunk = heap->chunks[allocation.chunkIndex];
+		chunk.allocator.free(allocation.offset);
+		if (chunk.allocator.allocations.empty() && heap->chunkCount > 1) {
+			vkFreeMemory(device, chunk.memory, nullptr);
+			chunk.memory = VK_NULL_HANDLE;
+			chunk.mappedPtr = nullptr;
+			heap->chunkCount -= 1;
+			heap->committedSize -= chunk.capacity;
+		}
+	}
+
+	void printMemoryReport() {
+		for (MemoryHeap* heap : { &gpuTexturesMemory, &gpuBuffersMemory, &uniformBuffersMemory, &hostAccelerationStructuresMemory }) {
+			uint64 usedSize = 0;
+			uint64 freeSize = 0;
+			uint64 largestFreeBlock = 0;
+			for (auto& chunk : heap->chunks) {
+				if (chunk.memory) {
+					TLSFAllocator::Stats stats = chunk.allocator.stats();
+					usedSize += stats.usedSize;
+					freeSize += stats.freeSize;
+					largestFreeBlock = std::max(largestFreeBlock, stats.largestFreeBlock);
+				}
+			}
+			printf("memory heap \"%s\": %.1f MB used, %.1f MB committed in %u chunks, peak %.1f MB, fragmentation %.3f\n",
+				heap->name, usedSize / (double)1_mb, heap->committedSize / (double)1_mb, heap->chunkCount, heap->peakCommittedSize / (double)1_mb,
+				freeSize == 0 ? 0.0 : 1.0 - (double)largestFreeBlock / freeSize);
+		}
+		printf("memory: staging ring %.1f MB, color buffers %.1f MB\n", stagingBuffersMemory.capacity / (double)1_mb, gpuColorBuffersMemory.capacity / (double)1_mb);
+	}
+
+	std::pair<VkBuffer, uint8*> createBuffer(MemoryHeap* heap, uint64 size, VkBufferUsageFlags usageFlags) {
 		VkBufferCreateInfo bufferCreateInfo = {
 			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
 			.size = size,
@@ -1199,20 +1852,28 @@ struct Vulkan {
 		vkCreateBuffer(device, &bufferCreateInfo, nullptr, &buffer);
 		VkMemoryRequirements memoryRequirements;
 		vkGetBufferMemoryRequirements(device, buffer, &memoryRequirements);
-		memory->offset = align(memory->offset, memoryRequirements.alignment);
-		uint64 offset = memory->offset;
-		vkBindBufferMemory(device, buffer, memory->memory, memory->offset);
-		memory->offset += memoryRequirements.size;
-		return std::make_pair(buffer, offset);
+		MemoryAllocation allocation = allocateMemory(heap, memoryRequirements, true);
+		auto& chunk = heap->chunks[allocation.chunkIndex];
+		vkBindBufferMemory(device, buffer, chunk.memory, allocation.offset);
+		memoryAllocations[buffer] = allocation;
+		return std::make_pair(buffer, chunk.mappedPtr ? chunk.mappedPtr + allocation.offset : nullptr);
+	}
+
+	void destroyBuffer(VkBuffer buffer) {
+		auto allocation = memoryAllocations.find(buffer);
+		assert(allocation != memoryAllocations.end());
+		vkDestroyBuffer(device, buffer, nullptr);
+		freeMemory(allocation->second);
+		memoryAllocations.erase(allocation);
 	}
 
-	VkImage createImage2D(Vulkan::Memory* memory, uint32 width, uint32 height, VkFormat format, VkImageUsageFlags usageFlags) {
+	VkImage createImage2D(MemoryHeap* heap, uint32 width, uint32 height, VkFormat format, VkImageUsageFlags usageFlags, uint32 mipLevels = 1) {
 		VkImageCreateInfo imageCreateInfo = {
 			.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
 			.imageType = VK_IMAGE_TYPE_2D,
 			.format = format,
 			.extent = { width, height, 1 },
-			.mipLevels = 1,
+			.mipLevels = mipLevels,
 			.arrayLayers = 1,
 			.samples = VK_SAMPLE_COUNT_1_BIT,
 			.tiling = VK_IMAGE_TILING_OPTIMAL,
@@ -1223,15 +1884,23 @@ struct Vulkan {
 		vkCreateImage(device, &imageCreateInfo, nullptr, &image);
 		VkMemoryRequirements memoryRequirement;
 		vkGetImageMemoryRequirements(device, image, &memoryRequirement);
-		memory->offset = align(memory->offset, memoryRequirement.alignment);
-		vkBindImageMemory(device, image, memory->memory, memory->offset);
-		memory->offset += memoryRequirement.size;
+		MemoryAllocation allocation = allocateMemory(heap, memoryRequirement, false);
+		vkBindImageMemory(device, image, heap->chunks[allocation.chunkIndex].memory, allocation.offset);
+		memoryAllocations[image] = allocation;
 
 		return image;
 	}
 
-	std::pair<VkImage, VkImageView> createImage2DAndView(Vulkan::Memory* memory, uint32 width, uint32 height, VkFormat format, VkImageAspectFlags aspectFlags, VkImageUsageFlags usageFlags) {
-		VkImage image = createImage2D(memory, width, height, format, usageFlags);
+	void destroyImage(VkImage image) {
+		auto allocation = memoryAllocations.find(image);
+		assert(allocation != memoryAllocations.end());
+		vkDestroyImage(device, image, nullptr);
+		freeMemory(allocation->second);
+		memoryAllocations.erase(allocation);
+	}
+
+	std::pair<VkImage, VkImageView> createImage2DAndView(MemoryHeap* heap, uint32 width, uint32 height, VkFormat format, VkImageAspectFlags aspectFlags, VkImageUsageFlags usageFlags, uint32 mipLevels = 1) {
+		VkImage image = createImage2D(heap, width, height, format, usageFlags, mipLevels);
 		VkImageViewCreateInfo imageViewCreateInfo = {
 			.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
 			.image = image,
@@ -1240,7 +1909,7 @@ struct Vulkan {
 			.subresourceRange = {
 				.aspectMask = aspectFlags,
 				.baseMipLevel = 0,
-				.levelCount = 1,
+				.levelCount = mipLevels,
 				.baseArrayLayer = 0,
 				.layerCount = 1
 			}
@@ -1250,11 +1919,283 @@ struct Vulkan {
 		return std::make_pair(image, imageView);
 	}
 
-	void handleWindowResize(uint windowWidth, uint windowHeight) {
-		vkQueueWaitIdle(graphicsQueue);
+	uint64 completedSemaphoreValue(Timeline& timeline) {
+		uint64 value;
+		vkGetSemaphoreCounterValue(device, timeline.semaphore, &value);
+		return value;
+	}
 
-		vkDestroySwapchainKHR(device, swapChain, nullptr);
-		for (size_t i = 0; i < countof(swapChainImageFramebuffers); i++) {
+	void waitSemaphore(Timeline& timeline, uint64 value) {
+		VkSemaphoreWaitInfo semaphoreWaitInfo = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+			.semaphoreCount = 1,
+			.pSemaphores = &timeline.semaphore,
+			.pValues = &value
+		};
+		vkWaitSemaphores(device, &semaphoreWaitInfo, UINT64_MAX);
+	}
+
+	// Staging ring positions grow monotonically, the buffer offset is position % capacity.
+	// Returns a null ptr when the only way to free space is to submit the caller's pending uploads.
+	StagingAllocation stagingAlloc(uint64 size, uint64 alignment = 16) {
+		uint64 capacity = stagingBuffersMemory.capacity;
+		assert(size <= capacity);
+		while (true) {
+			uint64 begin = align(stagingRingHead, alignment);
+			if (begin % capacity + size > capacity) {
+				begin = align(begin, capacity);
+			}
+			if (begin + size - stagingRingTail <= capacity) {
+				stagingRingHead = begin + size;
+				return { stagingBufferPtr + begin % capacity, begin % capacity };
+			}
+			if (stagingRingRegions.empty()) {
+				if (stagingRingHead != stagingRingTail) {
+					return {};
+				}
+				stagingRingHead = stagingRingTail = stagingRingSubmittedHead = align(stagingRingHead, capacity);
+				continue;
+			}
+			uint64 completedValue = completedSemaphoreValue(uploadTimeline);
+			if (stagingRingRegions.front().semaphoreValue > completedValue) {
+				waitSemaphore(uploadTimeline, stagingRingRegions.front().semaphoreValue);
+				completedValue = completedSemaphoreValue(uploadTimeline);
+			}
+			while (!stagingRingRegions.empty() && stagingRingRegions.front().semaphoreValue <= completedValue) {
+				stagingRingTail = stagingRingRegions.front().end;
+				stagingRingRegions.pop_front();
+			}
+		}
+	}
+
+	TimelineCmdBuf* beginTimelineCmdBuf(Timeline& timeline) {
+		uint64 completedValue = completedSemaphoreValue(timeline);
+		auto timelineCmdBuf = std::find_if(timeline.cmdBufs.begin(), timeline.cmdBufs.end(), [completedValue](const TimelineCmdBuf& cmdBuf) {
+			return cmdBuf.semaphoreValue <= completedValue;
+		});
+		if (timelineCmdBuf == timeline.cmdBufs.end()) {
+			VkCommandBufferAllocateInfo commandBufferAllocInfo = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+				.commandPool = timeline.cmdPool,
+				.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+				.commandBufferCount = 1
+			};
+			timelineCmdBuf = timeline.cmdBufs.insert(timeline.cmdBufs.end(), TimelineCmdBuf{});
+			vkAllocateCommandBuffers(device, &commandBufferAllocInfo, &timelineCmdBuf->cmdBuf);
+		}
+		timelineCmdBuf->semaphoreValue = UINT64_MAX;
+		timelineCmdBuf->waitUploadSemaphoreValue = 0;
+		VkCommandBufferBeginInfo cmdBufBeginInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+			.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+		};
+		vkResetCommandBuffer(timelineCmdBuf->cmdBuf, 0);
+		vkBeginCommandBuffer(timelineCmdBuf->cmdBuf, &cmdBufBeginInfo);
+		return &*timelineCmdBuf;
+	}
+
+	uint64 submitTimelineCmdBuf(Timeline& timeline, VkCommandBuffer cmdBuf) {
+		auto timelineCmdBuf = std::find_if(timeline.cmdBufs.begin(), timeline.cmdBufs.end(), [cmdBuf](const TimelineCmdBuf& timelineCmdBuf) {
+			return timelineCmdBuf.cmdBuf == cmdBuf;
+		});
+		assert(timelineCmdBuf != timeline.cmdBufs.end());
+		vkEndCommandBuffer(cmdBuf);
+		timeline.semaphoreValue += 1;
+		timelineCmdBuf->semaphoreValue = timeline.semaphoreValue;
+		VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+		VkTimelineSemaphoreSubmitInfo timelineSubmitInfo = {
+			.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+			.waitSemaphoreValueCount = timelineCmdBuf->waitUploadSemaphoreValue ? 1u : 0u,
+			.pWaitSemaphoreValues = &timelineCmdBuf->waitUploadSemaphoreValue,
+			.signalSemaphoreValueCount = 1,
+			.pSignalSemaphoreValues = &timeline.semaphoreValue
+		};
+		VkSubmitInfo submitInfo = {
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			.pNext = &timelineSubmitInfo,
+			.waitSemaphoreCount = timelineCmdBuf->waitUploadSemaphoreValue ? 1u : 0u,
+			.pWaitSemaphores = &uploadTimeline.semaphore,
+			.pWaitDstStageMask = &waitStage,
+			.commandBufferCount = 1,
+			.pCommandBuffers = &cmdBuf,
+			.signalSemaphoreCount = 1,
+			.pSignalSemaphores = &timeline.semaphore
+		};
+		vkQueueSubmit(timeline.queue, 1, &submitInfo, nullptr);
+		return timeline.semaphoreValue;
+	}
+
+	VkCommandBuffer beginUploadCmdBuf() {
+		return beginTimelineCmdBuf(uploadTimeline)->cmdBuf;
+	}
+
+	uint64 submitUploadCmdBuf(VkCommandBuffer cmdBuf) {
+		uint64 value = submitTimelineCmdBuf(uploadTimeline, cmdBuf);
+		if (stagingRingHead > stagingRingSubmittedHead) {
+			stagingRingRegions.push_back(StagingRegion{ .end = stagingRingHead, .semaphoreValue = value });
+			stagingRingSubmittedHead = stagingRingHead;
+		}
+		if (uploadsReleased) {
+			uploadsReleased = false;
+			acquireImageBarriers.insert(acquireImageBarriers.end(), pendingAcquireImageBarriers.begin(), pendingAcquireImageBarriers.end());
+			acquireBufferBarriers.insert(acquireBufferBarriers.end(), pendingAcquireBufferBarriers.begin(), pendingAcquireBufferBarriers.end());
+			pendingAcquireImageBarriers.clear();
+			pendingAcquireBufferBarriers.clear();
+			acquireUploadSemaphoreValue = value;
+		}
+		return value;
+	}
+
+	// Graphics command buffers acquire every upload released since the previous acquire and wait for it on the gpu.
+	VkCommandBuffer beginGraphicsCmdBuf() {
+		TimelineCmdBuf* timelineCmdBuf = beginTimelineCmdBuf(graphicsTimeline);
+		timelineCmdBuf->waitUploadSemaphoreValue = acquireUploads(timelineCmdBuf->cmdBuf);
+		return timelineCmdBuf->cmdBuf;
+	}
+
+	uint64 submitGraphicsCmdBuf(VkCommandBuffer cmdBuf) {
+		return submitTimelineCmdBuf(graphicsTimeline, cmdBuf);
+	}
+
+	// Records the transfer queue half of a queue family ownership transfer of freshly uploaded images and buffers,
+	// images end up in SHADER_READ_ONLY_OPTIMAL. The graphics queue half is recorded by acquireUploads.
+	void releaseUploads(VkCommandBuffer uploadCmdBuf, std::span<const VkImage> images, std::span<const VkBuffer> buffers) {
+		bool ownershipTransfer = transferQueueFamilyIndex != graphicsComputeQueueFamilyIndex;
+		std::vector<VkImageMemoryBarrier> imageBarriers(images.size());
+		for (size_t i = 0; i < images.size(); i++) {
+			imageBarriers[i] = {
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+				.dstAccessMask = 0,
+				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+				.srcQueueFamilyIndex = ownershipTransfer ? transferQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = ownershipTransfer ? graphicsComputeQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED,
+				.image = images[i],
+				.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1 }
+			};
+		}
+		std::vector<VkBufferMemoryBarrier> bufferBarriers;
+		if (ownershipTransfer) {
+			for (VkBuffer buffer : buffers) {
+				VkBufferMemoryBarrier bufferBarrier = {
+					.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+					.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+					.dstAccessMask = 0,
+					.srcQueueFamilyIndex = transferQueueFamilyIndex,
+					.dstQueueFamilyIndex = graphicsComputeQueueFamilyIndex,
+					.buffer = buffer,
+					.offset = 0,
+					.size = VK_WHOLE_SIZE
+				};
+				bufferBarriers.push_back(bufferBarrier);
+			}
+		}
+		vkCmdPipelineBarrier(uploadCmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, (uint32)bufferBarriers.size(), bufferBarriers.data(), (uint32)imageBarriers.size(), imageBarriers.data());
+		if (ownershipTransfer) {
+			for (auto& barrier : imageBarriers) {
+				barrier.srcAccessMask = 0;
+				barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			}
+			for (auto& barrier : bufferBarriers) {
+				barrier.srcAccessMask = 0;
+				barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+			}
+			pendingAcquireImageBarriers.insert(pendingAcquireImageBarriers.end(), imageBarriers.begin(), imageBarriers.end());
+			pendingAcquireBufferBarriers.insert(pendingAcquireBufferBarriers.end(), bufferBarriers.begin(), bufferBarriers.end());
+		}
+		uploadsReleased = true;
+	}
+
+	// Returns the upload semaphore value the command buffer's submission has to wait for, 0 if none.
+	uint64 acquireUploads(VkCommandBuffer cmdBuf) {
+		if (!acquireImageBarriers.empty() || !acquireBufferBarriers.empty()) {
+			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+				VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+				0, 0, nullptr, (uint32)acquireBufferBarriers.size(), acquireBufferBarriers.data(), (uint32)acquireImageBarriers.size(), acquireImageBarriers.data());
+		}
+		acquireImageBarriers.clear();
+		acquireBufferBarriers.clear();
+		uint64 value = acquireUploadSemaphoreValue;
+		acquireUploadSemaphoreValue = 0;
+		return value;
+	}
+
+	bool formatSupportsBlit(VkFormat format) {
+		VkFormatProperties properties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+		VkFormatFeatureFlags features = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+		return (properties.optimalTilingFeatures & features) == features;
+	}
+
+	// Fills mips 1 and up of a SHADER_READ_ONLY_OPTIMAL image by blitting each mip from the previous one,
+	// the image is SHADER_READ_ONLY_OPTIMAL again afterwards. Needs a graphics queue command buffer.
+	void recordMipBlits(VkCommandBuffer cmdBuf, VkImage image, uint32 width, uint32 height, uint32 mipLevels) {
+		VkImageMemoryBarrier barriers[2] = {
+			{
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.srcAccessMask = 0,
+				.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+				.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+				.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = image,
+				.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+			},
+			{
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.srcAccessMask = 0,
+				.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+				.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+				.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = image,
+				.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 1, VK_REMAINING_MIP_LEVELS, 0, 1 }
+			}
+		};
+		vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+		for (uint32 level = 1; level < mipLevels; level++) {
+			VkImageBlit blit = {
+				.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1 },
+				.srcOffsets = { { 0, 0, 0 }, { (int32)std::max(width >> (level - 1), 1u), (int32)std::max(height >> (level - 1), 1u), 1 } },
+				.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 },
+				.dstOffsets = { { 0, 0, 0 }, { (int32)std::max(width >> level, 1u), (int32)std::max(height >> level, 1u), 1 } }
+			};
+			vkCmdBlitImage(cmdBuf, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+			VkImageMemoryBarrier barrier = {
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+				.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = image,
+				.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1 }
+			};
+			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+		}
+		VkImageMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+			.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = image,
+			.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1 }
+		};
+		vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+	}
+
+	void handleWindowResize(uint windowWidth, uint windowHeight) {
+		vkQueueWaitIdle(graphicsQueue);
+
+		vkDestroySwapchainKHR(device, swapChain, nullptr);
+		for (size_t i = 0; i < countof(swapChainImageFramebuffers); i++) {
 			auto& imageFramebuffer = swapChainImageFramebuffers[i];
 			vkDestroyFramebuffer(device, imageFramebuffer.frameBuffer, nullptr);
 		}
@@ -1371,6 +2312,9 @@ struct Image {
 	VkFormat format;
 	uint32 size;
 	uint8* data;
+	uint32 components; // channels in the source file, 0 when loaded from the scene cache
+	uint32 mipLevels;
+	uint32 storedMipLevels; // mips present in data, the rest are generated on the gpu
 };
 
 struct Model {
@@ -1378,6 +2322,7 @@ struct Model {
 	std::filesystem::path filePath;
 	cgltf_data* gltfData;
 	std::vector<Image> images;
+	std::vector<uint64> imageHashes;
 };
 
 struct Light {
@@ -1408,6 +2353,24 @@ XMMATRIX getNodeTransformMat(cgltf_node* node) {
 	}
 }
 
+uint8* accessorData(cgltf_accessor* accessor) {
+	return (uint8*)(accessor->buffer_view->buffer->data) + accessor->buffer_view->offset + accessor->offset;
+}
+
+template <typename T>
+void readIndices(cgltf_accessor* accessor, T* dst) {
+	uint8* src = accessorData(accessor);
+	if (accessor->component_type == cgltf_component_type_r_8u) {
+		std::copy_n(src, accessor->count, dst);
+	}
+	else if (accessor->component_type == cgltf_component_type_r_16u) {
+		std::copy_n((uint16*)src, accessor->count, dst);
+	}
+	else {
+		std::copy_n((uint32*)src, accessor->count, dst);
+	}
+}
+
 struct PrimitiveVerticesData {
 	cgltf_accessor* indices;
 	cgltf_accessor* positions;
@@ -1415,6 +2378,41 @@ struct PrimitiveVerticesData {
 	cgltf_accessor* uvs;
 };
 
+PrimitiveVerticesData getPrimitiveVerticesData(cgltf_primitive& primitive) {
+	PrimitiveVerticesData data = { .indices = primitive.indices };
+	assert(primitive.type == cgltf_primitive_type_triangles);
+	assert(data.indices->component_type == cgltf_component_type_r_8u || data.indices->component_type == cgltf_component_type_r_16u || data.indices->component_type == cgltf_component_type_r_32u);
+	assert(data.indices->type == cgltf_type_scalar);
+	assert(data.indices->count % 3 == 0);
+	assert(data.indices->stride == cgltf_calc_size(data.indices->type, data.indices->component_type));
+	assert(data.indices->buffer_view->buffer->data);
+	for (size_t attribIndex = 0; attribIndex < primitive.attributes_count; attribIndex++) {
+		auto& attribute = primitive.attributes[attribIndex];
+		if (attribute.type == cgltf_attribute_type_position) {
+			assert(attribute.data->component_type == cgltf_component_type_r_32f);
+			assert(attribute.data->type == cgltf_type_vec3);
+			assert(attribute.data->buffer_view->buffer->data);
+			data.positions = attribute.data;
+		}
+		if (attribute.type == cgltf_attribute_type_normal) {
+			assert(attribute.data->component_type == cgltf_component_type_r_32f);
+			assert(attribute.data->type == cgltf_type_vec3);
+			assert(attribute.data->buffer_view->buffer->data);
+			data.normals = attribute.data;
+		}
+		if (attribute.type == cgltf_attribute_type_texcoord) {
+			assert(attribute.data->component_type == cgltf_component_type_r_32f);
+			assert(attribute.data->type == cgltf_type_vec2);
+			assert(attribute.data->buffer_view->buffer->data);
+			data.uvs = attribute.data;
+		}
+	}
+	assert(data.positions);
+	assert(data.normals);
+	//assert(data.uvs);
+	return data;
+}
+
 struct Vertex {
 	float position[4];
 	float normal[4];
@@ -1422,632 +2420,4242 @@ struct Vertex {
 	float pad0[2];
 };
 
-struct Geometry {
-	uint32 vertexOffset;
-	uint32 indexOffset;
-	uint32 materialIndex;
-	uint32 pad0;
+// GPU vertex layout: float3 position (also the BLAS build input), octahedron encoded snorm16x2 normal, half2 uv.
+struct PackedVertex {
+	float position[3];
+	uint32 normal;
+	uint32 uv;
 };
 
-struct Instance {
-	float transform[4][4];
-	float transformIT[4][4];
-	uint32 geometryOffset;
-	uint32 pad0[3];
-};
+uint32 packNormal(const float* normal) {
+	float length = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+	if (length == 0) {
+		return 0;
+	}
+	float u = normal[0] / length;
+	float v = normal[1] / length;
+	if (normal[2] < 0) {
+		float foldedU = (1.0f - fabsf(v)) * (u >= 0 ? 1.0f : -1.0f);
+		float foldedV = (1.0f - fabsf(u)) * (v >= 0 ? 1.0f : -1.0f);
+		u = foldedU;
+		v = foldedV;
+	}
+	int16 snormU = (int16)lrintf(std::clamp(u, -1.0f, 1.0f) * 32767.0f);
+	int16 snormV = (int16)lrintf(std::clamp(v, -1.0f, 1.0f) * 32767.0f);
+	return (uint32)(uint16)snormU | ((uint32)(uint16)snormV << 16);
+}
 
-struct Material {
-	float baseColorFactor[4];
-	float emissiveFactor[4];
-	uint32 baseColorTextureIndex;
-	uint32 emissiveTextureIndex;
-	uint32 pad0[2];
+PackedVertex packVertex(const Vertex& vertex) {
+	return {
+		.position = { vertex.position[0], vertex.position[1], vertex.position[2] },
+		.normal = packNormal(vertex.normal),
+		.uv = (uint32)PackedVector::XMConvertFloatToHalf(vertex.uv[0]) | ((uint32)PackedVector::XMConvertFloatToHalf(vertex.uv[1]) << 16)
+	};
+}
+
+// Conversion kernels. SSE4.1 is the baseline (DirectXMath is built with _XM_SSE4_INTRINSICS_),
+// AVX2 paths are picked at runtime and the scalar paths are the reference the benchmark checks against.
+enum class SimdLevel {
+	Scalar,
+	SSE41,
+	AVX2
 };
 
-struct Scene {
-	std::filesystem::path filePath;
-	Camera camera;
-	std::vector<Model> models;
-	std::vector<Light> lights;
+const char* simdLevelNames[] = { "scalar", "sse4.1", "avx2" };
+
+SimdLevel detectSimdLevel() {
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = info[2] & (1 << 27);
+	bool avx = info[2] & (1 << 28);
+	bool f16c = info[2] & (1 << 29);
+	if (osxsave && avx && f16c && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) {
+			return SimdLevel::AVX2;
+		}
+	}
+	return SimdLevel::SSE41;
+}
 
-	VkBuffer verticesBuffer;
-	VkBuffer indicesBuffer;
-	VkBuffer geometriesBuffer;
-	VkBuffer materialsBuffer;
-	VkBuffer instancesBuffer;
-	std::vector<std::pair<VkImage, VkImageView>> textures;
+const SimdLevel cpuSimdLevel = detectSimdLevel();
 
-	VkBuffer blasBuffer;
-	std::vector<VkAccelerationStructureKHR> blas;
-	VkBuffer tlasBuffer;
-	VkAccelerationStructureKHR tlas;
+struct VertexStreams {
+	const uint8* positions;
+	uint64 positionStride;
+	const uint8* normals;
+	uint64 normalStride;
+	const uint8* uvs; // optional
+	uint64 uvStride;
+	const uint32* sourceIndices; // optional, gathers sourceIndices[i] instead of i
+};
 
-	static Scene* create(const std::filesystem::path& filePath, Vulkan* vk) {
-		Scene* scene = new Scene();
-		scene->filePath = filePath;
-		scene->loadJson();
-		scene->loadModelsData();
-		scene->buildVkResources(vk);
-		return scene;
+// Interleaves float3 positions, float3 normals and float2 uvs into Vertex, zeroing the w and padding lanes.
+void interleaveVertices(Vertex* dst, const VertexStreams& src, uint64 count, SimdLevel level = cpuSimdLevel) {
+	if (level == SimdLevel::Scalar) {
+		for (uint64 i = 0; i < count; i++) {
+			uint64 s = src.sourceIndices ? src.sourceIndices[i] : i;
+			Vertex vertex = {};
+			memcpy(vertex.position, src.positions + s * src.positionStride, 12);
+			memcpy(vertex.normal, src.normals + s * src.normalStride, 12);
+			if (src.uvs) {
+				memcpy(vertex.uv, src.uvs + s * src.uvStride, 8);
+			}
+			dst[i] = vertex;
+		}
+		return;
+	}
+	// 12 byte loads are split into 8 + 4 so the last element of an accessor never reads past its buffer.
+	auto loadFloat3 = [](const uint8* p) {
+		return _mm_insert_epi32(_mm_loadl_epi64((const __m128i*)p), *(const int*)(p + 8), 2);
+	};
+	for (uint64 i = 0; i < count; i++) {
+		uint64 s = src.sourceIndices ? src.sourceIndices[i] : i;
+		__m128i* vertex = (__m128i*)&dst[i];
+		_mm_storeu_si128(vertex + 0, loadFloat3(src.positions + s * src.positionStride));
+		_mm_storeu_si128(vertex + 1, loadFloat3(src.normals + s * src.normalStride));
+		_mm_storeu_si128(vertex + 2, src.uvs ? _mm_loadl_epi64((const __m128i*)(src.uvs + s * src.uvStride)) : _mm_setzero_si128());
 	}
+}
 
-	void loadJson() {
-		std::ifstream file(filePath);
-		nlohmann::json json;
-		file >> json;
-		auto jCamera = json["camera"];
-		if (!jCamera.is_null()) {
-			auto position = jCamera["position"];
-			auto view = jCamera["view"];
-			camera.position = XMVectorSet(position[0], position[1], position[2], 0);
-			camera.view = XMVector3Normalize(XMVectorSet(view[0], view[1], view[2], 0));
-			camera.viewMat = XMMatrixLookAtRH(camera.position, camera.position + camera.view, XMVectorSet(0, 1, 0, 0));
-			camera.projMat = XMMatrixPerspectiveFovRH((float)80.0_deg, 1920.0f / 1080.0f, 0.1f, 1000.0f);
-			camera.viewProjMat = camera.viewMat * camera.projMat;
+// Expands RGB8 to RGBA8 with opaque alpha in place; data must hold pixelCount * 4 bytes.
+// Works backwards from the end so every block is loaded before its destination overwrites it.
+void expandRGBToRGBA(uint8* data, uint64 pixelCount, SimdLevel level = cpuSimdLevel) {
+	uint64 blockCount = level == SimdLevel::Scalar ? 0 : pixelCount / 16;
+	for (uint64 i = pixelCount; i > blockCount * 16; i--) {
+		uint8 r = data[(i - 1) * 3 + 0];
+		uint8 g = data[(i - 1) * 3 + 1];
+		uint8 b = data[(i - 1) * 3 + 2];
+		data[(i - 1) * 4 + 0] = r;
+		data[(i - 1) * 4 + 1] = g;
+		data[(i - 1) * 4 + 2] = b;
+		data[(i - 1) * 4 + 3] = 255;
+	}
+	if (level == SimdLevel::AVX2) {
+		const __m256i shuffle = _mm256_setr_epi8(
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m256i shuffleLast = _mm256_setr_epi8(
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+			4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1);
+		const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+		for (uint64 block = blockCount; block > 0; block--) {
+			const uint8* src = data + (block - 1) * 48;
+			__m256i* dst = (__m256i*)(data + (block - 1) * 64);
+			__m256i pixels0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)), _mm_loadu_si128((const __m128i*)(src + 12)), 1);
+			__m256i pixels1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src + 24))), _mm_loadu_si128((const __m128i*)(src + 32)), 1);
+			_mm256_storeu_si256(dst + 0, _mm256_or_si256(_mm256_shuffle_epi8(pixels0, shuffle), alpha));
+			_mm256_storeu_si256(dst + 1, _mm256_or_si256(_mm256_shuffle_epi8(pixels1, shuffleLast), alpha));
 		}
-		auto jModels = json["models"];
-		if (!jModels.is_null()) {
-			for (auto& jModel : jModels) {
-				Model m = {
-					.name = jModel["name"],
-					.filePath = std::string(jModel["path"])
-				};
-				models.push_back(m);
+	}
+	else if (level == SimdLevel::SSE41) {
+		const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+		for (uint64 block = blockCount; block > 0; block--) {
+			const __m128i* src = (const __m128i*)(data + (block - 1) * 48);
+			__m128i* dst = (__m128i*)(data + (block - 1) * 64);
+			__m128i a = _mm_loadu_si128(src + 0);
+			__m128i b = _mm_loadu_si128(src + 1);
+			__m128i c = _mm_loadu_si128(src + 2);
+			_mm_storeu_si128(dst + 0, _mm_or_si128(_mm_shuffle_epi8(a, shuffle), alpha));
+			_mm_storeu_si128(dst + 1, _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), shuffle), alpha));
+			_mm_storeu_si128(dst + 2, _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), shuffle), alpha));
+			_mm_storeu_si128(dst + 3, _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), shuffle), alpha));
+		}
+	}
+}
+
+// Packs Vertex into PackedVertex four at a time: the normals are transposed to SoA for the octahedron
+// encode and AVX2 level CPUs convert the uvs with F16C. Produces the same bits as packVertex.
+void packVertices(PackedVertex* dst, const Vertex* src, uint64 count, SimdLevel level = cpuSimdLevel) {
+	uint64 simdCount = level == SimdLevel::Scalar ? 0 : count / 4 * 4;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 minusOne = _mm_set1_ps(-1.0f);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	for (uint64 i = 0; i < simdCount; i += 4) {
+		__m128 x = _mm_loadu_ps(src[i + 0].normal);
+		__m128 y = _mm_loadu_ps(src[i + 1].normal);
+		__m128 z = _mm_loadu_ps(src[i + 2].normal);
+		__m128 w = _mm_loadu_ps(src[i + 3].normal);
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		__m128 length = _mm_add_ps(_mm_add_ps(_mm_and_ps(x, absMask), _mm_and_ps(y, absMask)), _mm_and_ps(z, absMask));
+		__m128 zeroLength = _mm_cmpeq_ps(length, zero);
+		length = _mm_blendv_ps(length, one, zeroLength);
+		__m128 u = _mm_andnot_ps(zeroLength, _mm_div_ps(x, length));
+		__m128 v = _mm_andnot_ps(zeroLength, _mm_div_ps(y, length));
+		__m128 foldedU = _mm_mul_ps(_mm_sub_ps(one, _mm_and_ps(v, absMask)), _mm_blendv_ps(minusOne, one, _mm_cmpge_ps(u, zero)));
+		__m128 foldedV = _mm_mul_ps(_mm_sub_ps(one, _mm_and_ps(u, absMask)), _mm_blendv_ps(minusOne, one, _mm_cmpge_ps(v, zero)));
+		__m128 fold = _mm_cmplt_ps(z, zero);
+		u = _mm_min_ps(_mm_max_ps(_mm_blendv_ps(u, foldedU, fold), minusOne), one);
+		v = _mm_min_ps(_mm_max_ps(_mm_blendv_ps(v, foldedV, fold), minusOne), one);
+		__m128i snormU = _mm_cvtps_epi32(_mm_mul_ps(u, _mm_set1_ps(32767.0f)));
+		__m128i snormV = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(32767.0f)));
+		alignas(16) uint32 normals[4];
+		_mm_store_si128((__m128i*)normals, _mm_or_si128(_mm_and_si128(snormU, _mm_set1_epi32(0xffff)), _mm_slli_epi32(snormV, 16)));
+		alignas(16) uint32 uvs[4];
+		if (level == SimdLevel::AVX2) {
+			__m128 uv01 = _mm_loadh_pi(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)src[i + 0].uv)), (const __m64*)src[i + 1].uv);
+			__m128 uv23 = _mm_loadh_pi(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)src[i + 2].uv)), (const __m64*)src[i + 3].uv);
+			_mm_store_si128((__m128i*)uvs, _mm_unpacklo_epi64(_mm_cvtps_ph(uv01, _MM_FROUND_TO_NEAREST_INT), _mm_cvtps_ph(uv23, _MM_FROUND_TO_NEAREST_INT)));
+		}
+		else {
+			for (uint32 j = 0; j < 4; j++) {
+				uvs[j] = (uint32)PackedVector::XMConvertFloatToHalf(src[i + j].uv[0]) | ((uint32)PackedVector::XMConvertFloatToHalf(src[i + j].uv[1]) << 16);
 			}
 		}
-		auto jLights = json["lights"];
-		if (!jLights.is_null()) {
-			for (auto& light : jLights) {
-				auto type = light["type"];
-				if (type.is_string() && type == "point") {
-					auto position = light["position"];
-					auto color = light["color"];
-					Light l = {
-						.position = { position[0], position[1], position[2] },
-						.color = { color[0], color[1], color[2] }
-					};
-					lights.push_back(l);
+		for (uint32 j = 0; j < 4; j++) {
+			dst[i + j] = {
+				.position = { src[i + j].position[0], src[i + j].position[1], src[i + j].position[2] },
+				.normal = normals[j],
+				.uv = uvs[j]
+			};
+		}
+	}
+	for (uint64 i = simdCount; i < count; i++) {
+		dst[i] = packVertex(src[i]);
+	}
+}
+
+// Block compression. Textures are encoded on the CPU at load time into 4x4 blocks: BC1 for opaque color,
+// BC4/BC5 for one and two channel data and BC7 mode 6 for color with alpha. Endpoints come from the principal
+// axis of each block and are refit once by least squares, indices are an exhaustive nearest palette search.
+// Only the index search has SIMD paths, so every level produces the same blocks.
+uint32 blockCompressedSize(VkFormat format) {
+	switch (format) {
+	case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+	case VK_FORMAT_BC4_UNORM_BLOCK:
+		return 8;
+	case VK_FORMAT_BC5_UNORM_BLOCK:
+	case VK_FORMAT_BC7_SRGB_BLOCK:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+// Bytes per texel of the format, or of the uncompressed format a block compressed one replaces.
+uint32 uncompressedTexelSize(VkFormat format) {
+	switch (format) {
+	case VK_FORMAT_R8_UNORM:
+	case VK_FORMAT_BC4_UNORM_BLOCK:
+		return 1;
+	case VK_FORMAT_R8G8_UNORM:
+	case VK_FORMAT_BC5_UNORM_BLOCK:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+bool isSrgbFormat(VkFormat format) {
+	return format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_BC1_RGB_SRGB_BLOCK || format == VK_FORMAT_BC7_SRGB_BLOCK;
+}
+
+// Image data is stored mip after mip, each mip as rows of texels or of 4x4 blocks.
+uint32 imageRowHeight(VkFormat format) {
+	return blockCompressedSize(format) ? 4 : 1;
+}
+
+uint64 imageRowSize(VkFormat format, uint32 width) {
+	uint32 blockSize = blockCompressedSize(format);
+	return blockSize ? (uint64)(width + 3) / 4 * blockSize : (uint64)width * uncompressedTexelSize(format);
+}
+
+uint64 imageMipSize(VkFormat format, uint32 width, uint32 height) {
+	return imageRowSize(format, width) * ((height + imageRowHeight(format) - 1) / imageRowHeight(format));
+}
+
+uint64 imageMipChainSize(VkFormat format, uint32 width, uint32 height, uint32 mipLevels) {
+	uint64 size = 0;
+	for (uint32 level = 0; level < mipLevels; level++) {
+		size += imageMipSize(format, std::max(width >> level, 1u), std::max(height >> level, 1u));
+	}
+	return size;
+}
+
+uint32 fullMipLevels(uint32 width, uint32 height) {
+	return (uint32)std::bit_width(std::max(width, height));
+}
+
+// Picks the index of the closest palette entry for every pixel, lowest index on ties, and returns the total squared error.
+// Pixels and palette entries are RGBA8, paletteSize is 4 or 16.
+uint32 selectBlockIndices(const uint8* pixels, const uint8* palette, uint32 paletteSize, uint8* indices, SimdLevel level) {
+	uint32 totalError = 0;
+	if (level == SimdLevel::Scalar) {
+		for (uint32 i = 0; i < 16; i++) {
+			uint32 bestError = UINT32_MAX;
+			for (uint32 j = 0; j < paletteSize; j++) {
+				uint32 error = 0;
+				for (uint32 c = 0; c < 4; c++) {
+					int d = (int)pixels[i * 4 + c] - (int)palette[j * 4 + c];
+					error += d * d;
+				}
+				if (error < bestError) {
+					bestError = error;
+					indices[i] = (uint8)j;
 				}
 			}
+			totalError += bestError;
+		}
+		return totalError;
+	}
+	// Channels are widened to int16 pairs so madd yields r*r + g*g and b*b + a*a per entry. Errors are shifted
+	// left by 4 with the entry index in the low bits, so an unsigned min picks the lowest error and then the lowest index.
+	alignas(32) int16 rg[32];
+	alignas(32) int16 ba[32];
+	for (uint32 j = 0; j < paletteSize; j++) {
+		rg[j * 2 + 0] = palette[j * 4 + 0];
+		rg[j * 2 + 1] = palette[j * 4 + 1];
+		ba[j * 2 + 0] = palette[j * 4 + 2];
+		ba[j * 2 + 1] = palette[j * 4 + 3];
+	}
+	if (level == SimdLevel::AVX2 && paletteSize == 16) {
+		const __m256i entryIndices0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i entryIndices1 = _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15);
+		__m256i rg0 = _mm256_load_si256((const __m256i*)rg);
+		__m256i rg1 = _mm256_load_si256((const __m256i*)rg + 1);
+		__m256i ba0 = _mm256_load_si256((const __m256i*)ba);
+		__m256i ba1 = _mm256_load_si256((const __m256i*)ba + 1);
+		for (uint32 i = 0; i < 16; i++) {
+			__m256i pixelRG = _mm256_set1_epi32(pixels[i * 4 + 0] | (pixels[i * 4 + 1] << 16));
+			__m256i pixelBA = _mm256_set1_epi32(pixels[i * 4 + 2] | (pixels[i * 4 + 3] << 16));
+			__m256i d0 = _mm256_sub_epi16(rg0, pixelRG);
+			__m256i d1 = _mm256_sub_epi16(ba0, pixelBA);
+			__m256i key0 = _mm256_or_si256(_mm256_slli_epi32(_mm256_add_epi32(_mm256_madd_epi16(d0, d0), _mm256_madd_epi16(d1, d1)), 4), entryIndices0);
+			d0 = _mm256_sub_epi16(rg1, pixelRG);
+			d1 = _mm256_sub_epi16(ba1, pixelBA);
+			__m256i key1 = _mm256_or_si256(_mm256_slli_epi32(_mm256_add_epi32(_mm256_madd_epi16(d0, d0), _mm256_madd_epi16(d1, d1)), 4), entryIndices1);
+			__m256i key = _mm256_min_epu32(key0, key1);
+			__m128i key4 = _mm_min_epu32(_mm256_castsi256_si128(key), _mm256_extracti128_si256(key, 1));
+			key4 = _mm_min_epu32(key4, _mm_shuffle_epi32(key4, _MM_SHUFFLE(1, 0, 3, 2)));
+			key4 = _mm_min_epu32(key4, _mm_shuffle_epi32(key4, _MM_SHUFFLE(2, 3, 0, 1)));
+			uint32 bestKey = (uint32)_mm_cvtsi128_si32(key4);
+			indices[i] = (uint8)(bestKey & 15);
+			totalError += bestKey >> 4;
+		}
+		return totalError;
+	}
+	for (uint32 i = 0; i < 16; i++) {
+		__m128i pixelRG = _mm_set1_epi32(pixels[i * 4 + 0] | (pixels[i * 4 + 1] << 16));
+		__m128i pixelBA = _mm_set1_epi32(pixels[i * 4 + 2] | (pixels[i * 4 + 3] << 16));
+		__m128i key = _mm_set1_epi32(-1);
+		for (uint32 j = 0; j < paletteSize; j += 4) {
+			__m128i d0 = _mm_sub_epi16(_mm_load_si128((const __m128i*)(rg + j * 2)), pixelRG);
+			__m128i d1 = _mm_sub_epi16(_mm_load_si128((const __m128i*)(ba + j * 2)), pixelBA);
+			__m128i error = _mm_add_epi32(_mm_madd_epi16(d0, d0), _mm_madd_epi16(d1, d1));
+			key = _mm_min_epu32(key, _mm_or_si128(_mm_slli_epi32(error, 4), _mm_setr_epi32(j, j + 1, j + 2, j + 3)));
 		}
+		key = _mm_min_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(1, 0, 3, 2)));
+		key = _mm_min_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(2, 3, 0, 1)));
+		uint32 bestKey = (uint32)_mm_cvtsi128_si32(key);
+		indices[i] = (uint8)(bestKey & 15);
+		totalError += bestKey >> 4;
 	}
+	return totalError;
+}
 
-	void loadModelsData() {
-		for (auto& model : models) {
-			std::filesystem::path modelFilePath = filePath.parent_path() / model.filePath;
-			std::string modelFilePathStr = modelFilePath.generic_string();
-			cgltf_options gltfOption = {};
-			cgltf_result parseFileResult = cgltf_parse_file(&gltfOption, modelFilePathStr.c_str(), &model.gltfData);
-			assert(parseFileResult == cgltf_result_success);
-			assert(model.gltfData->scene);
-			cgltf_result loadBuffersResult = cgltf_load_buffers(&gltfOption, model.gltfData, modelFilePathStr.c_str());
-			assert(loadBuffersResult == cgltf_result_success);
-			for (size_t i = 0; i < model.gltfData->images_count; i++) {
-				auto& gltfImage = model.gltfData->images[i];
-				int width, height, comp;
-				std::filesystem::path imagePath = modelFilePath.parent_path() / gltfImage.uri;
-				stbi_uc* data = stbi_load(imagePath.generic_string().c_str(), &width, &height, &comp, 0);
-				assert(data);
-				VkFormat format =
-					comp == 1 ? VK_FORMAT_R8_UNORM :
-					comp == 2 ? VK_FORMAT_R8G8_UNORM :
-					comp == 3 ? VK_FORMAT_R8G8B8A8_SRGB :
-					comp == 4 ? VK_FORMAT_R8G8B8A8_SRGB :
-					VK_FORMAT_UNDEFINED;
-				assert(format != VK_FORMAT_UNDEFINED);
-				if (comp == 3) {
-					comp = 4;
-					uint8* newData = new uint8[width * height * 4]();
-					for (int i = 0; i < width * height; i++) {
-						newData[i * 4 + 0] = data[i * 3 + 0];
-						newData[i * 4 + 1] = data[i * 3 + 1];
-						newData[i * 4 + 2] = data[i * 3 + 2];
-					}
-					stbi_image_free(data);
-					data = newData;
-				}
-				Image image = {
-					.width = (uint32)width,
-					.height = (uint32)height,
-					.format = format,
-					.size = (uint32)(width * height * comp),
-					.data = data
-				};
-				model.images.push_back(image);
+// Endpoints along the principal axis of the block's channelCount channels, found by power iteration
+// on the covariance matrix, spanning the extent of the pixel projections.
+void blockPrincipalEndpoints(const uint8* pixels, uint32 channelCount, float endpoints[2][4]) {
+	float mean[4] = {};
+	for (uint32 i = 0; i < 16; i++) {
+		for (uint32 c = 0; c < channelCount; c++) {
+			mean[c] += pixels[i * 4 + c] / 16.0f;
+		}
+	}
+	float covariance[4][4] = {};
+	for (uint32 i = 0; i < 16; i++) {
+		for (uint32 c0 = 0; c0 < channelCount; c0++) {
+			for (uint32 c1 = 0; c1 < channelCount; c1++) {
+				covariance[c0][c1] += (pixels[i * 4 + c0] - mean[c0]) * (pixels[i * 4 + c1] - mean[c1]);
+			}
+		}
+	}
+	float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	for (uint32 iteration = 0; iteration < 8; iteration++) {
+		float next[4] = {};
+		float length = 0;
+		for (uint32 c0 = 0; c0 < channelCount; c0++) {
+			for (uint32 c1 = 0; c1 < channelCount; c1++) {
+				next[c0] += covariance[c0][c1] * axis[c1];
+			}
+			length = std::max(length, fabsf(next[c0]));
+		}
+		if (length < 1e-6f) {
+			break;
+		}
+		for (uint32 c = 0; c < channelCount; c++) {
+			axis[c] = next[c] / length;
+		}
+	}
+	float minT = FLT_MAX;
+	float maxT = -FLT_MAX;
+	float axisLengthSquared = 0;
+	for (uint32 c = 0; c < channelCount; c++) {
+		axisLengthSquared += axis[c] * axis[c];
+	}
+	for (uint32 i = 0; i < 16; i++) {
+		float t = 0;
+		for (uint32 c = 0; c < channelCount; c++) {
+			t += (pixels[i * 4 + c] - mean[c]) * axis[c];
+		}
+		minT = std::min(minT, t / axisLengthSquared);
+		maxT = std::max(maxT, t / axisLengthSquared);
+	}
+	for (uint32 c = 0; c < 4; c++) {
+		endpoints[0][c] = c < channelCount ? std::clamp(mean[c] + axis[c] * minT, 0.0f, 255.0f) : 0.0f;
+		endpoints[1][c] = c < channelCount ? std::clamp(mean[c] + axis[c] * maxT, 0.0f, 255.0f) : 0.0f;
+	}
+}
+
+// Least squares endpoints for fixed per pixel interpolation weights in [0, 1]. Returns false when the weights are degenerate.
+bool refitBlockEndpoints(const uint8* pixels, uint32 channelCount, const float* weights, float endpoints[2][4]) {
+	float aa = 0, ab = 0, bb = 0;
+	float ax[4] = {};
+	float bx[4] = {};
+	for (uint32 i = 0; i < 16; i++) {
+		float b = weights[i];
+		float a = 1.0f - b;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		for (uint32 c = 0; c < channelCount; c++) {
+			ax[c] += a * pixels[i * 4 + c];
+			bx[c] += b * pixels[i * 4 + c];
+		}
+	}
+	float determinant = aa * bb - ab * ab;
+	if (fabsf(determinant) < 1e-6f) {
+		return false;
+	}
+	for (uint32 c = 0; c < channelCount; c++) {
+		endpoints[0][c] = std::clamp((ax[c] * bb - bx[c] * ab) / determinant, 0.0f, 255.0f);
+		endpoints[1][c] = std::clamp((bx[c] * aa - ax[c] * ab) / determinant, 0.0f, 255.0f);
+	}
+	return true;
+}
+
+// BC1 in four color mode, alpha is ignored.
+void encodeBC1Block(const uint8* rgba, uint8* dst, SimdLevel level) {
+	alignas(16) uint8 pixels[64];
+	for (uint32 i = 0; i < 16; i++) {
+		memcpy(&pixels[i * 4], &rgba[i * 4], 3);
+		pixels[i * 4 + 3] = 0;
+	}
+	auto quantize = [](const float* color) {
+		return (uint16)((lrintf(color[0] * 31.0f / 255.0f) << 11) | (lrintf(color[1] * 63.0f / 255.0f) << 5) | lrintf(color[2] * 31.0f / 255.0f));
+	};
+	auto expand = [](uint16 color, uint8* rgb) {
+		uint32 r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+		rgb[0] = (uint8)((r << 3) | (r >> 2));
+		rgb[1] = (uint8)((g << 2) | (g >> 4));
+		rgb[2] = (uint8)((b << 3) | (b >> 2));
+	};
+	uint32 bestError = UINT32_MAX;
+	uint16 bestColors[2] = {};
+	uint8 bestIndices[16] = {};
+	auto tryEndpoints = [&](const float endpoints[2][4]) {
+		uint16 colors[2] = { quantize(endpoints[1]), quantize(endpoints[0]) };
+		if (colors[0] < colors[1]) {
+			std::swap(colors[0], colors[1]);
+		}
+		alignas(16) uint8 palette[16] = {};
+		expand(colors[0], &palette[0]);
+		expand(colors[1], &palette[4]);
+		for (uint32 c = 0; c < 3; c++) {
+			palette[8 + c] = (uint8)((2 * palette[c] + palette[4 + c]) / 3);
+			palette[12 + c] = (uint8)((palette[c] + 2 * palette[4 + c]) / 3);
+		}
+		// Equal colors select the three color mode, but then all four entries equal color 0 and every index is 0.
+		uint8 indices[16];
+		uint32 error = selectBlockIndices(pixels, palette, 4, indices, level);
+		if (error < bestError) {
+			bestError = error;
+			bestColors[0] = colors[0];
+			bestColors[1] = colors[1];
+			memcpy(bestIndices, indices, sizeof(indices));
+		}
+	};
+	float endpoints[2][4];
+	blockPrincipalEndpoints(pixels, 3, endpoints);
+	tryEndpoints(endpoints);
+	const float paletteWeights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+	float weights[16];
+	for (uint32 i = 0; i < 16; i++) {
+		weights[i] = paletteWeights[bestIndices[i]];
+	}
+	float refitEndpoints[2][4] = {};
+	if (bestColors[0] != bestColors[1] && refitBlockEndpoints(pixels, 3, weights, refitEndpoints)) {
+		tryEndpoints(refitEndpoints);
+	}
+	uint32 indexBits = 0;
+	for (uint32 i = 0; i < 16; i++) {
+		indexBits |= (uint32)bestIndices[i] << (i * 2);
+	}
+	memcpy(dst + 0, &bestColors[0], 2);
+	memcpy(dst + 2, &bestColors[1], 2);
+	memcpy(dst + 4, &indexBits, 4);
+}
+
+// BC4 in eight value mode, reading every stride-th byte of the block.
+void encodeBC4Block(const uint8* block, uint32 stride, uint8* dst) {
+	uint8 values[16];
+	uint8 minValue = 255, maxValue = 0;
+	for (uint32 i = 0; i < 16; i++) {
+		values[i] = block[i * stride];
+		minValue = std::min(minValue, values[i]);
+		maxValue = std::max(maxValue, values[i]);
+	}
+	uint8 palette[8] = { maxValue, minValue };
+	for (uint32 j = 2; j < 8; j++) {
+		palette[j] = (uint8)(((8 - j) * maxValue + (j - 1) * minValue) / 7);
+	}
+	uint64 bits = (uint64)maxValue | ((uint64)minValue << 8);
+	for (uint32 i = 0; maxValue > minValue && i < 16; i++) {
+		uint32 bestIndex = 0;
+		int bestError = 256;
+		for (uint32 j = 0; j < 8; j++) {
+			int error = abs((int)values[i] - (int)palette[j]);
+			if (error < bestError) {
+				bestError = error;
+				bestIndex = j;
+			}
+		}
+		bits |= (uint64)bestIndex << (16 + i * 3);
+	}
+	memcpy(dst, &bits, 8);
+}
+
+struct BlockBitWriter {
+	uint64 bits[2] = {};
+	uint32 offset = 0;
+
+	void write(uint64 value, uint32 count) {
+		bits[offset / 64] |= value << (offset % 64);
+		if (offset % 64 + count > 64) {
+			bits[1] |= value >> (64 - offset % 64);
+		}
+		offset += count;
+	}
+};
+
+const uint32 bc7IndexWeights2[4] = { 0, 21, 43, 64 };
+const uint32 bc7IndexWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// BC7 mode 6: one subset, RGBA endpoints with 7 bits per channel plus a p-bit per endpoint, 4 bit indices.
+uint32 encodeBC7Mode6Block(const uint8* pixels, uint8* dst, SimdLevel level) {
+	uint32 bestError = UINT32_MAX;
+	uint8 bestEndpoints[2][4] = {};
+	uint32 bestPBits[2] = {};
+	uint8 bestIndices[16] = {};
+	auto tryEndpoints = [&](const float endpoints[2][4]) {
+		for (uint32 pBits = 0; pBits < 4; pBits++) {
+			uint32 p[2] = { pBits & 1, pBits >> 1 };
+			uint8 quantized[2][4];
+			for (uint32 e = 0; e < 2; e++) {
+				for (uint32 c = 0; c < 4; c++) {
+					quantized[e][c] = (uint8)std::clamp(lrintf((endpoints[e][c] - p[e]) / 2.0f), 0l, 127l);
+				}
+			}
+			alignas(16) uint8 palette[64];
+			for (uint32 j = 0; j < 16; j++) {
+				for (uint32 c = 0; c < 4; c++) {
+					uint32 e0 = (quantized[0][c] << 1) | p[0];
+					uint32 e1 = (quantized[1][c] << 1) | p[1];
+					palette[j * 4 + c] = (uint8)(((64 - bc7IndexWeights4[j]) * e0 + bc7IndexWeights4[j] * e1 + 32) >> 6);
+				}
+			}
+			uint8 indices[16];
+			uint32 error = selectBlockIndices(pixels, palette, 16, indices, level);
+			if (error < bestError) {
+				bestError = error;
+				memcpy(bestEndpoints, quantized, sizeof(quantized));
+				bestPBits[0] = p[0];
+				bestPBits[1] = p[1];
+				memcpy(bestIndices, indices, sizeof(indices));
+			}
+		}
+	};
+	float endpoints[2][4];
+	blockPrincipalEndpoints(pixels, 4, endpoints);
+	tryEndpoints(endpoints);
+	float weights[16];
+	for (uint32 i = 0; i < 16; i++) {
+		weights[i] = bc7IndexWeights4[bestIndices[i]] / 64.0f;
+	}
+	if (refitBlockEndpoints(pixels, 4, weights, endpoints)) {
+		tryEndpoints(endpoints);
+	}
+	// The most significant bit of the first index is implicitly 0, swapping the endpoints inverts the indices.
+	if (bestIndices[0] & 8) {
+		std::swap(bestEndpoints[0], bestEndpoints[1]);
+		std::swap(bestPBits[0], bestPBits[1]);
+		for (uint32 i = 0; i < 16; i++) {
+			bestIndices[i] = 15 - bestIndices[i];
+		}
+	}
+	BlockBitWriter writer;
+	writer.write(1 << 6, 7);
+	for (uint32 c = 0; c < 4; c++) {
+		writer.write(bestEndpoints[0][c], 7);
+		writer.write(bestEndpoints[1][c], 7);
+	}
+	writer.write(bestPBits[0], 1);
+	writer.write(bestPBits[1], 1);
+	for (uint32 i = 0; i < 16; i++) {
+		writer.write(bestIndices[i], i == 0 ? 3 : 4);
+	}
+	memcpy(dst, writer.bits, 16);
+	return bestError;
+}
+
+// BC7 mode 5: one subset with separately indexed color and alpha, 7 bit color and 8 bit alpha endpoints,
+// 2 bit indices each and no channel rotation. Handles alpha that doesn't follow the color, like cutout edges.
+uint32 encodeBC7Mode5Block(const uint8* pixels, uint8* dst, SimdLevel level) {
+	alignas(16) uint8 colors[64];
+	for (uint32 i = 0; i < 16; i++) {
+		memcpy(&colors[i * 4], &pixels[i * 4], 3);
+		colors[i * 4 + 3] = 0;
+	}
+	uint32 bestColorError = UINT32_MAX;
+	uint8 bestColorEndpoints[2][3] = {};
+	uint8 bestColorIndices[16] = {};
+	auto tryEndpoints = [&](const float endpoints[2][4]) {
+		uint8 quantized[2][3];
+		alignas(16) uint8 palette[16] = {};
+		for (uint32 e = 0; e < 2; e++) {
+			for (uint32 c = 0; c < 3; c++) {
+				quantized[e][c] = (uint8)std::clamp(lrintf(endpoints[e][c] * 127.0f / 255.0f), 0l, 127l);
+			}
+		}
+		for (uint32 j = 0; j < 4; j++) {
+			for (uint32 c = 0; c < 3; c++) {
+				uint32 e0 = (quantized[0][c] << 1) | (quantized[0][c] >> 6);
+				uint32 e1 = (quantized[1][c] << 1) | (quantized[1][c] >> 6);
+				palette[j * 4 + c] = (uint8)(((64 - bc7IndexWeights2[j]) * e0 + bc7IndexWeights2[j] * e1 + 32) >> 6);
+			}
+		}
+		uint8 indices[16];
+		uint32 error = selectBlockIndices(colors, palette, 4, indices, level);
+		if (error < bestColorError) {
+			bestColorError = error;
+			memcpy(bestColorEndpoints, quantized, sizeof(quantized));
+			memcpy(bestColorIndices, indices, sizeof(indices));
+		}
+	};
+	float endpoints[2][4];
+	blockPrincipalEndpoints(colors, 3, endpoints);
+	tryEndpoints(endpoints);
+	float weights[16];
+	for (uint32 i = 0; i < 16; i++) {
+		weights[i] = bc7IndexWeights2[bestColorIndices[i]] / 64.0f;
+	}
+	if (refitBlockEndpoints(colors, 3, weights, endpoints)) {
+		tryEndpoints(endpoints);
+	}
+	uint8 alphaEndpoints[2] = { 255, 0 };
+	for (uint32 i = 0; i < 16; i++) {
+		alphaEndpoints[0] = std::min(alphaEndpoints[0], pixels[i * 4 + 3]);
+		alphaEndpoints[1] = std::max(alphaEndpoints[1], pixels[i * 4 + 3]);
+	}
+	uint8 alphaPalette[4];
+	for (uint32 j = 0; j < 4; j++) {
+		alphaPalette[j] = (uint8)(((64 - bc7IndexWeights2[j]) * alphaEndpoints[0] + bc7IndexWeights2[j] * alphaEndpoints[1] + 32) >> 6);
+	}
+	uint32 alphaError = 0;
+	uint8 alphaIndices[16];
+	for (uint32 i = 0; i < 16; i++) {
+		uint32 bestError = UINT32_MAX;
+		for (uint32 j = 0; j < 4; j++) {
+			int d = (int)pixels[i * 4 + 3] - (int)alphaPalette[j];
+			if ((uint32)(d * d) < bestError) {
+				bestError = d * d;
+				alphaIndices[i] = (uint8)j;
+			}
+		}
+		alphaError += bestError;
+	}
+	if (bestColorIndices[0] & 2) {
+		std::swap(bestColorEndpoints[0], bestColorEndpoints[1]);
+		for (uint32 i = 0; i < 16; i++) {
+			bestColorIndices[i] = 3 - bestColorIndices[i];
+		}
+	}
+	if (alphaIndices[0] & 2) {
+		std::swap(alphaEndpoints[0], alphaEndpoints[1]);
+		for (uint32 i = 0; i < 16; i++) {
+			alphaIndices[i] = 3 - alphaIndices[i];
+		}
+	}
+	BlockBitWriter writer;
+	writer.write(1 << 5, 6);
+	writer.write(0, 2);
+	for (uint32 c = 0; c < 3; c++) {
+		writer.write(bestColorEndpoints[0][c], 7);
+		writer.write(bestColorEndpoints[1][c], 7);
+	}
+	writer.write(alphaEndpoints[0], 8);
+	writer.write(alphaEndpoints[1], 8);
+	for (uint32 i = 0; i < 16; i++) {
+		writer.write(bestColorIndices[i], i == 0 ? 1 : 2);
+	}
+	for (uint32 i = 0; i < 16; i++) {
+		writer.write(alphaIndices[i], i == 0 ? 1 : 2);
+	}
+	memcpy(dst, writer.bits, 16);
+	return bestColorError + alphaError;
+}
+
+// Encodes both single subset modes and keeps the one with the lower error.
+void encodeBC7Block(const uint8* rgba, uint8* dst, SimdLevel level) {
+	alignas(16) uint8 pixels[64];
+	memcpy(pixels, rgba, 64);
+	uint8 mode5Block[16];
+	uint32 mode6Error = encodeBC7Mode6Block(pixels, dst, level);
+	if (mode6Error > 0 && encodeBC7Mode5Block(pixels, mode5Block, level) < mode6Error) {
+		memcpy(dst, mode5Block, 16);
+	}
+}
+
+// Encodes block rows [blockRowBegin, blockRowEnd) of an image with 1, 2 or 4 bytes per pixel. Blocks past the right
+// and bottom edges repeat the last column and row.
+void compressImageBlocks(uint8* dst, const uint8* src, uint32 width, uint32 height, uint32 components, VkFormat format, uint32 blockRowBegin, uint32 blockRowEnd, SimdLevel level = cpuSimdLevel) {
+	uint32 blockSize = blockCompressedSize(format);
+	uint32 blockColumnCount = (width + 3) / 4;
+	for (uint32 blockRow = blockRowBegin; blockRow < blockRowEnd; blockRow++) {
+		for (uint32 blockColumn = 0; blockColumn < blockColumnCount; blockColumn++) {
+			alignas(16) uint8 block[64] = {};
+			for (uint32 y = 0; y < 4; y++) {
+				for (uint32 x = 0; x < 4; x++) {
+					uint64 pixel = (uint64)std::min(blockRow * 4 + y, height - 1) * width + std::min(blockColumn * 4 + x, width - 1);
+					memcpy(&block[(y * 4 + x) * 4], src + pixel * components, components);
+				}
+			}
+			uint8* blockDst = dst + ((uint64)blockRow * blockColumnCount + blockColumn) * blockSize;
+			switch (format) {
+			case VK_FORMAT_BC1_RGB_SRGB_BLOCK: encodeBC1Block(block, blockDst, level); break;
+			case VK_FORMAT_BC4_UNORM_BLOCK: encodeBC4Block(block, 4, blockDst); break;
+			case VK_FORMAT_BC5_UNORM_BLOCK: encodeBC4Block(block, 4, blockDst); encodeBC4Block(block + 1, 4, blockDst + 8); break;
+			case VK_FORMAT_BC7_SRGB_BLOCK: encodeBC7Block(block, blockDst, level); break;
+			default: assert(false);
+			}
+		}
+	}
+}
+
+const uint32 textureCompressionTaskBlockRows = 16;
+
+float srgbToLinear(float c) {
+	return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float linearToSrgb(float c) {
+	return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// Halves an image with 1, 2 or 4 bytes per pixel (rounding down, at least 1) using a separable [1 3 3 1] / 8 filter,
+// which is smoother than a 2x2 box at the same cost. sRGB color channels are filtered in linear space, alpha and
+// non color data as is. Taps past the edges clamp, so odd sizes and 1 pixel wide levels work.
+void downsampleImage(uint8* dst, const uint8* src, uint32 width, uint32 height, uint32 components, bool srgb) {
+	static const std::array<float, 256> srgbToLinearTable = [] {
+		std::array<float, 256> table;
+		for (uint32 i = 0; i < 256; i++) {
+			table[i] = srgbToLinear(i / 255.0f);
+		}
+		return table;
+	}();
+	const float weights[4] = { 1.0f / 8.0f, 3.0f / 8.0f, 3.0f / 8.0f, 1.0f / 8.0f };
+	uint32 dstWidth = std::max(width / 2, 1u);
+	uint32 dstHeight = std::max(height / 2, 1u);
+	uint32 srgbComponents = srgb ? std::min(components, 3u) : 0;
+	auto tap = [](uint32 dstCoord, uint32 i, uint32 size) {
+		return (uint32)std::clamp((int)(dstCoord * 2 + i) - 1, 0, (int)size - 1);
+	};
+	std::vector<float> rows((uint64)dstWidth * height * components);
+	for (uint32 y = 0; y < height; y++) {
+		for (uint32 x = 0; x < dstWidth; x++) {
+			for (uint32 c = 0; c < components; c++) {
+				float sum = 0;
+				for (uint32 i = 0; i < 4; i++) {
+					uint8 value = src[((uint64)y * width + tap(x, i, width)) * components + c];
+					sum += weights[i] * (c < srgbComponents ? srgbToLinearTable[value] : value / 255.0f);
+				}
+				rows[((uint64)y * dstWidth + x) * components + c] = sum;
+			}
+		}
+	}
+	for (uint32 y = 0; y < dstHeight; y++) {
+		for (uint32 x = 0; x < dstWidth; x++) {
+			for (uint32 c = 0; c < components; c++) {
+				float sum = 0;
+				for (uint32 i = 0; i < 4; i++) {
+					sum += weights[i] * rows[((uint64)tap(y, i, height) * dstWidth + x) * components + c];
+				}
+				sum = c < srgbComponents ? linearToSrgb(sum) : sum;
+				dst[((uint64)y * dstWidth + x) * components + c] = (uint8)std::clamp(lrintf(sum * 255.0f), 0l, 255l);
+			}
+		}
+	}
+}
+
+struct Geometry {
+	uint32 vertexOffset;
+	uint32 indexOffset; // in uint16 units
+	uint32 materialIndex;
+	uint32 indexStride; // in uint16 units, 1 for 16 bit indices and 2 for 32 bit indices
+};
+
+struct Instance {
+	float transform[4][4];
+	uint32 geometryOffset;
+	uint32 pad0[3];
+};
+
+// GPU instance layout: the 3x4 object to world transform in the same row major form as VkTransformMatrixKHR.
+// The shader derives the normal matrix from its cofactors.
+struct PackedInstance {
+	float transform[3][4];
+	uint32 geometryOffset;
+	uint32 pad0[3];
+};
+
+PackedInstance packInstance(const Instance& instance) {
+	PackedInstance packedInstance = { .geometryOffset = instance.geometryOffset };
+	for (uint32 row = 0; row < 3; row++) {
+		for (uint32 column = 0; column < 4; column++) {
+			packedInstance.transform[row][column] = instance.transform[column][row];
+		}
+	}
+	return packedInstance;
+}
+
+struct Material {
+	float baseColorFactor[4];
+	float emissiveFactor[4];
+	uint32 baseColorTextureIndex;
+	uint32 emissiveTextureIndex;
+	uint32 alphaMask;
+	float alphaCutoff;
+};
+
+struct GeometryInfo {
+	uint32 vertexCount;
+	uint32 indexCount;
+};
+
+struct Mesh {
+	uint32 geometryOffset;
+	uint32 geometryCount;
+};
+
+// Primitives with more vertices than 16 bit indices can address are split into clusters that each
+// reference at most indexClusterMaxVertexCount vertices. Vertices shared across cluster borders are duplicated.
+const uint32 indexClusterMaxVertexCount = 65536;
+
+struct IndexClusters {
+	std::vector<uint32> vertices; // source vertex index of every cluster vertex, clusters concatenated
+	std::vector<uint16> indices; // cluster local indices, clusters concatenated
+	std::vector<GeometryInfo> clusters;
+};
+
+IndexClusters clusterIndices(std::span<const uint32> indices, uint32 vertexCount) {
+	IndexClusters clusters;
+	clusters.indices.reserve(indices.size());
+	std::vector<uint32> vertexClusters(vertexCount, UINT32_MAX);
+	std::vector<uint16> localIndices(vertexCount);
+	uint32 clusterIndex = 0;
+	GeometryInfo cluster = {};
+	for (size_t triangleIndex = 0; triangleIndex < indices.size() / 3; triangleIndex++) {
+		const uint32* triangle = &indices[triangleIndex * 3];
+		uint32 newVertexCount = 0;
+		for (uint32 i = 0; i < 3; i++) {
+			newVertexCount += vertexClusters[triangle[i]] != clusterIndex && (i < 1 || triangle[i] != triangle[0]) && (i < 2 || triangle[i] != triangle[1]);
+		}
+		if (cluster.vertexCount + newVertexCount > indexClusterMaxVertexCount) {
+			clusters.clusters.push_back(cluster);
+			cluster = {};
+			clusterIndex += 1;
+		}
+		for (uint32 i = 0; i < 3; i++) {
+			uint32 vertexIndex = triangle[i];
+			if (vertexClusters[vertexIndex] != clusterIndex) {
+				vertexClusters[vertexIndex] = clusterIndex;
+				localIndices[vertexIndex] = (uint16)cluster.vertexCount;
+				clusters.vertices.push_back(vertexIndex);
+				cluster.vertexCount += 1;
+			}
+			clusters.indices.push_back(localIndices[vertexIndex]);
+		}
+		cluster.indexCount += 3;
+	}
+	if (cluster.indexCount > 0) {
+		clusters.clusters.push_back(cluster);
+	}
+	return clusters;
+}
+
+struct Bounds {
+	float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+	void grow(const float* point) {
+		for (uint32 i = 0; i < 3; i++) {
+			min[i] = std::min(min[i], point[i]);
+			max[i] = std::max(max[i], point[i]);
+		}
+	}
+
+	void grow(const Bounds& bounds) {
+		for (uint32 i = 0; i < 3; i++) {
+			min[i] = std::min(min[i], bounds.min[i]);
+			max[i] = std::max(max[i], bounds.max[i]);
+		}
+	}
+
+	std::array<float, 3> center() const {
+		return { (min[0] + max[0]) * 0.5f, (min[1] + max[1]) * 0.5f, (min[2] + max[2]) * 0.5f };
+	}
+
+	uint32 largestAxis() const {
+		float x = max[0] - min[0];
+		float y = max[1] - min[1];
+		float z = max[2] - min[2];
+		return (x >= y && x >= z) ? 0 : (y >= z ? 1 : 2);
+	}
+
+	float surfaceArea() const {
+		if (min[0] > max[0]) {
+			return 0;
+		}
+		float x = max[0] - min[0];
+		float y = max[1] - min[1];
+		float z = max[2] - min[2];
+		return 2 * (x * y + y * z + z * x);
+	}
+
+	Bounds transform(const XMMATRIX& mat) const {
+		Bounds bounds;
+		if (min[0] > max[0]) {
+			return bounds;
+		}
+		for (uint32 corner = 0; corner < 8; corner++) {
+			XMVECTOR point = XMVectorSet(corner & 1 ? max[0] : min[0], corner & 2 ? max[1] : min[1], corner & 4 ? max[2] : min[2], 1);
+			XMFLOAT3 transformedPoint;
+			XMStoreFloat3(&transformedPoint, XMVector3Transform(point, mat));
+			bounds.grow(&transformedPoint.x);
+		}
+		return bounds;
+	}
+};
+
+struct PartitionTriangle {
+	uint32 geometryIndex;
+	uint32 triangleIndex;
+	Bounds bounds;
+	std::array<float, 3> center;
+};
+
+struct VertexFetchStats {
+	uint64 triangleCount;
+	uint64 vertexCacheMissCount; // 32 entry FIFO post transform cache
+	uint64 fetchedBytes; // 16 KB direct mapped cache with 64 byte lines
+	uint64 vertexBytes;
+
+	void add(const VertexFetchStats& stats) {
+		triangleCount += stats.triangleCount;
+		vertexCacheMissCount += stats.vertexCacheMissCount;
+		fetchedBytes += stats.fetchedBytes;
+		vertexBytes += stats.vertexBytes;
+	}
+	double acmr() const { return vertexCacheMissCount / (double)std::max(triangleCount, (uint64)1); }
+	double overfetch() const { return fetchedBytes / (double)std::max(vertexBytes, (uint64)1); }
+};
+
+VertexFetchStats analyzeVertexFetch(std::span<const uint32> indices, uint32 vertexCount, uint32 vertexStride) {
+	const uint32 fifoSize = 32;
+	const uint32 lineSize = 64;
+	const uint32 lineCount = 256;
+	VertexFetchStats stats = { .triangleCount = indices.size() / 3, .vertexBytes = (uint64)vertexCount * vertexStride };
+	std::vector<uint32> fifoTimestamps(vertexCount, 0);
+	uint32 timestamp = fifoSize + 1;
+	uint64 lines[lineCount];
+	std::fill_n(lines, lineCount, UINT64_MAX);
+	for (uint32 index : indices) {
+		if (timestamp - fifoTimestamps[index] <= fifoSize) {
+			continue;
+		}
+		fifoTimestamps[index] = timestamp++;
+		stats.vertexCacheMissCount += 1;
+		uint64 begin = (uint64)index * vertexStride / lineSize;
+		uint64 end = ((uint64)index * vertexStride + vertexStride - 1) / lineSize;
+		for (uint64 line = begin; line <= end; line++) {
+			if (lines[line % lineCount] != line) {
+				lines[line % lineCount] = line;
+				stats.fetchedBytes += lineSize;
+			}
+		}
+	}
+	return stats;
+}
+
+// Merges bitwise identical vertices, sorts triangles along a Morton curve through their centers
+// and renumbers vertices in order of first use so both index and vertex fetches walk memory forward.
+void optimizeGeometry(std::vector<Vertex>& vertices, std::vector<uint32>& indices) {
+	std::vector<uint32> sortedVertices(vertices.size());
+	for (uint32 i = 0; i < vertices.size(); i++) {
+		sortedVertices[i] = i;
+	}
+	std::sort(sortedVertices.begin(), sortedVertices.end(), [&](uint32 a, uint32 b) {
+		int order = memcmp(&vertices[a], &vertices[b], sizeof(Vertex));
+		return order < 0 || (order == 0 && a < b);
+	});
+	std::vector<uint32> uniqueVertices(vertices.size());
+	for (size_t i = 0; i < sortedVertices.size(); i++) {
+		bool duplicate = i > 0 && !memcmp(&vertices[sortedVertices[i]], &vertices[sortedVertices[i - 1]], sizeof(Vertex));
+		uniqueVertices[sortedVertices[i]] = duplicate ? uniqueVertices[sortedVertices[i - 1]] : sortedVertices[i];
+	}
+
+	uint32 triangleCount = (uint32)(indices.size() / 3);
+	Bounds centerBounds;
+	std::vector<std::array<float, 3>> centers(triangleCount);
+	for (uint32 triangleIndex = 0; triangleIndex < triangleCount; triangleIndex++) {
+		for (uint32 axis = 0; axis < 3; axis++) {
+			centers[triangleIndex][axis] = 0;
+			for (uint32 i = 0; i < 3; i++) {
+				centers[triangleIndex][axis] += vertices[indices[triangleIndex * 3 + i]].position[axis] / 3.0f;
+			}
+		}
+		centerBounds.grow(centers[triangleIndex].data());
+	}
+	auto spreadBits = [](uint32 x) {
+		x = (x | (x << 16)) & 0x030000ff;
+		x = (x | (x << 8)) & 0x0300f00f;
+		x = (x | (x << 4)) & 0x030c30c3;
+		x = (x | (x << 2)) & 0x09249249;
+		return x;
+	};
+	std::vector<std::pair<uint32, uint32>> mortonTriangles(triangleCount);
+	for (uint32 triangleIndex = 0; triangleIndex < triangleCount; triangleIndex++) {
+		uint32 code = 0;
+		for (uint32 axis = 0; axis < 3; axis++) {
+			float extent = centerBounds.max[axis] - centerBounds.min[axis];
+			float t = extent > 0 ? (centers[triangleIndex][axis] - centerBounds.min[axis]) / extent : 0;
+			code |= spreadBits(std::min((uint32)(t * 1024.0f), 1023u)) << axis;
+		}
+		mortonTriangles[triangleIndex] = { code, triangleIndex };
+	}
+	std::sort(mortonTriangles.begin(), mortonTriangles.end());
+
+	std::vector<uint32> vertexRemap(vertices.size(), UINT32_MAX);
+	std::vector<Vertex> newVertices;
+	std::vector<uint32> newIndices(indices.size());
+	for (uint32 i = 0; i < triangleCount; i++) {
+		uint32 triangleIndex = mortonTriangles[i].second;
+		for (uint32 j = 0; j < 3; j++) {
+			uint32 vertexIndex = uniqueVertices[indices[triangleIndex * 3 + j]];
+			if (vertexRemap[vertexIndex] == UINT32_MAX) {
+				vertexRemap[vertexIndex] = (uint32)newVertices.size();
+				newVertices.push_back(vertices[vertexIndex]);
+			}
+			newIndices[i * 3 + j] = vertexRemap[vertexIndex];
+		}
+	}
+	vertices = std::move(newVertices);
+	indices = std::move(newIndices);
+}
+
+uint64 hashBytes(const void* data, uint64 size, uint64 hash = 0xcbf29ce484222325) {
+	// FNV-1a over 8 byte words, the tail is hashed byte by byte.
+	const uint64 prime = 0x100000001b3;
+	const uint8* bytes = (const uint8*)data;
+	uint64 wordCount = size / sizeof(uint64);
+	for (uint64 i = 0; i < wordCount; i++) {
+		uint64 word;
+		memcpy(&word, bytes + i * sizeof(uint64), sizeof(uint64));
+		hash = (hash ^ word) * prime;
+	}
+	for (uint64 i = wordCount * sizeof(uint64); i < size; i++) {
+		hash = (hash ^ bytes[i]) * prime;
+	}
+	return hash;
+}
+
+struct FileMapping {
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+	uint8* data = nullptr;
+	uint64 size = 0;
+
+	bool map(const std::filesystem::path& path) {
+		file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			unmap();
+			return false;
+		}
+		size = fileSize.QuadPart;
+		mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) {
+			data = (uint8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+		if (!data) {
+			unmap();
+			return false;
+		}
+		return true;
+	}
+
+	void unmap() {
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		mapping = nullptr;
+		data = nullptr;
+		size = 0;
+	}
+};
+
+// cgltf file callbacks that memory map the .gltf/.glb and .bin files instead of reading them into heap copies,
+// so accessor data points straight into the file mappings. Anything cgltf allocates itself (data URIs) is freed normally.
+struct GltfFileMappings {
+	std::mutex mutex;
+	std::unordered_map<void*, FileMapping> mappings;
+};
+
+GltfFileMappings gltfFileMappings;
+
+cgltf_result gltfMapFile(const cgltf_memory_options* memoryOptions, const cgltf_file_options* fileOptions, const char* path, cgltf_size* size, void** data) {
+	FileMapping mapping;
+	if (!mapping.map(std::filesystem::path((const char8_t*)path))) {
+		return cgltf_result_file_not_found;
+	}
+	if (size && *size > mapping.size) {
+		mapping.unmap();
+		return cgltf_result_io_error;
+	}
+	if (size && *size == 0) {
+		*size = mapping.size;
+	}
+	*data = mapping.data;
+	std::lock_guard<std::mutex> lock(gltfFileMappings.mutex);
+	gltfFileMappings.mappings[mapping.data] = mapping;
+	return cgltf_result_success;
+}
+
+void gltfFree(void* userData, void* ptr) {
+	if (!ptr) {
+		return;
+	}
+	std::unique_lock<std::mutex> lock(gltfFileMappings.mutex);
+	auto it = gltfFileMappings.mappings.find(ptr);
+	if (it == gltfFileMappings.mappings.end()) {
+		lock.unlock();
+		free(ptr);
+		return;
+	}
+	FileMapping mapping = it->second;
+	gltfFileMappings.mappings.erase(it);
+	lock.unlock();
+	mapping.unmap();
+}
+
+void gltfReleaseFile(const cgltf_memory_options* memoryOptions, const cgltf_file_options* fileOptions, void* data) {
+	gltfFree(nullptr, data);
+}
+
+// cgltf_parse_file frees the file data through memory.free on failure, so that has to understand mappings too.
+cgltf_options gltfMappedFileOptions() {
+	return cgltf_options{
+		.memory = { .free = gltfFree },
+		.file = { .read = gltfMapFile, .release = gltfReleaseFile },
+	};
+}
+
+// Unmaps the buffer files (and the GLB file, whose binary chunk is a buffer) once the vertex and index data has been
+// copied out. The JSON derived data (materials, nodes, image URIs) stays valid, only buffer contents become unavailable.
+void gltfReleaseBuffers(cgltf_data* gltfData) {
+	for (size_t i = 0; i < gltfData->buffers_count; i++) {
+		if (gltfData->buffers[i].data != gltfData->bin) {
+			gltfReleaseFile(&gltfData->memory, &gltfData->file, gltfData->buffers[i].data);
+		}
+		gltfData->buffers[i].data = nullptr;
+	}
+	gltfReleaseFile(&gltfData->memory, &gltfData->file, gltfData->file_data);
+	gltfData->file_data = nullptr;
+	gltfData->json = nullptr;
+	gltfData->json_size = 0;
+	gltfData->bin = nullptr;
+	gltfData->bin_size = 0;
+}
+
+const char sceneCacheMagic[8] = "vkrtscn";
+const uint32 sceneCacheVersion = 6;
+const uint32 sceneCacheFlagOptimizedMeshes = 1;
+const uint32 sceneCacheFlagCompressedTextures = 2;
+const uint32 sceneCacheFlagBlitMips = 4;
+
+struct SceneCacheSection {
+	uint64 offset;
+	uint64 size;
+};
+
+struct SceneCacheHeader {
+	char magic[8];
+	uint32 version;
+	uint32 flags;
+	SceneCacheSection dependencies;
+	SceneCacheSection vertices;
+	SceneCacheSection indices;
+	SceneCacheSection geometries;
+	SceneCacheSection geometryInfos;
+	SceneCacheSection meshes;
+	SceneCacheSection materials;
+	SceneCacheSection instances;
+	SceneCacheSection instanceMeshIndices;
+	SceneCacheSection images;
+	SceneCacheSection texels;
+};
+
+struct SceneCacheDependency {
+	char path[496];
+	uint64 size;
+	int64 lastWriteTime;
+};
+
+struct SceneCacheImage {
+	uint32 width;
+	uint32 height;
+	VkFormat format;
+	uint32 size;
+	uint64 offset;
+	uint32 mipLevels;
+	uint32 storedMipLevels;
+};
+
+// Keyed by the driver UUID and a content hash per mesh, each entry holds one BLAS
+// serialized with vkCmdCopyAccelerationStructureToMemoryKHR.
+const char blasCacheMagic[8] = "vkrtbls";
+const uint32 blasCacheVersion = 3;
+const uint64 blasSerializedHeaderSize = 2 * VK_UUID_SIZE + 3 * sizeof(uint64);
+
+struct BlasCacheHeader {
+	char magic[8];
+	uint32 version;
+	uint32 blasCount;
+	uint8 driverUUID[VK_UUID_SIZE];
+	SceneCacheSection entries;
+	SceneCacheSection data;
+};
+
+struct BlasCacheEntry {
+	uint64 meshHash;
+	uint64 offset;
+	uint64 size;
+};
+
+SceneCacheDependency getSceneCacheDependency(const std::filesystem::path& path) {
+	SceneCacheDependency dependency = {};
+	std::string pathStr = path.generic_string();
+	assert(pathStr.size() < sizeof(dependency.path));
+	memcpy(dependency.path, pathStr.c_str(), pathStr.size());
+	std::error_code error;
+	dependency.size = std::filesystem::file_size(path, error);
+	if (!error) {
+		dependency.lastWriteTime = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+	}
+	return dependency;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - time).count();
+}
+
+enum class BlasBuildMode {
+	Device,
+	Host,
+	Mixed
+};
+
+const char* blasBuildModeNames[] = { "device", "host", "mixed" };
+
+enum class MipGeneration {
+	Cpu,
+	Blit
+};
+
+const char* mipGenerationNames[] = { "cpu", "blit" };
+
+struct SceneLoadOptions {
+	bool rebuildCache = false;
+	bool compactBlas = true;
+	uint64 blasScratchBudget = 64_mb;
+	BlasBuildMode blasBuildMode = BlasBuildMode::Device;
+	double blasHostBuildShare = 0.25;
+	bool blasCache = true;
+	bool partitionBlas = true;
+	bool optimizeMeshes = true;
+	bool compressTextures = true;
+	MipGeneration mipGeneration = MipGeneration::Cpu;
+	bool asyncReads = true;
+	bool directStagingReads = true;
+	uint64 textureStreamingBudget = 0; // 0 keeps every texture fully resident
+};
+
+// Partitioner cost model: tracing a BLAS is estimated as the surface area of its bounds times
+// (instance overhead + BVH depth), with the instance overhead counted in BVH levels.
+const double blasInstanceTraversalCost = 2.0;
+const uint32 blasMergeMaxTriangleCount = 4096;
+const uint32 blasMergedMaxTriangleCount = 65536;
+const uint32 blasSplitMinTriangleCount = 65536;
+const uint32 blasSplitMaxDepth = 3;
+
+double blasTraceCost(double surfaceArea, uint32 triangleCount) {
+	return surfaceArea * (blasInstanceTraversalCost + std::log2(std::max(triangleCount, 1u)));
+}
+
+const uint32 minInstanceCapacity = 64;
+const uint32 tlasMaxRefitCount = 256;
+const double tlasRebuildMovedInstanceRatio = 0.25;
+
+// Streamed textures keep the mips up to textureStreamingTailSize texels resident and load finer ones on request.
+const uint32 textureStreamingTailSize = 128;
+const uint64 textureStreamingBatchSize = 64_mb;
+const uint64 textureStreamingMaxLoadSize = vkStagingBufferSize / 2;
+const uint64 textureStreamingEvictFrames = 120;
+
+const uint64 asyncReadChunkSize = 1_mb;
+const uint32 asyncReadQueueDepth = 64;
+
+// Overlapped reads completed through an I/O completion port. Requests are split into chunks and up to
+// asyncReadQueueDepth chunks are kept in flight, so many small files and large payloads are read concurrently
+// instead of one blocking read at a time. Completion callbacks run on the thread calling poll/wait.
+struct AsyncFileReader {
+	struct File {
+		HANDLE handle;
+		uint64 size;
+	};
+	struct Request {
+		uint32 fileIndex;
+		uint64 offset;
+		uint64 size;
+		uint8* dst;
+		uint64 issuedSize;
+		uint64 completedSize;
+		std::function<void()> completed;
+	};
+	struct Read {
+		OVERLAPPED overlapped;
+		uint32 requestIndex;
+		uint32 size;
+	};
+
+	HANDLE completionPort;
+	std::vector<File> files;
+	std::vector<Request> requests;
+	std::deque<uint32> pendingRequests;
+	Read reads[asyncReadQueueDepth];
+	std::vector<uint32> freeReads;
+	uint32 queueDepth = 0;
+	uint32 peakQueueDepth = 0;
+	uint64 queueDepthSum = 0;
+	uint64 readCount = 0;
+	uint64 readSize = 0;
+	double busyTime = 0;
+	std::chrono::steady_clock::time_point busyStartTime;
+
+	AsyncFileReader() {
+		completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+		assert(completionPort);
+		for (uint32 i = 0; i < asyncReadQueueDepth; i++) {
+			freeReads.push_back(asyncReadQueueDepth - 1 - i);
+		}
+	}
+
+	~AsyncFileReader() {
+		wait();
+		for (auto& file : files) {
+			CloseHandle(file.handle);
+		}
+		CloseHandle(completionPort);
+	}
+
+	// Returns UINT32_MAX when the file can't be opened.
+	uint32 openFile(const std::filesystem::path& path) {
+		HANDLE handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (handle == INVALID_HANDLE_VALUE) {
+			return UINT32_MAX;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(handle, &fileSize) || !CreateIoCompletionPort(handle, completionPort, 0, 0)) {
+			CloseHandle(handle);
+			return UINT32_MAX;
+		}
+		files.push_back(File{ .handle = handle, .size = (uint64)fileSize.QuadPart });
+		return (uint32)files.size() - 1;
+	}
+
+	void read(uint32 fileIndex, uint64 offset, uint64 size, uint8* dst, std::function<void()> completed = nullptr) {
+		assert(offset + size <= files[fileIndex].size);
+		requests.push_back(Request{ .fileIndex = fileIndex, .offset = offset, .size = size, .dst = dst, .completed = std::move(completed) });
+		if (size == 0) {
+			if (requests.back().completed) {
+				requests.back().completed();
+			}
+			return;
+		}
+		pendingRequests.push_back((uint32)requests.size() - 1);
+		submit();
+	}
+
+	void submit() {
+		while (!pendingRequests.empty() && !freeReads.empty()) {
+			uint32 requestIndex = pendingRequests.front();
+			Request& request = requests[requestIndex];
+			uint32 readIndex = freeReads.back();
+			freeReads.pop_back();
+			Read& read = reads[readIndex];
+			uint64 offset = request.offset + request.issuedSize;
+			read = { .requestIndex = requestIndex, .size = (uint32)std::min(request.size - request.issuedSize, asyncReadChunkSize) };
+			read.overlapped.Offset = (DWORD)offset;
+			read.overlapped.OffsetHigh = (DWORD)(offset >> 32);
+			BOOL result = ReadFile(files[request.fileIndex].handle, request.dst + request.issuedSize, read.size, nullptr, &read.overlapped);
+			assert(result || GetLastError() == ERROR_IO_PENDING);
+			request.issuedSize += read.size;
+			if (request.issuedSize == request.size) {
+				pendingRequests.pop_front();
+			}
+			if (queueDepth == 0) {
+				busyStartTime = std::chrono::steady_clock::now();
+			}
+			queueDepth++;
+			peakQueueDepth = std::max(peakQueueDepth, queueDepth);
+			queueDepthSum += queueDepth;
+			readCount++;
+		}
+	}
+
+	// Processes finished reads and tops the queue back up, returns whether any read finished.
+	bool poll(bool block = false) {
+		if (queueDepth == 0) {
+			return false;
+		}
+		OVERLAPPED_ENTRY entries[asyncReadQueueDepth];
+		ULONG entryCount = 0;
+		if (!GetQueuedCompletionStatusEx(completionPort, entries, countof(entries), &entryCount, block ? INFINITE : 0, FALSE)) {
+			return false;
+		}
+		for (ULONG i = 0; i < entryCount; i++) {
+			Read& read = *CONTAINING_RECORD(entries[i].lpOverlapped, Read, overlapped);
+			assert(read.overlapped.Internal == 0 && entries[i].dwNumberOfBytesTransferred == read.size);
+			Request& request = requests[read.requestIndex];
+			request.completedSize += read.size;
+			readSize += read.size;
+			freeReads.push_back((uint32)(&read - reads));
+			queueDepth--;
+			if (queueDepth == 0) {
+				busyTime += secondsSince(busyStartTime);
+			}
+			if (request.completedSize == request.size && request.completed) {
+				request.completed();
+			}
+		}
+		submit();
+		return entryCount > 0;
+	}
+
+	void wait() {
+		while (queueDepth > 0) {
+			poll(true);
+		}
+	}
+
+	void printStats(const char* name) {
+		if (readCount == 0) {
+			return;
+		}
+		printf("%s: %.1f MB in %llu reads, %.1f MB/s, queue depth avg %.1f peak %u\n", name, readSize / (double)1_mb, readCount,
+			busyTime > 0 ? readSize / (double)1_mb / busyTime : 0.0, queueDepthSum / (double)readCount, peakQueueDepth);
+	}
+};
+
+const uint64 streamingLoaderHostMemoryBudget = 256_mb;
+const uint64 streamingLoaderChunkSize = 16_mb;
+const uint64 streamingLoaderBatchSize = 64_mb;
+
+// Streams buffers and images to the gpu through the staging ring on the transfer queue.
+// Items with a decode function are decoded on the job system, at most hostMemoryBudget bytes at a time,
+// copied into the staging ring in chunks, and released once staged. Copies are submitted every batchSize bytes
+// so several batches are in flight, the staging ring blocks on the oldest batch when it runs out of space.
+// An item's encoded file is read on the async reader when the item is admitted, so it counts against
+// hostMemoryBudget along with the decode. Items backed by a file region are read straight into the staging ring
+// and their batch is submitted once the reads land.
+struct StreamingLoader {
+	struct Item {
+		VkBuffer buffer;
+		VkImage image;
+		uint32 width;
+		uint32 height;
+		VkFormat format;
+		uint32 mipLevels = 1; // mips in data, laid out as by imageMipSize
+		uint64 size;
+		const uint8* data;
+		uint32 fileIndex = UINT32_MAX;
+		uint64 fileOffset;
+		std::function<uint8*(std::span<const uint8> encoded)> decode; // returned data is released with stbi_image_free
+		uint32 encodedFileIndex = UINT32_MAX;
+		std::vector<uint8> encoded;
+		uint64 hostMemorySize; // charged to hostMemoryUsage from admission until staged
+	};
+
+	Vulkan* vk;
+	JobSystem* jobSystem;
+	uint64 hostMemoryBudget;
+	AsyncFileReader reader;
+	std::vector<Item> items;
+	std::function<void(uint32 itemIndex, const uint8* data)> itemStaged;
+
+	VkCommandBuffer cmdBuf = nullptr;
+	uint64 cmdBufSize = 0;
+	std::mutex readyItemsMutex;
+	std::deque<uint32> readyItems;
+	uint64 hostMemoryUsage = 0;
+	uint64 peakHostMemoryUsage = 0;
+	uint64 stagedSize = 0;
+	uint32 submitCount = 0;
+
+	StreamingLoader(Vulkan* vk, JobSystem* jobSystem, uint64 hostMemoryBudget = streamingLoaderHostMemoryBudget)
+		: vk(vk), jobSystem(jobSystem), hostMemoryBudget(hostMemoryBudget) {}
+
+	void addBuffer(VkBuffer buffer, const void* data, uint64 size) {
+		items.push_back(Item{ .buffer = buffer, .size = size, .data = (const uint8*)data });
+	}
+
+	void addFileBuffer(VkBuffer buffer, uint32 fileIndex, uint64 fileOffset, uint64 size) {
+		items.push_back(Item{ .buffer = buffer, .size = size, .fileIndex = fileIndex, .fileOffset = fileOffset });
+	}
+
+	void addImage(VkImage vkImage, const Image& image, std::function<uint8*(std::span<const uint8>)> decode = nullptr, uint32 encodedFileIndex = UINT32_MAX) {
+		Item item = {
+			.image = vkImage,
+			.width = image.width,
+			.height = image.height,
+			.format = image.format,
+			.mipLevels = image.storedMipLevels,
+			.size = image.size,
+			.data = decode ? nullptr : image.data,
+			.decode = std::move(decode),
+			.encodedFileIndex = encodedFileIndex
+		};
+		items.push_back(std::move(item));
+	}
+
+	void addFileImage(VkImage vkImage, const Image& image, uint32 fileIndex, uint64 fileOffset) {
+		addImage(vkImage, image);
+		items.back().data = nullptr;
+		items.back().fileIndex = fileIndex;
+		items.back().fileOffset = fileOffset;
+	}
+
+	// Host memory a decode holds at once: the RGBA level 0 and its cpu mips, plus the output chain, which is
+	// compressed and far smaller than the RGBA working set for BC formats.
+	static uint64 decodeHostMemorySize(const Item& item) {
+		return (uint64)item.width * item.height * 4 * 4 / 3 + item.size;
+	}
+
+	// Returns the upload semaphore value that signals when every item is on the gpu.
+	// Items are released to the graphics queue, the next graphics command buffer acquires them.
+	uint64 run() {
+		cmdBuf = vk->beginUploadCmdBuf();
+		std::vector<VkImageMemoryBarrier> imageBarriers;
+		for (auto& item : items) {
+			if (item.image) {
+				VkImageMemoryBarrier imageBarrier = {
+					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+					.srcAccessMask = 0,
+					.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+					.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+					.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.image = item.image,
+					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1 }
+				};
+				imageBarriers.push_back(imageBarrier);
+			}
+		}
+		vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, (uint32)imageBarriers.size(), imageBarriers.data());
+
+		TaskGraph graph(jobSystem);
+		auto decodeItem = [this, &graph](uint32 itemIndex) {
+			graph.add([this, itemIndex] {
+				uint8* data = items[itemIndex].decode(items[itemIndex].encoded);
+				items[itemIndex].encoded = {};
+				std::lock_guard lock(readyItemsMutex);
+				items[itemIndex].data = data;
+				readyItems.push_back(itemIndex);
+			});
+		};
+		uint32 issuedItemCount = 0;
+		uint32 stagedItemCount = 0;
+		while (stagedItemCount < items.size()) {
+			for (; issuedItemCount < items.size(); issuedItemCount++) {
+				uint32 itemIndex = issuedItemCount;
+				Item& item = items[itemIndex];
+				if (item.decode) {
+					uint64 encodedSize = item.encodedFileIndex != UINT32_MAX ? reader.files[item.encodedFileIndex].size : 0;
+					uint64 hostMemorySize = encodedSize + decodeHostMemorySize(item);
+					if (hostMemoryUsage > 0 && hostMemoryUsage + hostMemorySize > hostMemoryBudget) {
+						break;
+					}
+					item.hostMemorySize = hostMemorySize;
+					hostMemoryUsage += hostMemorySize;
+					peakHostMemoryUsage = std::max(peakHostMemoryUsage, hostMemoryUsage);
+					if (encodedSize > 0) {
+						item.encoded.resize(encodedSize);
+						reader.read(item.encodedFileIndex, 0, encodedSize, item.encoded.data(), [decodeItem, itemIndex] { decodeItem(itemIndex); });
+					}
+					else {
+						decodeItem(itemIndex);
+					}
+				}
+				else {
+					std::lock_guard lock(readyItemsMutex);
+					readyItems.push_back(itemIndex);
+				}
+			}
+			uint32 itemIndex = UINT32_MAX;
+			{
+				std::lock_guard lock(readyItemsMutex);
+				if (!readyItems.empty()) {
+					itemIndex = readyItems.front();
+					readyItems.pop_front();
+				}
+			}
+			if (itemIndex == UINT32_MAX) {
+				if (!reader.poll() && !jobSystem->runTask()) {
+					std::this_thread::yield();
+				}
+				continue;
+			}
+			Item& item = items[itemIndex];
+			stageItem(item);
+			if (itemStaged) {
+				itemStaged(itemIndex, item.data);
+			}
+			if (item.decode) {
+				stbi_image_free((void*)item.data);
+				item.data = nullptr;
+				hostMemoryUsage -= item.hostMemorySize;
+			}
+			stagedItemCount++;
+		}
+		graph.wait();
+		reader.wait();
+
+		std::vector<VkImage> images;
+		std::vector<VkBuffer> buffers;
+		for (auto& item : items) {
+			if (item.image) {
+				images.push_back(item.image);
+			}
+			else if (item.size > 0) {
+				buffers.push_back(item.buffer);
+			}
+		}
+		vk->releaseUploads(cmdBuf, images, buffers);
+		uint64 semaphoreValue = vk->submitUploadCmdBuf(cmdBuf);
+		submitCount++;
+		cmdBuf = nullptr;
+		printf("streaming loader: %.1f MB in %u batches, peak decode host memory %.1f MB\n", stagedSize / (double)1_mb, submitCount, peakHostMemoryUsage / (double)1_mb);
+		reader.printStats("async reads");
+		return semaphoreValue;
+	}
+
+	void stageItem(const Item& item) {
+		uint64 levelOffset = 0;
+		for (uint32 level = 0; level < item.mipLevels; level++) {
+			uint32 width = std::max(item.width >> level, 1u);
+			uint32 height = std::max(item.height >> level, 1u);
+			uint64 rowSize = item.image ? imageRowSize(item.format, width) : 1;
+			uint32 rowHeight = item.image ? imageRowHeight(item.format) : 1;
+			uint64 levelSize = item.image ? imageMipSize(item.format, width, height) : item.size;
+			uint64 offset = 0;
+			while (offset < levelSize) {
+				uint64 chunkSize = std::min(levelSize - offset, std::max(streamingLoaderChunkSize / rowSize, (uint64)1) * rowSize);
+				Vulkan::StagingAllocation staging = vk->stagingAlloc(chunkSize);
+				if (!staging.ptr) {
+					submitBatch();
+					continue;
+				}
+				if (item.fileIndex != UINT32_MAX) {
+					reader.read(item.fileIndex, item.fileOffset + levelOffset + offset, chunkSize, staging.ptr);
+				}
+				else {
+					parallelMemcpy(jobSystem, staging.ptr, item.data + levelOffset + offset, chunkSize);
+				}
+				if (item.image) {
+					uint32 y = (uint32)(offset / rowSize * rowHeight);
+					VkBufferImageCopy imageCopy = {
+						.bufferOffset = staging.offset,
+						.imageSubresource = {
+							.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+							.mipLevel = level,
+							.baseArrayLayer = 0,
+							.layerCount = 1
+						},
+						.imageOffset = { 0, (int32)y, 0 },
+						.imageExtent = { width, std::min((uint32)(chunkSize / rowSize * rowHeight), height - y), 1 }
+					};
+					vkCmdCopyBufferToImage(cmdBuf, vk->stagingBuffer, item.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &imageCopy);
+				}
+				else {
+					VkBufferCopy bufferCopy = {
+						.srcOffset = staging.offset,
+						.dstOffset = offset,
+						.size = chunkSize
+					};
+					vkCmdCopyBuffer(cmdBuf, vk->stagingBuffer, item.buffer, 1, &bufferCopy);
+				}
+				offset += chunkSize;
+				stagedSize += chunkSize;
+				cmdBufSize += chunkSize;
+				if (cmdBufSize >= streamingLoaderBatchSize) {
+					submitBatch();
+				}
+			}
+			levelOffset += levelSize;
+		}
+	}
+
+	void submitBatch() {
+		reader.wait();
+		vk->submitUploadCmdBuf(cmdBuf);
+		submitCount++;
+		cmdBuf = vk->beginUploadCmdBuf();
+		cmdBufSize = 0;
+	}
+};
+
+struct Scene {
+	std::filesystem::path filePath;
+	Camera camera;
+	std::vector<Model> models;
+	std::vector<Light> lights;
+
+	std::vector<Vertex> verticesData;
+	std::vector<uint16> indicesData;
+	std::span<const Vertex> vertices;
+	std::span<const uint16> indices;
+	std::vector<PackedVertex> packedVertices;
+	std::vector<IndexClusters> indexClusters;
+	std::vector<Geometry> geometries;
+	std::vector<GeometryInfo> geometryInfos;
+	std::vector<Mesh> meshes;
+	std::vector<Material> materials;
+	std::vector<Instance> instances;
+	std::vector<uint32> instanceMeshIndices;
+	std::vector<Image> images;
+	std::vector<std::filesystem::path> imageFilePaths;
+	std::vector<uint64> imageHashes;
+	std::vector<SceneCacheDependency> cacheDependencies;
+	FileMapping cacheMapping;
+	std::ofstream cacheFile;
+	SceneCacheHeader cacheHeader;
+	std::vector<SceneCacheImage> cacheImages;
+	JobSystem* jobSystem;
+
+	VkBuffer verticesBuffer;
+	VkBuffer indicesBuffer;
+	VkBuffer geometriesBuffer;
+	VkBuffer materialsBuffer;
+	VkBuffer instancesBuffer;
+	VkBuffer triangleLodsBuffer;
+	std::vector<std::pair<VkImage, VkImageView>> textures;
+
+	VkBuffer blasBuffer;
+	VkBuffer hostBlasBuffer;
+	std::vector<VkAccelerationStructureKHR> blas;
+	VkBuffer tlasBuffer;
+	VkAccelerationStructureKHR tlas;
+	VkBuffer tlasBuildInstancesBuffer;
+	VkBuffer tlasScratchBuffer;
+	VkBuffer scratchBuffer;
+	std::vector<VkDeviceAddress> blasDeviceAddresses;
+
+	std::vector<VkAccelerationStructureInstanceKHR> tlasInstances;
+	uint32 instanceCapacity;
+	std::vector<uint32> freeInstanceSlots;
+	std::vector<uint32> dirtyInstances;
+	std::vector<uint8> instanceDirtyFlags;
+	std::vector<uint8> instanceMovedFlags;
+	uint32 movedInstanceCount;
+	uint32 tlasBuiltInstanceCount;
+	uint32 tlasRefitCount;
+	uint64 tlasUpdateCount;
+	uint64 tlasRebuildCount;
+	uint32 alphaMaskGeometryCount;
+	bool alphaMaskEnabled = true;
+	struct {
+		VkBuffer buffer;
+		uint8* mappedPtr;
+		uint64 capacity;
+	} instanceUploadBuffers[vkMaxFrameInFlight];
+	std::vector<VkBuffer> retiredBuffers[vkMaxFrameInFlight];
+	std::vector<VkAccelerationStructureKHR> retiredAccelerationStructures[vkMaxFrameInFlight];
+
+	struct StreamedTexture {
+		uint32 tailLevel;
+		uint32 residentLevel; // finest mip bound in textures, mipLevels while blankTexture is bound
+		uint32 requestedLevel;
+		uint64 requestFrame;
+		bool loading;
+		std::pair<VkImage, VkImageView> tail; // mips from tailLevel, kept once loaded
+		std::pair<VkImage, VkImageView> detail; // mips from residentLevel when finer than the tail
+	};
+	struct TextureLoad {
+		uint32 imageIndex;
+		uint32 level;
+		bool tail;
+		std::pair<VkImage, VkImageView> image;
+		uint64 stagingOffset;
+	};
+	std::vector<StreamedTexture> streamedTextures; // empty unless streaming
+	std::vector<TextureLoad> textureLoads; // being copied into the staging ring by textureLoadGraph
+	std::vector<TextureLoad> uploadedTextureLoads; // submitted, swapped in once the next frame acquired them
+	std::unique_ptr<TaskGraph> textureLoadGraph;
+	uint64 textureStreamingBudget;
+	uint64 textureStreamingResidentSize;
+	std::vector<std::pair<VkImage, VkImageView>> retiredTextures[vkMaxFrameInFlight];
+	struct {
+		VkBuffer buffer;
+		uint8* mappedPtr;
+	} textureFeedbackBuffers[vkMaxFrameInFlight];
+
+	static Scene* create(const std::filesystem::path& filePath, Vulkan* vk, JobSystem* jobSystem, const SceneLoadOptions& options = {}) {
+		auto loadStartTime = std::chrono::steady_clock::now();
+		Scene* scene = new Scene();
+		scene->filePath = filePath;
+		scene->jobSystem = jobSystem;
+		scene->loadJson();
+		std::filesystem::path cachePath = std::filesystem::path(filePath).replace_extension(".vkrtscene");
+		bool compressTextures = options.compressTextures && vk->textureCompressionBC;
+		uint32 cacheFlags = (options.optimizeMeshes ? sceneCacheFlagOptimizedMeshes : 0) | (compressTextures ? sceneCacheFlagCompressedTextures : 0) |
+			(options.mipGeneration == MipGeneration::Blit ? sceneCacheFlagBlitMips : 0);
+		bool cacheHit = !options.rebuildCache && scene->loadCache(cachePath, cacheFlags);
+		if (!cacheHit) {
+			scene->loadModelsData();
+			if (options.optimizeMeshes) {
+				scene->optimizeMeshes();
+			}
+			scene->deduplicateContent();
+			scene->chooseTextureLayouts(vk, compressTextures, options.mipGeneration);
+			scene->beginCache(cachePath, cacheFlags);
+		}
+		if (options.partitionBlas) {
+			scene->partitionMeshes();
+		}
+		double loadTime = secondsSince(loadStartTime);
+		auto uploadStartTime = std::chrono::steady_clock::now();
+		uint64 buildSemaphoreValue = scene->buildVkResources(vk, options);
+		vk->waitSemaphore(vk->graphicsTimeline, buildSemaphoreValue);
+		if (scene->scratchBuffer) {
+			vk->destroyBuffer(scene->scratchBuffer);
+		}
+		double uploadTime = secondsSince(uploadStartTime);
+		if (!cacheHit) {
+			scene->finishCache(cachePath);
+		}
+		// Streamed textures keep loading their mips from the cache mapping.
+		if (scene->streamedTextures.empty()) {
+			scene->cacheMapping.unmap();
+			scene->images.clear();
+		}
+		scene->vertices = {};
+		scene->indices = {};
+		scene->imageFilePaths.clear();
+		scene->imageHashes.clear();
+		printf("scene \"%s\": %s %.1f ms, %supload %.1f ms\n", filePath.generic_string().c_str(), cacheHit ? "cache load" : "load/convert", loadTime * 1000, cacheHit ? "" : "decode/", uploadTime * 1000);
+		return scene;
+	}
+
+	void destroy(Vulkan* vk) {
+		vkQueueWaitIdle(vk->graphicsQueue);
+		vkQueueWaitIdle(vk->transferQueue);
+		if (textureLoadGraph) {
+			textureLoadGraph->wait();
+		}
+		vkDestroyAccelerationStructure(vk->device, tlas, nullptr);
+		for (auto& as : blas) {
+			vkDestroyAccelerationStructure(vk->device, as, nullptr);
+		}
+		for (VkBuffer buffer : { verticesBuffer, indicesBuffer, geometriesBuffer, materialsBuffer, instancesBuffer, triangleLodsBuffer, tlasBuffer, tlasBuildInstancesBuffer, tlasScratchBuffer }) {
+			vk->destroyBuffer(buffer);
+		}
+		for (VkBuffer buffer : { blasBuffer, hostBlasBuffer }) {
+			if (buffer) {
+				vk->destroyBuffer(buffer);
+			}
+		}
+		for (uint32 frameIndex = 0; frameIndex < vkMaxFrameInFlight; frameIndex++) {
+			if (instanceUploadBuffers[frameIndex].buffer) {
+				vk->destroyBuffer(instanceUploadBuffers[frameIndex].buffer);
+			}
+			for (VkBuffer buffer : retiredBuffers[frameIndex]) {
+				vk->destroyBuffer(buffer);
+			}
+			for (VkAccelerationStructureKHR as : retiredAccelerationStructures[frameIndex]) {
+				vkDestroyAccelerationStructure(vk->device, as, nullptr);
+			}
+			vk->destroyBuffer(textureFeedbackBuffers[frameIndex].buffer);
+		}
+		std::vector<std::pair<VkImage, VkImageView>> destroyTextures;
+		if (streamedTextures.empty()) {
+			destroyTextures = textures;
+		}
+		for (auto& texture : streamedTextures) {
+			for (auto& imageAndView : { texture.tail, texture.detail }) {
+				if (imageAndView.first) destroyTextures.push_back(imageAndView);
+			}
+		}
+		for (auto& load : textureLoads) destroyTextures.push_back(load.image);
+		for (auto& load : uploadedTextureLoads) destroyTextures.push_back(load.image);
+		for (auto& retired : retiredTextures) {
+			destroyTextures.insert(destroyTextures.end(), retired.begin(), retired.end());
+		}
+		for (auto& [image, view] : destroyTextures) {
+			vkDestroyImageView(vk->device, view, nullptr);
+			vk->destroyImage(image);
+		}
+		cacheMapping.unmap();
+		for (auto& model : models) {
+			if (model.gltfData) {
+				cgltf_free(model.gltfData);
+			}
+		}
+	}
+
+	void loadJson() {
+		std::ifstream file(filePath);
+		nlohmann::json json;
+		file >> json;
+		auto jCamera = json["camera"];
+		if (!jCamera.is_null()) {
+			auto position = jCamera["position"];
+			auto view = jCamera["view"];
+			camera.position = XMVectorSet(position[0], position[1], position[2], 0);
+			camera.view = XMVector3Normalize(XMVectorSet(view[0], view[1], view[2], 0));
+			camera.viewMat = XMMatrixLookAtRH(camera.position, camera.position + camera.view, XMVectorSet(0, 1, 0, 0));
+			camera.projMat = XMMatrixPerspectiveFovRH((float)80.0_deg, 1920.0f / 1080.0f, 0.1f, 1000.0f);
+			camera.viewProjMat = camera.viewMat * camera.projMat;
+		}
+		auto jModels = json["models"];
+		if (!jModels.is_null()) {
+			for (auto& jModel : jModels) {
+				Model m = {
+					.name = jModel["name"],
+					.filePath = std::string(jModel["path"])
+				};
+				models.push_back(m);
+			}
+		}
+		auto jLights = json["lights"];
+		if (!jLights.is_null()) {
+			for (auto& light : jLights) {
+				auto type = light["type"];
+				if (type.is_string() && type == "point") {
+					auto position = light["position"];
+					auto color = light["color"];
+					Light l = {
+						.position = { position[0], position[1], position[2] },
+						.color = { color[0], color[1], color[2] }
+					};
+					lights.push_back(l);
+				}
+			}
+		}
+	}
+
+	void loadModelsData() {
+		TaskGraph graph(jobSystem);
+		std::vector<Task*> parseTasks;
+		for (auto& model : models) {
+			parseTasks.push_back(graph.add([this, &model, &graph] {
+				parseModel(model);
+				for (size_t imageIndex = 0; imageIndex < model.images.size(); imageIndex++) {
+					graph.add([this, &model, imageIndex] { loadModelImageInfo(model, imageIndex); });
+				}
+			}));
+		}
+		graph.add([this, &graph] { bakeModelsData(graph); }, parseTasks);
+		graph.wait();
+		indexClusters = {};
+		for (auto& model : models) {
+			gltfReleaseBuffers(model.gltfData);
+			images.insert(images.end(), model.images.begin(), model.images.end());
+			imageHashes.insert(imageHashes.end(), model.imageHashes.begin(), model.imageHashes.end());
+			for (size_t i = 0; i < model.gltfData->images_count; i++) {
+				imageFilePaths.push_back((filePath.parent_path() / model.filePath).parent_path() / model.gltfData->images[i].uri);
+			}
+		}
+		vertices = verticesData;
+		indices = indicesData;
+		collectCacheDependencies();
+	}
+
+	void parseModel(Model& model) {
+		std::filesystem::path modelFilePath = filePath.parent_path() / model.filePath;
+		std::string modelFilePathStr = modelFilePath.generic_string();
+		cgltf_options gltfOption = gltfMappedFileOptions();
+		cgltf_result parseFileResult = cgltf_parse_file(&gltfOption, modelFilePathStr.c_str(), &model.gltfData);
+		assert(parseFileResult == cgltf_result_success);
+		assert(model.gltfData->scene);
+		cgltf_result loadBuffersResult = cgltf_load_buffers(&gltfOption, model.gltfData, modelFilePathStr.c_str());
+		assert(loadBuffersResult == cgltf_result_success);
+		model.images.resize(model.gltfData->images_count);
+		model.imageHashes.resize(model.gltfData->images_count);
+	}
+
+	void loadModelImageInfo(Model& model, size_t imageIndex) {
+		auto& gltfImage = model.gltfData->images[imageIndex];
+		int width, height, comp;
+		std::filesystem::path imagePath = (filePath.parent_path() / model.filePath).parent_path() / gltfImage.uri;
+		int result = stbi_info(imagePath.generic_string().c_str(), &width, &height, &comp);
+		assert(result);
+		FileMapping imageFile;
+		if (imageFile.map(imagePath)) {
+			model.imageHashes[imageIndex] = hashBytes(imageFile.data, imageFile.size);
+			imageFile.unmap();
+		}
+		VkFormat format =
+			comp == 1 ? VK_FORMAT_R8_UNORM :
+			comp == 2 ? VK_FORMAT_R8G8_UNORM :
+			comp == 3 ? VK_FORMAT_R8G8B8A8_SRGB :
+			comp == 4 ? VK_FORMAT_R8G8B8A8_SRGB :
+			VK_FORMAT_UNDEFINED;
+		assert(format != VK_FORMAT_UNDEFINED);
+		model.images[imageIndex] = {
+			.width = (uint32)width,
+			.height = (uint32)height,
+			.format = format,
+			.size = (uint32)(width * height * (comp == 3 ? 4 : comp)),
+			.data = nullptr,
+			.components = (uint32)comp,
+			.mipLevels = 1,
+			.storedMipLevels = 1
+		};
+	}
+
+	// Decodes from the already read file contents when given, otherwise reads the file itself.
+	uint8* decodeImage(uint32 imageIndex, std::span<const uint8> encoded) {
+		int width, height, comp;
+		stbi_uc* data = encoded.empty() ?
+			stbi_load(imageFilePaths[imageIndex].generic_string().c_str(), &width, &height, &comp, 0) :
+			stbi_load_from_memory(encoded.data(), (int)encoded.size(), &width, &height, &comp, 0);
+		assert(data);
+		assert((uint32)width == images[imageIndex].width && (uint32)height == images[imageIndex].height);
+		if (comp == 3) {
+			data = (stbi_uc*)STBI_REALLOC(data, (uint64)width * height * 4);
+			assert(data);
+			expandRGBToRGBA(data, (uint64)width * height);
+		}
+		const Image& image = images[imageIndex];
+		uint32 components = comp == 3 ? 4 : comp;
+		if (image.storedMipLevels == 1 && !blockCompressedSize(image.format)) {
+			return data;
+		}
+		std::vector<std::vector<uint8>> mips(image.storedMipLevels);
+		for (uint32 level = 1; level < image.storedMipLevels; level++) {
+			uint32 mipWidth = std::max(image.width >> level, 1u);
+			uint32 mipHeight = std::max(image.height >> level, 1u);
+			const uint8* src = level == 1 ? data : mips[level - 1].data();
+			mips[level].resize((uint64)mipWidth * mipHeight * components);
+			downsampleImage(mips[level].data(), src, std::max(image.width >> (level - 1), 1u), std::max(image.height >> (level - 1), 1u), components, isSrgbFormat(image.format));
+		}
+		uint8* mipChain = (uint8*)STBI_MALLOC(image.size);
+		assert(mipChain);
+		TaskGraph graph(jobSystem);
+		uint64 offset = 0;
+		for (uint32 level = 0; level < image.storedMipLevels; level++) {
+			uint32 mipWidth = std::max(image.width >> level, 1u);
+			uint32 mipHeight = std::max(image.height >> level, 1u);
+			const uint8* src = level == 0 ? data : mips[level].data();
+			if (blockCompressedSize(image.format)) {
+				uint32 blockRowCount = (mipHeight + 3) / 4;
+				for (uint32 blockRow = 0; blockRow < blockRowCount; blockRow += textureCompressionTaskBlockRows) {
+					graph.add([&image, dst = mipChain + offset, src, mipWidth, mipHeight, components, blockRow, blockRowCount] {
+						compressImageBlocks(dst, src, mipWidth, mipHeight, components, image.format, blockRow, std::min(blockRow + textureCompressionTaskBlockRows, blockRowCount));
+					});
+				}
+			}
+			else {
+				memcpy(mipChain + offset, src, (uint64)mipWidth * mipHeight * components);
+			}
+			offset += imageMipSize(image.format, mipWidth, mipHeight);
+		}
+		graph.wait();
+		assert(offset == image.size);
+		stbi_image_free(data);
+		return mipChain;
+	}
+
+	// Picks the gpu format and mip layout of every texture. Compressed formats follow the channel count and material
+	// usage: alpha is kept (BC7) only for base color textures of alpha masked materials, other color textures drop it (BC1).
+	// Textures get full mip chains, filtered on the cpu and cached unless blit generation is asked for and the format allows it.
+	void chooseTextureLayouts(Vulkan* vk, bool compress, MipGeneration mipGeneration) {
+		std::vector<bool> alphaUsed(images.size());
+		for (auto& material : materials) {
+			if (material.alphaMask && material.baseColorTextureIndex != UINT32_MAX) {
+				alphaUsed[material.baseColorTextureIndex] = true;
+			}
+		}
+		for (size_t imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+			Image& image = images[imageIndex];
+			if (compress) {
+				image.format =
+					image.components == 1 ? VK_FORMAT_BC4_UNORM_BLOCK :
+					image.components == 2 ? VK_FORMAT_BC5_UNORM_BLOCK :
+					image.components == 4 && alphaUsed[imageIndex] ? VK_FORMAT_BC7_SRGB_BLOCK :
+					VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+			}
+			image.mipLevels = fullMipLevels(image.width, image.height);
+			image.storedMipLevels = mipGeneration == MipGeneration::Blit && vk->formatSupportsBlit(image.format) ? 1 : image.mipLevels;
+			image.size = (uint32)imageMipChainSize(image.format, image.width, image.height, image.storedMipLevels);
+		}
+	}
+
+	void printTextureStats() {
+		uint32 formatCounts[5] = {};
+		uint64 size = 0;
+		uint64 uncompressedSize = 0;
+		for (auto& image : images) {
+			VkFormat format = image.format;
+			formatCounts[format == VK_FORMAT_BC1_RGB_SRGB_BLOCK ? 0 : format == VK_FORMAT_BC4_UNORM_BLOCK ? 1 : format == VK_FORMAT_BC5_UNORM_BLOCK ? 2 : format == VK_FORMAT_BC7_SRGB_BLOCK ? 3 : 4]++;
+			size += imageMipChainSize(format, image.width, image.height, image.mipLevels);
+			uncompressedSize += imageMipChainSize(VK_FORMAT_R8G8B8A8_UNORM, image.width, image.height, image.mipLevels) / 4 * uncompressedTexelSize(format);
+		}
+		if (!images.empty()) {
+			printf("textures: %u bc1, %u bc4, %u bc5, %u bc7, %u uncompressed, gpuTexturesMemory %.1f MB of texels, %.1f MB uncompressed, %.1f MB saved\n",
+				formatCounts[0], formatCounts[1], formatCounts[2], formatCounts[3], formatCounts[4],
+				size / (double)1_mb, uncompressedSize / (double)1_mb, (uncompressedSize - size) / (double)1_mb);
+		}
+	}
+
+	void bakeModelsData(TaskGraph& graph) {
+		struct PrimitivePack {
+			cgltf_primitive* primitive;
+			uint32 geometryIndex;
+			uint32 clustersIndex;
+		};
+		std::vector<PrimitivePack> primitivePacks;
+		uint32 clusteredPrimitiveCount = 0;
+		uint32 clusterCount = 0;
+		uint64 duplicatedVertexCount = 0;
+		uint32 wideIndexPrimitiveCount = 0;
+		for (auto& model : models) {
+			uint32 meshOffset = (uint32)meshes.size();
+			uint32 materialOffset = (uint32)materials.size();
+			for (size_t meshIndex = 0; meshIndex < model.gltfData->meshes_count; meshIndex++) {
+				auto& gltfMesh = model.gltfData->meshes[meshIndex];
+				Mesh& mesh = meshes.emplace_back(Mesh{ .geometryOffset = (uint32)geometries.size(), .geometryCount = 0 });
+				for (size_t primitiveIndex = 0; primitiveIndex < gltfMesh.primitives_count; primitiveIndex++) {
+					auto& primitive = gltfMesh.primitives[primitiveIndex];
+					PrimitiveVerticesData primitiveData = getPrimitiveVerticesData(primitive);
+					uint32 materialIndex = (uint32)(materialOffset + std::distance(model.gltfData->materials, primitive.material));
+					uint32 vertexCount = (uint32)primitiveData.positions->count;
+					uint32 indexCount = (uint32)primitiveData.indices->count;
+					auto addGeometry = [&](uint32 geometryVertexCount, uint32 geometryIndexCount, uint32 indexStride) {
+						geometries.push_back(Geometry{
+							.vertexOffset = (uint32)verticesData.size(),
+							.indexOffset = (uint32)indicesData.size(),
+							.materialIndex = materialIndex,
+							.indexStride = indexStride
+						});
+						geometryInfos.push_back(GeometryInfo{ .vertexCount = geometryVertexCount, .indexCount = geometryIndexCount });
+						verticesData.resize(verticesData.size() + geometryVertexCount);
+						indicesData.resize(indicesData.size() + geometryIndexCount * indexStride);
+						mesh.geometryCount += 1;
+					};
+					PrimitivePack& pack = primitivePacks.emplace_back(PrimitivePack{ .primitive = &primitive, .geometryIndex = (uint32)geometries.size(), .clustersIndex = UINT32_MAX });
+					if (vertexCount <= indexClusterMaxVertexCount) {
+						addGeometry(vertexCount, indexCount, 1);
+						continue;
+					}
+					// Keep 16 bit indices unless the duplicated border vertices cost more than widening the indices.
+					std::vector<uint32> sourceIndices(indexCount);
+					readIndices(primitiveData.indices, sourceIndices.data());
+					IndexClusters clusters = clusterIndices(sourceIndices, vertexCount);
+					uint64 clusteredSize = clusters.vertices.size() * sizeof(PackedVertex) + indexCount * sizeof(uint16);
+					uint64 wideSize = vertexCount * sizeof(PackedVertex) + indexCount * sizeof(uint32);
+					if (clusteredSize <= wideSize) {
+						for (auto& cluster : clusters.clusters) {
+							addGeometry(cluster.vertexCount, cluster.indexCount, 1);
+						}
+						clusteredPrimitiveCount += 1;
+						clusterCount += (uint32)clusters.clusters.size();
+						duplicatedVertexCount += clusters.vertices.size() - vertexCount;
+						pack.clustersIndex = (uint32)indexClusters.size();
+						indexClusters.push_back(std::move(clusters));
+					}
+					else {
+						if (indicesData.size() % 2) {
+							indicesData.push_back(0);
+						}
+						addGeometry(vertexCount, indexCount, 2);
+						wideIndexPrimitiveCount += 1;
+					}
+				}
+			}
+			materials.resize(materials.size() + model.gltfData->materials_count);
+			{
+				std::stack<cgltf_node*> nodes;
+				std::stack<XMMATRIX> transforms;
+				for (size_t nodeIndex = 0; nodeIndex < model.gltfData->scene->nodes_count; nodeIndex++) {
+					cgltf_node* node = model.gltfData->scene->nodes[nodeIndex];
+					nodes.push(node);
+					transforms.push(getNodeTransformMat(node));
+				}
+				while (!nodes.empty()) {
+					cgltf_node* node = nodes.top();
+					XMMATRIX transform = transforms.top();
+					nodes.pop();
+					transforms.pop();
+					if (node->mesh) {
+						uint32 meshIndex = meshOffset + (uint32)std::distance(model.gltfData->meshes, node->mesh);
+						Instance instance;
+						memcpy(instance.transform, transform.r, sizeof(transform));
+						instance.geometryOffset = meshes[meshIndex].geometryOffset;
+						instances.push_back(instance);
+						instanceMeshIndices.push_back(meshIndex);
+					}
+					for (size_t childIndex = 0; childIndex < node->children_count; childIndex++) {
+						cgltf_node* childNode = node->children[childIndex];
+						nodes.push(childNode);
+						transforms.push(getNodeTransformMat(childNode) * transform);
+					}
+				}
+			}
+		}
+		if (clusteredPrimitiveCount > 0 || wideIndexPrimitiveCount > 0) {
+			printf("index clusters: split %u primitives into %u 16 bit clusters, %llu duplicated vertices, %u primitives with 32 bit indices\n",
+				clusteredPrimitiveCount, clusterCount, duplicatedVertexCount, wideIndexPrimitiveCount);
+		}
+		for (auto& pack : primitivePacks) {
+			graph.add([this, pack] { packPrimitive(*pack.primitive, pack.geometryIndex, pack.clustersIndex); });
+		}
+		uint32 materialOffset = 0;
+		uint32 textureOffset = 0;
+		for (auto& model : models) {
+			for (size_t materialIndex = 0; materialIndex < model.gltfData->materials_count; materialIndex++) {
+				graph.add([this, &model, &material = materials[materialOffset + materialIndex], &gltfMaterial = model.gltfData->materials[materialIndex], textureOffset] {
+					material = translateMaterial(model, gltfMaterial, textureOffset);
+				});
+			}
+			materialOffset += (uint32)model.gltfData->materials_count;
+			textureOffset += (uint32)model.gltfData->images_count;
+		}
+	}
+
+	// Clustered primitives occupy consecutive geometries, so their vertices and indices are contiguous starting at the first one.
+	void packPrimitive(cgltf_primitive& primitive, uint32 geometryIndex, uint32 clustersIndex) {
+		PrimitiveVerticesData primitiveData = getPrimitiveVerticesData(primitive);
+		Geometry& geometry = geometries[geometryIndex];
+		VertexStreams streams = {
+			.positions = accessorData(primitiveData.positions),
+			.positionStride = primitiveData.positions->stride,
+			.normals = accessorData(primitiveData.normals),
+			.normalStride = primitiveData.normals->stride,
+			.uvs = primitiveData.uvs ? accessorData(primitiveData.uvs) : nullptr,
+			.uvStride = primitiveData.uvs ? primitiveData.uvs->stride : 0
+		};
+		if (clustersIndex != UINT32_MAX) {
+			IndexClusters& clusters = indexClusters[clustersIndex];
+			streams.sourceIndices = clusters.vertices.data();
+			interleaveVertices(&verticesData[geometry.vertexOffset], streams, clusters.vertices.size());
+			memcpy(&indicesData[geometry.indexOffset], clusters.indices.data(), clusters.indices.size() * sizeof(uint16));
+		}
+		else {
+			interleaveVertices(&verticesData[geometry.vertexOffset], streams, primitiveData.positions->count);
+			if (geometry.indexStride == 2) {
+				readIndices(primitiveData.indices, (uint32*)&indicesData[geometry.indexOffset]);
+			}
+			else {
+				readIndices(primitiveData.indices, &indicesData[geometry.indexOffset]);
+			}
+		}
+	}
+
+	Material translateMaterial(Model& model, cgltf_material& gltfMaterial, uint32 textureOffset) {
+		Material material = {};
+		memcpy(material.emissiveFactor, gltfMaterial.emissive_factor, 12);
+		material.baseColorFactor[3] = 1.0f;
+		material.alphaMask = gltfMaterial.alpha_mode == cgltf_alpha_mode_mask;
+		material.alphaCutoff = gltfMaterial.alpha_cutoff;
+		if (gltfMaterial.has_pbr_metallic_roughness) {
+			memcpy(material.baseColorFactor, gltfMaterial.pbr_metallic_roughness.base_color_factor, 16);
+			if (gltfMaterial.pbr_metallic_roughness.base_color_texture.texture) {
+				uint64 textureIndex = std::distance(model.gltfData->images, gltfMaterial.pbr_metallic_roughness.base_color_texture.texture->image);
+				material.baseColorTextureIndex = (uint32)(textureOffset + textureIndex);
+			}
+			else {
+				material.baseColorTextureIndex = UINT32_MAX;
+			}
+		}
+		return material;
+	}
+
+	void collectCacheDependencies() {
+		cacheDependencies.push_back(getSceneCacheDependency(filePath));
+		for (auto& model : models) {
+			std::filesystem::path modelFilePath = filePath.parent_path() / model.filePath;
+			cacheDependencies.push_back(getSceneCacheDependency(modelFilePath));
+			for (size_t i = 0; i < model.gltfData->buffers_count; i++) {
+				const char* uri = model.gltfData->buffers[i].uri;
+				if (uri && strncmp(uri, "data:", 5)) {
+					cacheDependencies.push_back(getSceneCacheDependency(modelFilePath.parent_path() / uri));
+				}
+			}
+			for (size_t i = 0; i < model.gltfData->images_count; i++) {
+				cacheDependencies.push_back(getSceneCacheDependency(modelFilePath.parent_path() / model.gltfData->images[i].uri));
+			}
+		}
+	}
+
+	bool loadCache(const std::filesystem::path& cachePath, uint32 flags) {
+		if (!cacheMapping.map(cachePath)) {
+			return false;
+		}
+		SceneCacheHeader* header = (SceneCacheHeader*)cacheMapping.data;
+		bool valid = cacheMapping.size >= sizeof(SceneCacheHeader) &&
+			!memcmp(header->magic, sceneCacheMagic, sizeof(sceneCacheMagic)) &&
+			header->version == sceneCacheVersion &&
+			header->flags == flags;
+		SceneCacheSection* sections[] = {
+			&header->dependencies, &header->vertices, &header->indices, &header->geometries, &header->geometryInfos,
+			&header->meshes, &header->materials, &header->instances, &header->instanceMeshIndices, &header->images, &header->texels
+		};
+		for (size_t i = 0; valid && i < countof(sections); i++) {
+			valid = sections[i]->offset <= cacheMapping.size && sections[i]->size <= cacheMapping.size - sections[i]->offset;
+		}
+		if (valid) {
+			std::span<const SceneCacheDependency> dependencies = getCacheSection<SceneCacheDependency>(header->dependencies);
+			valid = std::all_of(dependencies.begin(), dependencies.end(), [](const SceneCacheDependency& dependency) {
+				SceneCacheDependency current = getSceneCacheDependency(dependency.path);
+				return current.size == dependency.size && current.lastWriteTime == dependency.lastWriteTime;
+			});
+		}
+		if (valid) {
+			std::span<const SceneCacheImage> cacheImages = getCacheSection<SceneCacheImage>(header->images);
+			valid = std::all_of(cacheImages.begin(), cacheImages.end(), [header](const SceneCacheImage& cacheImage) {
+				return cacheImage.offset <= header->texels.size && cacheImage.size <= header->texels.size - cacheImage.offset &&
+					cacheImage.width > 0 && cacheImage.height > 0 &&
+					cacheImage.storedMipLevels > 0 && cacheImage.storedMipLevels <= cacheImage.mipLevels && cacheImage.mipLevels <= fullMipLevels(cacheImage.width, cacheImage.height) &&
+					cacheImage.size == imageMipChainSize(cacheImage.format, cacheImage.width, cacheImage.height, cacheImage.storedMipLevels);
+			});
+		}
+		// The sections index into each other, so a stale or corrupt cache must not let any of them reach past another.
+		if (valid) {
+			uint64 vertexCount = header->vertices.size / sizeof(Vertex);
+			uint64 indexCount = header->indices.size / sizeof(uint16);
+			std::span<const Material> cacheMaterials = getCacheSection<Material>(header->materials);
+			std::span<const Geometry> cacheGeometries = getCacheSection<Geometry>(header->geometries);
+			std::span<const GeometryInfo> cacheGeometryInfos = getCacheSection<GeometryInfo>(header->geometryInfos);
+			valid = cacheGeometries.size() == cacheGeometryInfos.size();
+			for (size_t i = 0; valid && i < cacheGeometries.size(); i++) {
+				const Geometry& geometry = cacheGeometries[i];
+				const GeometryInfo& geometryInfo = cacheGeometryInfos[i];
+				valid = (geometry.indexStride == 1 || geometry.indexStride == 2) && geometry.materialIndex < cacheMaterials.size() &&
+					(uint64)geometry.vertexOffset + geometryInfo.vertexCount <= vertexCount &&
+					(uint64)geometry.indexOffset + (uint64)geometryInfo.indexCount * geometry.indexStride <= indexCount;
+			}
+			uint64 imageCount = header->images.size / sizeof(SceneCacheImage);
+			valid = valid && std::all_of(cacheMaterials.begin(), cacheMaterials.end(), [&](const Material& material) {
+				return material.baseColorTextureIndex == UINT32_MAX || material.baseColorTextureIndex < imageCount;
+			});
+			std::span<const Mesh> cacheMeshes = getCacheSection<Mesh>(header->meshes);
+			valid = valid && std::all_of(cacheMeshes.begin(), cacheMeshes.end(), [&](const Mesh& mesh) {
+				return (uint64)mesh.geometryOffset + mesh.geometryCount <= cacheGeometries.size();
+			});
+			std::span<const uint32> cacheInstanceMeshIndices = getCacheSection<uint32>(header->instanceMeshIndices);
+			valid = valid && cacheInstanceMeshIndices.size() == header->instances.size / sizeof(Instance) &&
+				std::all_of(cacheInstanceMeshIndices.begin(), cacheInstanceMeshIndices.end(), [&](uint32 meshIndex) { return meshIndex < cacheMeshes.size(); });
+		}
+		if (!valid) {
+			cacheMapping.unmap();
+			return false;
+		}
+		vertices = getCacheSection<Vertex>(header->vertices);
+		indices = getCacheSection<uint16>(header->indices);
+		auto copySection = [this]<typename T>(std::vector<T>& v, const SceneCacheSection& section) {
+			std::span<const T> data = getCacheSection<T>(section);
+			v.assign(data.begin(), data.end());
+		};
+		copySection(geometries, header->geometries);
+		copySection(geometryInfos, header->geometryInfos);
+		copySection(meshes, header->meshes);
+		copySection(materials, header->materials);
+		copySection(instances, header->instances);
+		copySection(instanceMeshIndices, header->instanceMeshIndices);
+		uint8* texels = cacheMapping.data + header->texels.offset;
+		for (auto& cacheImage : getCacheSection<SceneCacheImage>(header->images)) {
+			Image image = {
+				.width = cacheImage.width,
+				.height = cacheImage.height,
+				.format = cacheImage.format,
+				.size = cacheImage.size,
+				.data = texels + cacheImage.offset,
+				.mipLevels = cacheImage.mipLevels,
+				.storedMipLevels = cacheImage.storedMipLevels
+			};
+			images.push_back(image);
+		}
+		return true;
+	}
+
+	template <typename T>
+	std::span<const T> getCacheSection(const SceneCacheSection& section) {
+		return std::span<const T>((const T*)(cacheMapping.data + section.offset), section.size / sizeof(T));
+	}
+
+	void beginCache(const std::filesystem::path& cachePath, uint32 flags) {
+		cacheFile.open(cachePath, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!cacheFile.is_open()) {
+			return;
+		}
+		cacheHeader = { .version = sceneCacheVersion, .flags = flags };
+		memcpy(cacheHeader.magic, sceneCacheMagic, sizeof(sceneCacheMagic));
+		SceneCacheHeader emptyHeader = {};
+		cacheFile.write((const char*)&emptyHeader, sizeof(emptyHeader));
+		auto writeSection = [this](SceneCacheSection& section, const void* data, uint64 size) {
+			uint64 offset = cacheFile.tellp();
+			const char zeros[16] = {};
+			cacheFile.write(zeros, align(offset, 16) - offset);
+			section = { .offset = align(offset, 16), .size = size };
+			cacheFile.write((const char*)data, size);
+		};
+		writeSection(cacheHeader.dependencies, cacheDependencies.data(), cacheDependencies.size() * sizeof(SceneCacheDependency));
+		writeSection(cacheHeader.vertices, vertices.data(), vertices.size_bytes());
+		writeSection(cacheHeader.indices, indices.data(), indices.size_bytes());
+		writeSection(cacheHeader.geometries, geometries.data(), geometries.size() * sizeof(Geometry));
+		writeSection(cacheHeader.geometryInfos, geometryInfos.data(), geometryInfos.size() * sizeof(GeometryInfo));
+		writeSection(cacheHeader.meshes, meshes.data(), meshes.size() * sizeof(Mesh));
+		writeSection(cacheHeader.materials, materials.data(), materials.size() * sizeof(Material));
+		writeSection(cacheHeader.instances, instances.data(), instances.size() * sizeof(Instance));
+		writeSection(cacheHeader.instanceMeshIndices, instanceMeshIndices.data(), instanceMeshIndices.size() * sizeof(uint32));
+		cacheImages.resize(images.size());
+		uint64 texelsSize = 0;
+		for (size_t i = 0; i < images.size(); i++) {
+			cacheImages[i] = { images[i].width, images[i].height, images[i].format, images[i].size, texelsSize, images[i].mipLevels, images[i].storedMipLevels };
+			texelsSize = align(texelsSize + images[i].size, 16);
+		}
+		writeSection(cacheHeader.images, cacheImages.data(), cacheImages.size() * sizeof(SceneCacheImage));
+		writeSection(cacheHeader.texels, nullptr, 0);
+		cacheHeader.texels.size = images.empty() ? 0 : cacheImages.back().offset + cacheImages.back().size;
+	}
+
+	void writeCacheImage(uint32 imageIndex, const uint8* data) {
+		if (cacheFile.is_open()) {
+			cacheFile.seekp(cacheHeader.texels.offset + cacheImages[imageIndex].offset);
+			cacheFile.write((const char*)data, cacheImages[imageIndex].size);
+		}
+	}
+
+	void finishCache(const std::filesystem::path& cachePath) {
+		if (!cacheFile.is_open()) {
+			return;
+		}
+		cacheFile.seekp(0);
+		cacheFile.write((const char*)&cacheHeader, sizeof(cacheHeader));
+		bool good = cacheFile.good();
+		cacheFile.close();
+		cacheImages.clear();
+		if (!good) {
+			std::error_code error;
+			std::filesystem::remove(cachePath, error);
+		}
+	}
+
+	void optimizeMeshes() {
+		auto optimizeStartTime = std::chrono::steady_clock::now();
+		struct OptimizedGeometry {
+			std::vector<Vertex> vertices;
+			std::vector<uint32> indices;
+			VertexFetchStats statsBefore;
+			VertexFetchStats statsAfter;
+		};
+		std::vector<OptimizedGeometry> optimizedGeometries(geometries.size());
+		{
+			TaskGraph graph(jobSystem);
+			for (uint32 geometryIndex = 0; geometryIndex < geometries.size(); geometryIndex++) {
+				graph.add([this, &optimizedGeometry = optimizedGeometries[geometryIndex], geometryIndex] {
+					auto& geometry = geometries[geometryIndex];
+					auto& geometryInfo = geometryInfos[geometryIndex];
+					optimizedGeometry.vertices.assign(&vertices[geometry.vertexOffset], &vertices[geometry.vertexOffset] + geometryInfo.vertexCount);
+					optimizedGeometry.indices.resize(geometryInfo.indexCount);
+					for (uint32 i = 0; i < geometryInfo.indexCount; i++) {
+						optimizedGeometry.indices[i] = indexAt(geometry, i);
+					}
+					optimizedGeometry.statsBefore = analyzeVertexFetch(optimizedGeometry.indices, geometryInfo.vertexCount, sizeof(PackedVertex));
+					optimizeGeometry(optimizedGeometry.vertices, optimizedGeometry.indices);
+					optimizedGeometry.statsAfter = analyzeVertexFetch(optimizedGeometry.indices, (uint32)optimizedGeometry.vertices.size(), sizeof(PackedVertex));
+				});
+			}
+			graph.wait();
+		}
+
+		uint64 vertexCountBefore = vertices.size();
+		uint64 indicesSizeBefore = indices.size_bytes();
+		std::vector<Vertex> newVerticesData;
+		std::vector<uint16> newIndicesData;
+		newVerticesData.reserve(vertices.size());
+		newIndicesData.reserve(indices.size());
+		VertexFetchStats statsBefore = {};
+		VertexFetchStats statsAfter = {};
+		for (uint32 geometryIndex = 0; geometryIndex < geometries.size(); geometryIndex++) {
+			auto& geometry = geometries[geometryIndex];
+			auto& optimizedGeometry = optimizedGeometries[geometryIndex];
+			geometry.vertexOffset = (uint32)newVerticesData.size();
+			newVerticesData.insert(newVerticesData.end(), optimizedGeometry.vertices.begin(), optimizedGeometry.vertices.end());
+			if (geometry.indexStride == 2 && newIndicesData.size() % 2) {
+				newIndicesData.push_back(0);
+			}
+			geometry.indexOffset = (uint32)newIndicesData.size();
+			newIndicesData.resize(newIndicesData.size() + optimizedGeometry.indices.size() * geometry.indexStride);
+			if (geometry.indexStride == 2) {
+				memcpy(&newIndicesData[geometry.indexOffset], optimizedGeometry.indices.data(), optimizedGeometry.indices.size() * sizeof(uint32));
+			}
+			else {
+				std::copy(optimizedGeometry.indices.begin(), optimizedGeometry.indices.end(), &newIndicesData[geometry.indexOffset]);
+			}
+			geometryInfos[geometryIndex].vertexCount = (uint32)optimizedGeometry.vertices.size();
+			statsBefore.add(optimizedGeometry.statsBefore);
+			statsAfter.add(optimizedGeometry.statsAfter);
+		}
+		verticesData = std::move(newVerticesData);
+		indicesData = std::move(newIndicesData);
+		vertices = verticesData;
+		indices = indicesData;
+
+		printf("mesh optimization: %.1f ms, vertices %llu -> %llu, %.2f MB saved\n", secondsSince(optimizeStartTime) * 1000,
+			vertexCountBefore, (uint64)vertices.size(), ((double)(vertexCountBefore - vertices.size()) * sizeof(Vertex) + (double)indicesSizeBefore - (double)indices.size_bytes()) / 1_mb);
+		printf("    vertex fetch: acmr %.3f -> %.3f, overfetch %.3f -> %.3f\n", statsBefore.acmr(), statsAfter.acmr(), statsBefore.overfetch(), statsAfter.overfetch());
+	}
+
+	// Content addressed deduplication across models: identical image files share a texture slot, identical
+	// materials and vertex/index ranges are stored once and meshes made of identical geometries share a BLAS.
+	void deduplicateContent() {
+		auto dedupStartTime = std::chrono::steady_clock::now();
+		uint32 imageCountBefore = (uint32)images.size();
+		uint32 materialCountBefore = (uint32)materials.size();
+		uint32 meshCountBefore = (uint32)meshes.size();
+		uint64 dataSizeBefore = vertices.size_bytes() + indices.size_bytes();
+
+		std::vector<uint32> imageRemap(images.size());
+		{
+			std::unordered_map<uint64, uint32> imageIndices;
+			std::vector<Image> uniqueImages;
+			std::vector<std::filesystem::path> uniqueImageFilePaths;
+			auto sameFile = [](const std::filesystem::path& a, const std::filesystem::path& b) {
+				if (a == b) {
+					return true;
+				}
+				FileMapping fileA, fileB;
+				bool same = fileA.map(a) && fileB.map(b) && fileA.size == fileB.size && !memcmp(fileA.data, fileB.data, fileA.size);
+				fileA.unmap();
+				fileB.unmap();
+				return same;
+			};
+			for (uint32 imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+				Image& image = images[imageIndex];
+				auto [it, inserted] = imageIndices.try_emplace(imageHashes[imageIndex], (uint32)uniqueImages.size());
+				if (!inserted && imageHashes[imageIndex] != 0 &&
+					uniqueImages[it->second].width == image.width && uniqueImages[it->second].height == image.height && uniqueImages[it->second].format == image.format &&
+					sameFile(uniqueImageFilePaths[it->second], imageFilePaths[imageIndex])) {
+					imageRemap[imageIndex] = it->second;
+				}
+				else {
+					imageRemap[imageIndex] = (uint32)uniqueImages.size();
+					uniqueImages.push_back(image);
+					uniqueImageFilePaths.push_back(imageFilePaths[imageIndex]);
+				}
+			}
+			images = std::move(uniqueImages);
+			imageFilePaths = std::move(uniqueImageFilePaths);
+		}
+		for (auto& material : materials) {
+			if (material.baseColorTextureIndex != UINT32_MAX) {
+				material.baseColorTextureIndex = imageRemap[material.baseColorTextureIndex];
+			}
+		}
+
+		std::vector<uint32> materialRemap(materials.size());
+		{
+			std::unordered_map<uint64, uint32> materialIndices;
+			std::vector<Material> uniqueMaterials;
+			for (uint32 materialIndex = 0; materialIndex < materials.size(); materialIndex++) {
+				auto [it, inserted] = materialIndices.try_emplace(hashBytes(&materials[materialIndex], sizeof(Material)), (uint32)uniqueMaterials.size());
+				if (inserted || memcmp(&uniqueMaterials[it->second], &materials[materialIndex], sizeof(Material))) {
+					materialRemap[materialIndex] = (uint32)uniqueMaterials.size();
+					uniqueMaterials.push_back(materials[materialIndex]);
+				}
+				else {
+					materialRemap[materialIndex] = it->second;
+				}
+			}
+			materials = std::move(uniqueMaterials);
+		}
+
+		// Geometries with identical vertices and indices point at the first copy; the copies are dropped when the data is compacted.
+		{
+			auto sameData = [this](uint32 a, uint32 b) {
+				const Geometry& geometryA = geometries[a];
+				const Geometry& geometryB = geometries[b];
+				return geometryA.indexStride == geometryB.indexStride &&
+					!memcmp(&geometryInfos[a], &geometryInfos[b], sizeof(GeometryInfo)) &&
+					!memcmp(&vertices[geometryA.vertexOffset], &vertices[geometryB.vertexOffset], geometryInfos[a].vertexCount * sizeof(Vertex)) &&
+					!memcmp(&indices[geometryA.indexOffset], &indices[geometryB.indexOffset], geometryInfos[a].indexCount * geometryA.indexStride * sizeof(uint16));
+			};
+			std::unordered_map<uint64, uint32> geometryIndices;
+			for (uint32 geometryIndex = 0; geometryIndex < geometries.size(); geometryIndex++) {
+				Geometry& geometry = geometries[geometryIndex];
+				GeometryInfo& geometryInfo = geometryInfos[geometryIndex];
+				geometry.materialIndex = materialRemap[geometry.materialIndex];
+				uint64 hash = hashBytes(&geometryInfo, sizeof(GeometryInfo));
+				hash = hashBytes(&geometry.indexStride, sizeof(uint32), hash);
+				hash = hashBytes(&vertices[geometry.vertexOffset], geometryInfo.vertexCount * sizeof(Vertex), hash);
+				hash = hashBytes(&indices[geometry.indexOffset], geometryInfo.indexCount * geometry.indexStride * sizeof(uint16), hash);
+				auto [it, inserted] = geometryIndices.try_emplace(hash, geometryIndex);
+				if (!inserted && sameData(it->second, geometryIndex)) {
+					geometry.vertexOffset = geometries[it->second].vertexOffset;
+					geometry.indexOffset = geometries[it->second].indexOffset;
+				}
+			}
+			std::unordered_map<uint64, std::pair<uint32, uint32>> newOffsets;
+			std::vector<Vertex> newVerticesData;
+			std::vector<uint16> newIndicesData;
+			for (uint32 geometryIndex = 0; geometryIndex < geometries.size(); geometryIndex++) {
+				Geometry& geometry = geometries[geometryIndex];
+				GeometryInfo& geometryInfo = geometryInfos[geometryIndex];
+				auto [it, inserted] = newOffsets.try_emplace((uint64)geometry.vertexOffset << 32 | geometry.indexOffset);
+				if (inserted) {
+					if (geometry.indexStride == 2 && newIndicesData.size() % 2) {
+						newIndicesData.push_back(0);
+					}
+					it->second = { (uint32)newVerticesData.size(), (uint32)newIndicesData.size() };
+					newVerticesData.insert(newVerticesData.end(), &vertices[geometry.vertexOffset], &vertices[geometry.vertexOffset] + geometryInfo.vertexCount);
+					newIndicesData.insert(newIndicesData.end(), &indices[geometry.indexOffset], &indices[geometry.indexOffset] + geometryInfo.indexCount * geometry.indexStride);
+				}
+				std::tie(geometry.vertexOffset, geometry.indexOffset) = it->second;
+			}
+			verticesData = std::move(newVerticesData);
+			indicesData = std::move(newIndicesData);
+			vertices = verticesData;
+			indices = indicesData;
+		}
+
+		// Meshes made of the same geometries (data and materials) share one BLAS. Meshes no instance references are dropped.
+		{
+			auto sameGeometries = [this](const Mesh& a, const Mesh& b) {
+				return a.geometryCount == b.geometryCount &&
+					!memcmp(&geometries[a.geometryOffset], &geometries[b.geometryOffset], a.geometryCount * sizeof(Geometry)) &&
+					!memcmp(&geometryInfos[a.geometryOffset], &geometryInfos[b.geometryOffset], a.geometryCount * sizeof(GeometryInfo));
+			};
+			std::unordered_map<uint64, uint32> meshIndices;
+			std::vector<uint32> meshRemap(meshes.size(), UINT32_MAX);
+			std::vector<Mesh> uniqueMeshes;
+			for (uint32 instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+				uint32& meshIndex = instanceMeshIndices[instanceIndex];
+				if (meshRemap[meshIndex] == UINT32_MAX) {
+					Mesh& mesh = meshes[meshIndex];
+					uint64 hash = hashBytes(&geometries[mesh.geometryOffset], mesh.geometryCount * sizeof(Geometry));
+					hash = hashBytes(&geometryInfos[mesh.geometryOffset], mesh.geometryCount * sizeof(GeometryInfo), hash);
+					auto [it, inserted] = meshIndices.try_emplace(hash, (uint32)uniqueMeshes.size());
+					if (inserted || !sameGeometries(uniqueMeshes[it->second], mesh)) {
+						meshRemap[meshIndex] = (uint32)uniqueMeshes.size();
+						uniqueMeshes.push_back(mesh);
+					}
+					else {
+						meshRemap[meshIndex] = it->second;
+					}
+				}
+				meshIndex = meshRemap[meshIndex];
+				instances[instanceIndex].geometryOffset = uniqueMeshes[meshIndex].geometryOffset;
+			}
+			meshes = std::move(uniqueMeshes);
+		}
+
+		uint64 dataSizeAfter = vertices.size_bytes() + indices.size_bytes();
+		printf("content dedup: %.1f ms, textures %u -> %u, materials %u -> %u, meshes %u -> %u, vertex/index data %.2f MB -> %.2f MB\n",
+			secondsSince(dedupStartTime) * 1000, imageCountBefore, (uint32)images.size(), materialCountBefore, (uint32)materials.size(),
+			meshCountBefore, (uint32)meshes.size(), dataSizeBefore / (double)1_mb, dataSizeAfter / (double)1_mb);
+	}
+
+	// Merges small meshes that are instanced once under the same transform and splits large meshes spatially,
+	// in both cases only when the cost model says the resulting TLAS is cheaper to trace.
+	void partitionMeshes() {
+		auto partitionStartTime = std::chrono::steady_clock::now();
+		std::vector<Bounds> meshBounds(meshes.size());
+		std::vector<uint32> meshTriangleCounts(meshes.size(), 0);
+		std::vector<uint32> meshInstanceCounts(meshes.size(), 0);
+		for (uint32 meshIndex = 0; meshIndex < meshes.size(); meshIndex++) {
+			auto& mesh = meshes[meshIndex];
+			for (uint32 geometryIndex = mesh.geometryOffset; geometryIndex < mesh.geometryOffset + mesh.geometryCount; geometryIndex++) {
+				auto& geometry = geometries[geometryIndex];
+				auto& geometryInfo = geometryInfos[geometryIndex];
+				meshTriangleCounts[meshIndex] += geometryInfo.indexCount / 3;
+				for (uint32 vertexIndex = 0; vertexIndex < geometryInfo.vertexCount; vertexIndex++) {
+					meshBounds[meshIndex].grow(vertices[geometry.vertexOffset + vertexIndex].position);
+				}
+			}
+		}
+		for (uint32 meshIndex : instanceMeshIndices) {
+			meshInstanceCounts[meshIndex] += 1;
+		}
+
+		// Instance overlap is the summed surface area of the instance bounds relative to the scene bounds,
+		// the number of instances a ray crossing the scene is expected to enter.
+		auto estimateCosts = [&]() -> std::pair<double, double> {
+			std::vector<Bounds> instanceBounds(instances.size());
+			Bounds sceneBounds;
+			for (uint32 instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+				instanceBounds[instanceIndex] = meshBounds[instanceMeshIndices[instanceIndex]].transform(XMMATRIX(&instances[instanceIndex].transform[0][0]));
+				sceneBounds.grow(instanceBounds[instanceIndex]);
+			}
+			double sceneSurfaceArea = sceneBounds.surfaceArea();
+			if (sceneSurfaceArea == 0) {
+				return { 0.0, 0.0 };
+			}
+			double overlap = 0;
+			double cost = 0;
+			for (uint32 instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+				overlap += instanceBounds[instanceIndex].surfaceArea();
+				cost += blasTraceCost(instanceBounds[instanceIndex].surfaceArea(), meshTriangleCounts[instanceMeshIndices[instanceIndex]]);
+			}
+			return { overlap / sceneSurfaceArea, cost / sceneSurfaceArea };
+		};
+		auto [overlapBefore, costBefore] = estimateCosts();
+		uint32 instanceCountBefore = (uint32)instances.size();
+		uint32 meshCountBefore = (uint32)meshes.size();
+
+		uint32 originalMeshCount = (uint32)meshes.size();
+		std::vector<std::vector<uint32>> meshParts(originalMeshCount);
+		uint32 splitMeshCount = 0;
+		uint32 splitPartCount = 0;
+		for (uint32 meshIndex = 0; meshIndex < originalMeshCount; meshIndex++) {
+			if (meshInstanceCounts[meshIndex] > 0 && meshTriangleCounts[meshIndex] >= blasSplitMinTriangleCount) {
+				meshParts[meshIndex] = splitMesh(meshIndex, meshBounds, meshTriangleCounts);
+				if (!meshParts[meshIndex].empty()) {
+					splitMeshCount += 1;
+					splitPartCount += (uint32)meshParts[meshIndex].size();
+				}
+			}
+		}
+
+		std::vector<uint32> mergeCandidates;
+		for (uint32 instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+			uint32 meshIndex = instanceMeshIndices[instanceIndex];
+			if (meshInstanceCounts[meshIndex] == 1 && meshTriangleCounts[meshIndex] < blasMergeMaxTriangleCount && meshParts[meshIndex].empty()) {
+				mergeCandidates.push_back(instanceIndex);
+			}
+		}
+		auto sameTransform = [this](uint32 a, uint32 b) { return !memcmp(instances[a].transform, instances[b].transform, sizeof(Instance::transform)); };
+		std::sort(mergeCandidates.begin(), mergeCandidates.end(), [this](uint32 a, uint32 b) {
+			return memcmp(instances[a].transform, instances[b].transform, sizeof(Instance::transform)) < 0;
+		});
+		std::vector<uint32> instanceMergedMeshes(instances.size(), UINT32_MAX);
+		std::vector<uint8> instanceMergedAway(instances.size(), 0);
+		uint32 mergedMeshCount = 0;
+		uint32 mergedIntoCount = 0;
+		for (size_t groupBegin = 0, groupEnd = 0; groupBegin < mergeCandidates.size(); groupBegin = groupEnd) {
+			groupEnd = groupBegin + 1;
+			while (groupEnd < mergeCandidates.size() && sameTransform(mergeCandidates[groupBegin], mergeCandidates[groupEnd])) {
+				groupEnd += 1;
+			}
+			if (groupEnd - groupBegin < 2) {
+				continue;
+			}
+			std::span<uint32> group(mergeCandidates.data() + groupBegin, groupEnd - groupBegin);
+			Bounds groupBounds;
+			for (uint32 instanceIndex : group) {
+				groupBounds.grow(meshBounds[instanceMeshIndices[instanceIndex]].center().data());
+			}
+			uint32 axis = groupBounds.largestAxis();
+			std::sort(group.begin(), group.end(), [&](uint32 a, uint32 b) {
+				return meshBounds[instanceMeshIndices[a]].center()[axis] < meshBounds[instanceMeshIndices[b]].center()[axis];
+			});
+			// Sweep along the largest axis and keep growing the current cluster while merging is estimated to be cheaper.
+			for (size_t clusterBegin = 0, clusterEnd = 0; clusterBegin < group.size(); clusterBegin = clusterEnd) {
+				Bounds clusterBounds = meshBounds[instanceMeshIndices[group[clusterBegin]]];
+				uint32 clusterTriangleCount = meshTriangleCounts[instanceMeshIndices[group[clusterBegin]]];
+				for (clusterEnd = clusterBegin + 1; clusterEnd < group.size(); clusterEnd++) {
+					uint32 meshIndex = instanceMeshIndices[group[clusterEnd]];
+					Bounds mergedBounds = clusterBounds;
+					mergedBounds.grow(meshBounds[meshIndex]);
+					uint32 mergedTriangleCount = clusterTriangleCount + meshTriangleCounts[meshIndex];
+					double separateCost = blasTraceCost(clusterBounds.surfaceArea(), clusterTriangleCount) + blasTraceCost(meshBounds[meshIndex].surfaceArea(), meshTriangleCounts[meshIndex]);
+					if (mergedTriangleCount > blasMergedMaxTriangleCount || blasTraceCost(mergedBounds.surfaceArea(), mergedTriangleCount) > separateCost) {
+						break;
+					}
+					clusterBounds = mergedBounds;
+					clusterTriangleCount = mergedTriangleCount;
+				}
+				if (clusterEnd - clusterBegin < 2) {
+					continue;
+				}
+				Mesh mergedMesh = { .geometryOffset = (uint32)geometries.size(), .geometryCount = 0 };
+				for (size_t i = clusterBegin; i < clusterEnd; i++) {
+					Mesh mesh = meshes[instanceMeshIndices[group[i]]];
+					for (uint32 geometryIndex = mesh.geometryOffset; geometryIndex < mesh.geometryOffset + mesh.geometryCount; geometryIndex++) {
+						Geometry geometry = geometries[geometryIndex];
+						GeometryInfo geometryInfo = geometryInfos[geometryIndex];
+						geometries.push_back(geometry);
+						geometryInfos.push_back(geometryInfo);
+					}
+					mergedMesh.geometryCount += mesh.geometryCount;
+					instanceMergedAway[group[i]] = i > clusterBegin;
+				}
+				instanceMergedMeshes[group[clusterBegin]] = (uint32)meshes.size();
+				meshes.push_back(mergedMesh);
+				meshBounds.push_back(clusterBounds);
+				meshTriangleCounts.push_back(clusterTriangleCount);
+				mergedMeshCount += (uint32)(clusterEnd - clusterBegin);
+				mergedIntoCount += 1;
+			}
+		}
+
+		std::vector<Instance> partitionedInstances;
+		std::vector<uint32> partitionedInstanceMeshIndices;
+		for (uint32 instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+			uint32 meshIndex = instanceMeshIndices[instanceIndex];
+			if (instanceMergedAway[instanceIndex]) {
+				continue;
+			}
+			if (instanceMergedMeshes[instanceIndex] != UINT32_MAX) {
+				partitionedInstances.push_back(instances[instanceIndex]);
+				partitionedInstanceMeshIndices.push_back(instanceMergedMeshes[instanceIndex]);
+			}
+			else if (meshIndex < originalMeshCount && !meshParts[meshIndex].empty()) {
+				for (uint32 partMeshIndex : meshParts[meshIndex]) {
+					partitionedInstances.push_back(instances[instanceIndex]);
+					partitionedInstanceMeshIndices.push_back(partMeshIndex);
+				}
+			}
+			else {
+				partitionedInstances.push_back(instances[instanceIndex]);
+				partitionedInstanceMeshIndices.push_back(meshIndex);
+			}
+		}
+
+		// Drop the meshes no instance refers to anymore so they don't get a BLAS.
+		std::vector<uint32> meshRemap(meshes.size(), UINT32_MAX);
+		std::vector<Mesh> partitionedMeshes;
+		std::vector<Bounds> partitionedMeshBounds;
+		std::vector<uint32> partitionedMeshTriangleCounts;
+		for (uint32& meshIndex : partitionedInstanceMeshIndices) {
+			if (meshRemap[meshIndex] == UINT32_MAX) {
+				meshRemap[meshIndex] = (uint32)partitionedMeshes.size();
+				partitionedMeshes.push_back(meshes[meshIndex]);
+				partitionedMeshBounds.push_back(meshBounds[meshIndex]);
+				partitionedMeshTriangleCounts.push_back(meshTriangleCounts[meshIndex]);
+			}
+			meshIndex = meshRemap[meshIndex];
+		}
+		for (uint32 instanceIndex = 0; instanceIndex < partitionedInstances.size(); instanceIndex++) {
+			partitionedInstances[instanceIndex].geometryOffset = partitionedMeshes[partitionedInstanceMeshIndices[instanceIndex]].geometryOffset;
+		}
+		instances = std::move(partitionedInstances);
+		instanceMeshIndices = std::move(partitionedInstanceMeshIndices);
+		meshes = std::move(partitionedMeshes);
+		meshBounds = std::move(partitionedMeshBounds);
+		meshTriangleCounts = std::move(partitionedMeshTriangleCounts);
+
+		auto [overlapAfter, costAfter] = estimateCosts();
+		printf("blas partition: merged %u meshes into %u, split %u meshes into %u, %.1f ms\n", mergedMeshCount, mergedIntoCount, splitMeshCount, splitPartCount, secondsSince(partitionStartTime) * 1000);
+		printf("    instances %u -> %u, blas %u -> %u, instance overlap %.2f -> %.2f, estimated trace cost %.2f -> %.2f\n",
+			instanceCountBefore, (uint32)instances.size(), meshCountBefore, (uint32)meshes.size(), overlapBefore, overlapAfter, costBefore, costAfter);
+	}
+
+	uint32 indexAt(const Geometry& geometry, uint32 i) const {
+		const uint16* index = &indices[geometry.indexOffset + i * geometry.indexStride];
+		return geometry.indexStride == 2 ? index[0] | ((uint32)index[1] << 16) : index[0];
+	}
+
+	std::vector<uint32> splitMesh(uint32 meshIndex, std::vector<Bounds>& meshBounds, std::vector<uint32>& meshTriangleCounts) {
+		Mesh mesh = meshes[meshIndex];
+		std::vector<PartitionTriangle> triangles;
+		triangles.reserve(meshTriangleCounts[meshIndex]);
+		for (uint32 geometryIndex = 0; geometryIndex < mesh.geometryCount; geometryIndex++) {
+			auto& geometry = geometries[mesh.geometryOffset + geometryIndex];
+			auto& geometryInfo = geometryInfos[mesh.geometryOffset + geometryIndex];
+			for (uint32 triangleIndex = 0; triangleIndex < geometryInfo.indexCount / 3; triangleIndex++) {
+				PartitionTriangle triangle = { .geometryIndex = geometryIndex, .triangleIndex = triangleIndex };
+				for (uint32 i = 0; i < 3; i++) {
+					triangle.bounds.grow(vertices[geometry.vertexOffset + indexAt(geometry, triangleIndex * 3 + i)].position);
+				}
+				triangle.center = triangle.bounds.center();
+				triangles.push_back(triangle);
+			}
+		}
+		std::vector<std::span<PartitionTriangle>> clusters;
+		splitTriangles(triangles, 0, clusters);
+		if (clusters.size() < 2) {
+			return {};
+		}
+
+		// Reorder the triangles of every geometry so each cluster owns a contiguous index range.
+		// The reordered indices are appended rather than written in place, since deduplicated geometries of other meshes may share the range.
+		if (indices.data() != indicesData.data()) {
+			indicesData.assign(indices.begin(), indices.end());
+		}
+		std::vector<std::vector<uint16>> geometryIndices(mesh.geometryCount);
+		std::vector<std::vector<uint32>> clusterTriangleOffsets(clusters.size(), std::vector<uint32>(mesh.geometryCount));
+		std::vector<std::vector<uint32>> clusterTriangleCounts(clusters.size(), std::vector<uint32>(mesh.geometryCount));
+		for (size_t clusterIndex = 0; clusterIndex < clusters.size(); clusterIndex++) {
+			for (uint32 geometryIndex = 0; geometryIndex < mesh.geometryCount; geometryIndex++) {
+				clusterTriangleOffsets[clusterIndex][geometryIndex] = (uint32)geometryIndices[geometryIndex].size() / (3 * geometries[mesh.geometryOffset + geometryIndex].indexStride);
+			}
+			for (auto& triangle : clusters[clusterIndex]) {
+				auto& geometry = geometries[mesh.geometryOffset + triangle.geometryIndex];
+				const uint16* triangleIndices = &indices[geometry.indexOffset + triangle.triangleIndex * 3 * geometry.indexStride];
+				geometryIndices[triangle.geometryIndex].insert(geometryIndices[triangle.geometryIndex].end(), triangleIndices, triangleIndices + 3 * geometry.indexStride);
+				clusterTriangleCounts[clusterIndex][triangle.geometryIndex] += 1;
+			}
+		}
+		std::vector<uint32> geometryIndexOffsets(mesh.geometryCount);
+		for (uint32 geometryIndex = 0; geometryIndex < mesh.geometryCount; geometryIndex++) {
+			if (geometries[mesh.geometryOffset + geometryIndex].indexStride == 2 && indicesData.size() % 2) {
+				indicesData.push_back(0);
+			}
+			geometryIndexOffsets[geometryIndex] = (uint32)indicesData.size();
+			indicesData.insert(indicesData.end(), geometryIndices[geometryIndex].begin(), geometryIndices[geometryIndex].end());
+		}
+		indices = indicesData;
+
+		std::vector<uint32> partMeshIndices;
+		for (size_t clusterIndex = 0; clusterIndex < clusters.size(); clusterIndex++) {
+			Mesh partMesh = { .geometryOffset = (uint32)geometries.size(), .geometryCount = 0 };
+			Bounds partBounds;
+			for (auto& triangle : clusters[clusterIndex]) {
+				partBounds.grow(triangle.bounds);
+			}
+			for (uint32 geometryIndex = 0; geometryIndex < mesh.geometryCount; geometryIndex++) {
+				uint32 triangleCount = clusterTriangleCounts[clusterIndex][geometryIndex];
+				if (triangleCount > 0) {
+					Geometry geometry = geometries[mesh.geometryOffset + geometryIndex];
+					geometry.indexOffset = geometryIndexOffsets[geometryIndex] + clusterTriangleOffsets[clusterIndex][geometryIndex] * 3 * geometry.indexStride;
+					geometries.push_back(geometry);
+					geometryInfos.push_back(GeometryInfo{ .vertexCount = geometryInfos[mesh.geometryOffset + geometryIndex].vertexCount, .indexCount = triangleCount * 3 });
+					partMesh.geometryCount += 1;
+				}
+			}
+			partMeshIndices.push_back((uint32)meshes.size());
+			meshes.push_back(partMesh);
+			meshBounds.push_back(partBounds);
+			meshTriangleCounts.push_back((uint32)clusters[clusterIndex].size());
+		}
+		return partMeshIndices;
+	}
+
+	// Binned SAH split along the largest axis of the triangle centers, recursing while a split lowers the estimated cost.
+	void splitTriangles(std::span<PartitionTriangle> triangles, uint32 depth, std::vector<std::span<PartitionTriangle>>& clusters) {
+		Bounds bounds;
+		Bounds centerBounds;
+		for (auto& triangle : triangles) {
+			bounds.grow(triangle.bounds);
+			centerBounds.grow(triangle.center.data());
+		}
+		uint32 axis = centerBounds.largestAxis();
+		float axisMin = centerBounds.min[axis];
+		float axisExtent = centerBounds.max[axis] - centerBounds.min[axis];
+		if (triangles.size() < blasSplitMinTriangleCount || depth >= blasSplitMaxDepth || axisExtent <= 0) {
+			clusters.push_back(triangles);
+			return;
+		}
+		const uint32 binCount = 16;
+		auto binIndex = [&](const PartitionTriangle& triangle) {
+			return std::min((uint32)((triangle.center[axis] - axisMin) / axisExtent * binCount), binCount - 1);
+		};
+		Bounds binBounds[binCount];
+		uint32 binTriangleCounts[binCount] = {};
+		for (auto& triangle : triangles) {
+			uint32 bin = binIndex(triangle);
+			binBounds[bin].grow(triangle.bounds);
+			binTriangleCounts[bin] += 1;
+		}
+		Bounds rightBounds[binCount];
+		uint32 rightTriangleCounts[binCount] = {};
+		for (uint32 bin = binCount - 1; bin > 0; bin--) {
+			rightBounds[bin - 1] = bin < binCount - 1 ? rightBounds[bin] : Bounds();
+			rightBounds[bin - 1].grow(binBounds[bin]);
+			rightTriangleCounts[bin - 1] = (bin < binCount - 1 ? rightTriangleCounts[bin] : 0) + binTriangleCounts[bin];
+		}
+		double bestCost = blasTraceCost(bounds.surfaceArea(), (uint32)triangles.size());
+		uint32 bestSplit = 0;
+		Bounds leftBounds;
+		uint32 leftTriangleCount = 0;
+		for (uint32 split = 0; split < binCount - 1; split++) {
+			leftBounds.grow(binBounds[split]);
+			leftTriangleCount += binTriangleCounts[split];
+			if (leftTriangleCount == 0 || rightTriangleCounts[split] == 0) {
+				continue;
+			}
+			double cost = blasTraceCost(leftBounds.surfaceArea(), leftTriangleCount) + blasTraceCost(rightBounds[split].surfaceArea(), rightTriangleCounts[split]);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestSplit = split + 1;
+			}
+		}
+		if (bestSplit == 0) {
+			clusters.push_back(triangles);
+			return;
+		}
+		auto middle = std::partition(triangles.begin(), triangles.end(), [&](const PartitionTriangle& triangle) { return binIndex(triangle) < bestSplit; });
+		size_t leftCount = std::distance(triangles.begin(), middle);
+		splitTriangles(triangles.first(leftCount), depth + 1, clusters);
+		splitTriangles(triangles.subspan(leftCount), depth + 1, clusters);
+	}
+
+	void printLayoutStats() {
+		const uint64 fullInstanceSize = 2 * sizeof(float[4][4]) + 4 * sizeof(uint32); // transform and its inverse transpose
+		uint64 triangleCount = 0;
+		for (auto& mesh : meshes) {
+			for (uint32 geometryIndex = mesh.geometryOffset; geometryIndex < mesh.geometryOffset + mesh.geometryCount; geometryIndex++) {
+				triangleCount += geometryInfos[geometryIndex].indexCount / 3;
+			}
+		}
+		triangleCount = std::max(triangleCount, (uint64)1);
+		uint64 fullSize = vertices.size() * sizeof(Vertex) + indices.size_bytes();
+		uint64 packedSize = vertices.size() * sizeof(PackedVertex) + indices.size_bytes();
+		printf("scene layout: %.1f -> %.1f bytes per triangle, vertices+indices %.2f MB -> %.2f MB\n",
+			fullSize / (double)triangleCount, packedSize / (double)triangleCount, fullSize / (double)1_mb, packedSize / (double)1_mb);
+		printf("    instances %llu -> %llu bytes each, hit shader fetch %llu -> %llu bytes\n",
+			fullInstanceSize, (uint64)sizeof(PackedInstance),
+			fullInstanceSize + 3 * sizeof(Vertex), sizeof(PackedInstance) + 3 * sizeof(PackedVertex));
+	}
+
+	// Per triangle 0.5 * log2(uv area / object space area), the texture independent base of the ray cone texture lod.
+	// Indexed by the triangle's first index position in uint16 units divided by 3, which is unique as triangles take
+	// at least 3 index slots. Geometries that repeat or cover part of another geometry's index range are computed once.
+	std::vector<float> computeTriangleLods() {
+		std::vector<float> triangleLods((indices.size() + 2) / 3, 0.0f);
+		std::vector<uint32> geometryOrder(geometries.size());
+		for (uint32 i = 0; i < geometryOrder.size(); i++) geometryOrder[i] = i;
+		std::sort(geometryOrder.begin(), geometryOrder.end(), [this](uint32 a, uint32 b) {
+			return geometries[a].indexOffset < geometries[b].indexOffset ||
+				(geometries[a].indexOffset == geometries[b].indexOffset && geometryInfos[a].indexCount > geometryInfos[b].indexCount);
+		});
+		TaskGraph graph(jobSystem);
+		uint64 coveredEnd = 0;
+		for (uint32 geometryIndex : geometryOrder) {
+			const Geometry& geometry = geometries[geometryIndex];
+			uint64 end = geometry.indexOffset + (uint64)geometryInfos[geometryIndex].indexCount * geometry.indexStride;
+			if (end <= coveredEnd) continue;
+			coveredEnd = end;
+			graph.add([this, &triangleLods, &geometry, triangleCount = geometryInfos[geometryIndex].indexCount / 3] {
+				for (uint32 triangle = 0; triangle < triangleCount; triangle++) {
+					const Vertex& v0 = vertices[geometry.vertexOffset + indexAt(geometry, triangle * 3)];
+					const Vertex& v1 = vertices[geometry.vertexOffset + indexAt(geometry, triangle * 3 + 1)];
+					const Vertex& v2 = vertices[geometry.vertexOffset + indexAt(geometry, triangle * 3 + 2)];
+					XMVECTOR p0 = XMVectorSet(v0.position[0], v0.position[1], v0.position[2], 0);
+					XMVECTOR p1 = XMVectorSet(v1.position[0], v1.position[1], v1.position[2], 0);
+					XMVECTOR p2 = XMVectorSet(v2.position[0], v2.position[1], v2.position[2], 0);
+					float positionArea = XMVectorGetX(XMVector3Length(XMVector3Cross(p1 - p0, p2 - p0)));
+					float uvArea = fabsf((v1.uv[0] - v0.uv[0]) * (v2.uv[1] - v0.uv[1]) - (v2.uv[0] - v0.uv[0]) * (v1.uv[1] - v0.uv[1]));
+					float lod = positionArea > 0 && uvArea > 0 ? 0.5f * log2f(uvArea / positionArea) : 0.0f;
+					triangleLods[(geometry.indexOffset + triangle * 3 * geometry.indexStride) / 3] = lod;
+				}
+			});
+		}
+		graph.wait();
+		return triangleLods;
+	}
+
+	uint64 buildVkResources(Vulkan* vk, const SceneLoadOptions& options) {
+		packedVertices.resize(vertices.size());
+		packVertices(packedVertices.data(), vertices.data(), vertices.size());
+		std::vector<PackedInstance> packedInstances(instances.size());
+		for (size_t instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+			packedInstances[instanceIndex] = packInstance(instances[instanceIndex]);
+		}
+		printLayoutStats();
+		std::vector<float> triangleLods = computeTriangleLods();
+
+		uint64 verticesBufferSize = packedVertices.size() * sizeof(PackedVertex);
+		uint64 indicesBufferSize = indices.size_bytes();
+		uint64 geometriesBufferSize = geometries.size() * sizeof(Geometry);
+		uint64 materialsBufferSize = materials.size() * sizeof(Material);
+		uint64 instancesBufferSize = packedInstances.size() * sizeof(PackedInstance);
+		uint64 triangleLodsBufferSize = std::max(triangleLods.size(), (size_t)1) * sizeof(float);
+		{
+			VkBufferUsageFlags bufferUsageFlags =
+				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+				VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
+			verticesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, verticesBufferSize, bufferUsageFlags).first;
+			indicesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, indicesBufferSize, bufferUsageFlags).first;
+			geometriesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, geometriesBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).first;
+			materialsBuffer = vk->createBuffer(&vk->gpuBuffersMemory, materialsBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).first;
+			triangleLodsBuffer = vk->createBuffer(&vk->gpuBuffersMemory, triangleLodsBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).first;
+			for (auto& feedbackBuffer : textureFeedbackBuffers) {
+				uint64 feedbackBufferSize = std::max(images.size(), (size_t)1) * sizeof(uint32);
+				std::tie(feedbackBuffer.buffer, feedbackBuffer.mappedPtr) = vk->createBuffer(&vk->uniformBuffersMemory, feedbackBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+				memset(feedbackBuffer.mappedPtr, 0, feedbackBufferSize);
+			}
+			// Streaming loads mips out of the scene cache, so it needs every texture's full mip chain in there.
+			bool streamTextures = options.textureStreamingBudget > 0 && !images.empty() && std::all_of(images.begin(), images.end(), [](const Image& image) {
+				return image.data && image.storedMipLevels == image.mipLevels;
+			});
+			if (options.textureStreamingBudget > 0 && !images.empty() && !streamTextures) {
+				printf("texture streaming: textures are not all in the scene cache with cpu mips, loading them fully\n");
+			}
+			textureStreamingBudget = options.textureStreamingBudget;
+			textureStreamingResidentSize = 0;
+			for (auto& image : images) {
+				if (streamTextures) {
+					uint32 tailLevel = 0;
+					while (std::max(image.width >> tailLevel, image.height >> tailLevel) > textureStreamingTailSize) tailLevel++;
+					streamedTextures.push_back(StreamedTexture{ .tailLevel = tailLevel, .residentLevel = image.mipLevels, .requestedLevel = image.mipLevels });
+					textures.push_back(vk->blankTexture);
+					continue;
+				}
+				VkImageUsageFlags flags = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+				if (image.storedMipLevels < image.mipLevels) flags |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+				auto vkImageAndView = vk->createImage2DAndView(&vk->gpuTexturesMemory, image.width, image.height, image.format, VK_IMAGE_ASPECT_COLOR_BIT, flags, image.mipLevels);
+				textures.push_back(vkImageAndView);
+			}
+			if (streamTextures) {
+				printf("texture streaming: %u textures, %.1f MB budget\n", (uint32)streamedTextures.size(), textureStreamingBudget / (double)1_mb);
+			}
+		}
+		printTextureStats();
+
+		alphaMaskGeometryCount = 0;
+		for (auto& geometry : geometries) {
+			alphaMaskGeometryCount += materials[geometry.materialIndex].alphaMask;
+		}
+		if (alphaMaskGeometryCount > 0) {
+			printf("alpha mask: %u of %u geometries use any-hit\n", alphaMaskGeometryCount, (uint32)geometries.size());
+		}
+
+		instanceDirtyFlags.assign(instances.size(), 0);
+		instanceMovedFlags.assign(instances.size(), 0);
+		createInstanceBuffers(vk, std::max((uint32)instances.size(), minInstanceCapacity));
+
+		{
+			StreamingLoader loader(vk, jobSystem);
+			// Payloads that sit unmodified in the scene cache are read from the file straight into the staging ring
+			// rather than faulted in through the cache mapping.
+			uint32 cacheFileIndex = UINT32_MAX;
+			if (options.directStagingReads && cacheMapping.data) {
+				cacheFileIndex = loader.reader.openFile(std::filesystem::path(filePath).replace_extension(".vkrtscene"));
+			}
+			auto cacheFileOffset = [this, cacheFileIndex](const void* data) {
+				const uint8* ptr = (const uint8*)data;
+				bool inCache = cacheFileIndex != UINT32_MAX && ptr >= cacheMapping.data && ptr < cacheMapping.data + cacheMapping.size;
+				return inCache ? (uint64)(ptr - cacheMapping.data) : UINT64_MAX;
+			};
+			loader.addBuffer(verticesBuffer, packedVertices.data(), verticesBufferSize);
+			if (uint64 offset = cacheFileOffset(indices.data()); offset != UINT64_MAX) {
+				loader.addFileBuffer(indicesBuffer, cacheFileIndex, offset, indicesBufferSize);
+			}
+			else {
+				loader.addBuffer(indicesBuffer, indices.data(), indicesBufferSize);
+			}
+			loader.addBuffer(geometriesBuffer, geometries.data(), geometriesBufferSize);
+			loader.addBuffer(materialsBuffer, materials.data(), materialsBufferSize);
+			loader.addBuffer(instancesBuffer, packedInstances.data(), instancesBufferSize);
+			loader.addBuffer(triangleLodsBuffer, triangleLods.data(), triangleLods.size() * sizeof(float));
+			uint32 imageItemOffset = (uint32)loader.items.size();
+			for (uint32 imageIndex = 0; imageIndex < images.size() && streamedTextures.empty(); imageIndex++) {
+				if (uint64 offset = cacheFileOffset(images[imageIndex].data); offset != UINT64_MAX) {
+					loader.addFileImage(textures[imageIndex].first, images[imageIndex], cacheFileIndex, offset);
+				}
+				else if (images[imageIndex].data) {
+					loader.addImage(textures[imageIndex].first, images[imageIndex]);
+				}
+				else {
+					uint32 encodedFileIndex = options.asyncReads ? loader.reader.openFile(imageFilePaths[imageIndex]) : UINT32_MAX;
+					loader.addImage(textures[imageIndex].first, images[imageIndex], [this, imageIndex](std::span<const uint8> encoded) {
+						return decodeImage(imageIndex, encoded);
+					}, encodedFileIndex);
+				}
+			}
+			if (cacheFile.is_open()) {
+				loader.itemStaged = [this, imageItemOffset](uint32 itemIndex, const uint8* data) {
+					if (itemIndex >= imageItemOffset) {
+						writeCacheImage(itemIndex - imageItemOffset, data);
+					}
+				};
+			}
+			loader.run();
+			uint32 blitImageCount = 0;
+			VkCommandBuffer cmdBuf = VK_NULL_HANDLE;
+			for (uint32 imageIndex = 0; imageIndex < images.size(); imageIndex++) {
+				const Image& image = images[imageIndex];
+				if (image.storedMipLevels < image.mipLevels) {
+					if (!cmdBuf) cmdBuf = vk->beginGraphicsCmdBuf();
+					vk->recordMipBlits(cmdBuf, textures[imageIndex].first, image.width, image.height, image.mipLevels);
+					blitImageCount++;
+				}
+			}
+			if (cmdBuf) {
+				vk->submitGraphicsCmdBuf(cmdBuf);
+				printf("Generated mips for %u textures with blits\n", blitImageCount);
+			}
+		}
+		if (options.blasCache) {
+			std::filesystem::path blasCachePath = std::filesystem::path(filePath).replace_extension(".vkrtblas");
+			std::vector<uint64> meshHashes = hashMeshes();
+			if (options.rebuildCache || !loadBlasCache(vk, blasCachePath, meshHashes)) {
+				buildBlas(vk, options);
+				writeBlasCache(vk, blasCachePath, meshHashes);
+			}
+		}
+		else {
+			buildBlas(vk, options);
+		}
+		packedVertices = {};
+		{
+			blasDeviceAddresses.resize(blas.size());
+			for (size_t i = 0; i < blas.size(); i++) {
+				VkAccelerationStructureDeviceAddressInfoKHR asDeviceAddressInfo = {
+					.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+					.accelerationStructure = blas[i]
+				};
+				blasDeviceAddresses[i] = vkGetAccelerationStructureDeviceAddress(vk->device, &asDeviceAddressInfo);
+			}
+			tlasInstances.resize(instances.size());
+			for (uint32 instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+				VkAccelerationStructureInstanceKHR& tlasInstance = tlasInstances[instanceIndex];
+				tlasInstance = {
+					.instanceCustomIndex = instanceIndex,
+					.mask = 0xff,
+					.instanceShaderBindingTableRecordOffset = meshHasAlphaMask(instanceMeshIndices[instanceIndex]) ? 1u : 0u,
+					.accelerationStructureReference = blasDeviceAddresses[instanceMeshIndices[instanceIndex]]
+				};
+				XMMATRIX transformT = XMMatrixTranspose(XMMATRIX(&instances[instanceIndex].transform[0][0]));
+				memcpy(tlasInstance.transform.matrix, transformT.r, 12 * sizeof(float));
+			}
+			StreamingLoader loader(vk, jobSystem);
+			loader.addBuffer(tlasBuildInstancesBuffer, tlasInstances.data(), tlasInstances.size() * sizeof(VkAccelerationStructureInstanceKHR));
+			loader.run();
+		}
+		{
+			VkCommandBuffer cmdBuf = vk->beginGraphicsCmdBuf();
+			VkMemoryBarrier memoryBarrier = {
+				.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+				.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+				.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+			};
+			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+			recordTlasBuild(vk, cmdBuf, false);
+			return vk->submitGraphicsCmdBuf(cmdBuf);
+		}
+	}
+
+	void buildBlas(Vulkan* vk, const SceneLoadOptions& options) {
+		std::vector<VkAccelerationStructureBuildGeometryInfoKHR> blasInfos(meshes.size());
+		std::vector<VkAccelerationStructureBuildSizesInfoKHR> blasSizes(meshes.size());
+		std::vector<std::vector<VkAccelerationStructureGeometryKHR>> blasGeometries(meshes.size());
+		std::vector<std::vector<VkAccelerationStructureBuildRangeInfoKHR>> blasRanges(meshes.size());
+		std::vector<uint8> blasHostBuilt(meshes.size(), 0);
+		std::vector<uint32> deviceBlasIndices;
+		std::vector<uint32> hostBlasIndices;
+		BlasBuildMode buildMode = options.blasBuildMode;
+		if (buildMode != BlasBuildMode::Device && !vk->accelerationStructureHostCommands) {
+			printf("blas build: accelerationStructureHostCommands not supported, falling back to device builds\n");
+			buildMode = BlasBuildMode::Device;
+		}
+		{
+			if (buildMode == BlasBuildMode::Host) {
+				std::fill(blasHostBuilt.begin(), blasHostBuilt.end(), 1);
+			}
+			else if (buildMode == BlasBuildMode::Mixed) {
+				// Hand out the largest meshes first, each to whichever side is furthest below its share of the triangles.
+				std::vector<uint64> triangleCounts(meshes.size(), 0);
+				std::vector<uint32> meshIndices(meshes.size());
+				uint64 totalTriangleCount = 0;
+				for (uint32 meshIndex = 0; meshIndex < meshes.size(); meshIndex++) {
+					for (uint32 geometryIndex = 0; geometryIndex < meshes[meshIndex].geometryCount; geometryIndex++) {
+						triangleCounts[meshIndex] += geometryInfos[meshes[meshIndex].geometryOffset + geometryIndex].indexCount / 3;
+					}
+					totalTriangleCount += triangleCounts[meshIndex];
+					meshIndices[meshIndex] = meshIndex;
+				}
+				std::sort(meshIndices.begin(), meshIndices.end(), [&](uint32 a, uint32 b) { return triangleCounts[a] > triangleCounts[b]; });
+				double hostShare = std::clamp(options.blasHostBuildShare, 0.0, 1.0);
+				uint64 hostTriangleCount = 0;
+				uint64 deviceTriangleCount = 0;
+				for (uint32 meshIndex : meshIndices) {
+					double hostDeficit = hostShare * totalTriangleCount - hostTriangleCount;
+					double deviceDeficit = (1.0 - hostShare) * totalTriangleCount - deviceTriangleCount;
+					if (hostDeficit > deviceDeficit) {
+						blasHostBuilt[meshIndex] = 1;
+						hostTriangleCount += triangleCounts[meshIndex];
+					}
+					else {
+						deviceTriangleCount += triangleCounts[meshIndex];
+					}
+				}
+			}
+			for (uint32 meshIndex = 0; meshIndex < meshes.size(); meshIndex++) {
+				(blasHostBuilt[meshIndex] ? hostBlasIndices : deviceBlasIndices).push_back(meshIndex);
+			}
+		}
+		{
+			VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
+				.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+				.buffer = verticesBuffer
+			};
+			VkDeviceAddress vertexBufferDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
+			bufferDeviceAddressInfo.buffer = indicesBuffer;
+			VkDeviceAddress indexBufferDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
+
+			uint64 blasBufferSize = 0;
+			uint64 hostBlasBufferSize = 0;
+			for (size_t meshIndex = 0; meshIndex < meshes.size(); meshIndex++) {
+				auto& mesh = meshes[meshIndex];
+				auto& geometries = blasGeometries[meshIndex];
+				auto& ranges = blasRanges[meshIndex];
+				bool hostBuilt = blasHostBuilt[meshIndex];
+				geometries.resize(mesh.geometryCount);
+				ranges.resize(mesh.geometryCount);
+				std::vector<uint32> maxPrimitiveCounts(mesh.geometryCount);
+				for (uint32 geometryIndex = 0; geometryIndex < mesh.geometryCount; geometryIndex++) {
+					auto& geometry = this->geometries[mesh.geometryOffset + geometryIndex];
+					auto& geometryInfo = geometryInfos[mesh.geometryOffset + geometryIndex];
+					geometries[geometryIndex] = {
+						.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+						.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
+						.geometry = {
+							.triangles = {
+								.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
+								.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
+								.vertexStride = sizeof(struct PackedVertex),
+								.maxVertex = geometryInfo.vertexCount,
+								.indexType = geometry.indexStride == 2 ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16,
+							}
+						}
+					};
+					if (!materials[geometry.materialIndex].alphaMask) {
+						geometries[geometryIndex].flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+					}
+					auto& triangles = geometries[geometryIndex].geometry.triangles;
+					if (hostBuilt) {
+						triangles.vertexData.hostAddress = packedVertices.data() + geometry.vertexOffset;
+						triangles.indexData.hostAddress = indices.data() + geometry.indexOffset;
+					}
+					else {
+						triangles.vertexData.deviceAddress = vertexBufferDeviceAddress + geometry.vertexOffset * sizeof(struct PackedVertex);
+						triangles.indexData.deviceAddress = indexBufferDeviceAddress + geometry.indexOffset * sizeof(uint16);
+					}
+					ranges[geometryIndex] = {
+						.primitiveCount = geometryInfo.indexCount / 3
+					};
+					maxPrimitiveCounts[geometryIndex] = ranges[geometryIndex].primitiveCount;
+				}
+
+				auto& blasInfo = blasInfos[meshIndex];
+				blasInfo = {
+					.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+					.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+					.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | (options.compactBlas ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR : 0u),
+					.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+					.geometryCount = mesh.geometryCount,
+					.pGeometries = geometries.data()
+				};
+				blasSizes[meshIndex] = {
+					.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR
+				};
+				VkAccelerationStructureBuildTypeKHR buildType = hostBuilt ? VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR : VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR;
+				vkGetAccelerationStructureBuildSizes(vk->device, buildType, &blasInfo, maxPrimitiveCounts.data(), &blasSizes[meshIndex]);
+				(hostBuilt ? hostBlasBufferSize : blasBufferSize) += align(blasSizes[meshIndex].accelerationStructureSize, vkAccelerationStructureAlignment);
+			}
+
+			VkBufferUsageFlags blasBufferUsageFlags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+			blasBuffer = blasBufferSize > 0 ? vk->createBuffer(&vk->gpuBuffersMemory, blasBufferSize, blasBufferUsageFlags).first : VK_NULL_HANDLE;
+			hostBlasBuffer = hostBlasBufferSize > 0 ? vk->createBuffer(&vk->hostAccelerationStructuresMemory, hostBlasBufferSize, blasBufferUsageFlags).first : VK_NULL_HANDLE;
+			uint64 blasBufferOffset = 0;
+			uint64 hostBlasBufferOffset = 0;
+			for (size_t i = 0; i < blasInfos.size(); i++) {
+				auto& info = blasInfos[i];
+				auto& size = blasSizes[i];
+				uint64& offset = blasHostBuilt[i] ? hostBlasBufferOffset : blasBufferOffset;
+				VkAccelerationStructureCreateInfoKHR blasCreateInfo = {
+					.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+					.buffer = blasHostBuilt[i] ? hostBlasBuffer : blasBuffer,
+					.offset = offset,
+					.size = size.accelerationStructureSize,
+					.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
+				};
+				vkCreateAccelerationStructure(vk->device, &blasCreateInfo, nullptr, &info.dstAccelerationStructure);
+				blas.push_back(info.dstAccelerationStructure);
+				offset += align(size.accelerationStructureSize, vkAccelerationStructureAlignment);
+			}
+		}
+
+		std::vector<uint32> blasBatchOffsets;
+		scratchBuffer = VK_NULL_HANDLE;
+		if (!deviceBlasIndices.empty()) {
+			// Greedily group device BLAS builds into batches whose scratch fits the budget, every batch reuses the same scratch buffer.
+			// A BLAS whose scratch alone exceeds the budget gets a batch of its own.
+			uint64 scratchBufferAlignment = vk->accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment;
+			uint64 scratchBufferSize = 0;
+			uint64 batchScratchSize = 0;
+			uint64 unbatchedScratchSize = 0;
+			for (uint32 i = 0; i < deviceBlasIndices.size(); i++) {
+				uint64 size = align(blasSizes[deviceBlasIndices[i]].buildScratchSize, scratchBufferAlignment);
+				unbatchedScratchSize += size;
+				if (i == 0 || batchScratchSize + size > options.blasScratchBudget) {
+					blasBatchOffsets.push_back(i);
+					batchScratchSize = 0;
+				}
+				batchScratchSize += size;
+				scratchBufferSize = std::max(scratchBufferSize, batchScratchSize);
+			}
+			blasBatchOffsets.push_back((uint32)deviceBlasIndices.size());
+			scratchBuffer = vk->createBuffer(&vk->gpuBuffersMemory, scratchBufferSize + scratchBufferAlignment, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT).first;
+
+			VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
+				.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+				.buffer = scratchBuffer
+			};
+			VkDeviceAddress scratchBufferDeviceAddress = align(vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo), scratchBufferAlignment);
+			for (size_t batchIndex = 0; batchIndex + 1 < blasBatchOffsets.size(); batchIndex++) {
+				VkDeviceAddress deviceAddress = scratchBufferDeviceAddress;
+				for (uint32 i = blasBatchOffsets[batchIndex]; i < blasBatchOffsets[batchIndex + 1]; i++) {
+					blasInfos[deviceBlasIndices[i]].scratchData.deviceAddress = deviceAddress;
+					deviceAddress = align(deviceAddress + blasSizes[deviceBlasIndices[i]].buildScratchSize, scratchBufferAlignment);
+				}
+			}
+			printf("blas build: %u device meshes in %u batches, scratch %.1f MB (%.1f MB unbatched)\n",
+				(uint32)deviceBlasIndices.size(), (uint32)blasBatchOffsets.size() - 1, scratchBufferSize / (double)1_mb, unbatchedScratchSize / (double)1_mb);
+		}
+		{
+			auto blasBuildStartTime = std::chrono::steady_clock::now();
+			bool compactDeviceBlas = options.compactBlas && !deviceBlasIndices.empty();
+			VkQueryPool compactedSizeQueryPool = VK_NULL_HANDLE;
+			if (compactDeviceBlas) {
+				VkQueryPoolCreateInfo queryPoolCreateInfo = {
+					.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+					.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+					.queryCount = (uint32)deviceBlasIndices.size()
+				};
+				vkCreateQueryPool(vk->device, &queryPoolCreateInfo, nullptr, &compactedSizeQueryPool);
+			}
+			std::vector<VkAccelerationStructureBuildGeometryInfoKHR> deviceBlasInfos;
+			std::vector<VkAccelerationStructureBuildRangeInfoKHR*> deviceBlasRangesPtr;
+			std::vector<VkAccelerationStructureKHR> deviceBlas;
+			for (uint32 meshIndex : deviceBlasIndices) {
+				deviceBlasInfos.push_back(blasInfos[meshIndex]);
+				deviceBlasRangesPtr.push_back(blasRanges[meshIndex].data());
+				deviceBlas.push_back(blas[meshIndex]);
+			}
+			VkCommandBuffer cmdBuf = vk->beginGraphicsCmdBuf();
+			if (compactDeviceBlas) {
+				vkCmdResetQueryPool(cmdBuf, compactedSizeQueryPool, 0, (uint32)deviceBlas.size());
+			}
+			for (size_t batchIndex = 0; batchIndex + 1 < blasBatchOffsets.size(); batchIndex++) {
+				if (batchIndex > 0) {
+					VkMemoryBarrier memoryBarrier = {
+						.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+						.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+						.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+					};
+					vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+				}
+				uint32 infoOffset = blasBatchOffsets[batchIndex];
+				uint32 infoCount = blasBatchOffsets[batchIndex + 1] - infoOffset;
+				vkCmdBuildAccelerationStructures(cmdBuf, infoCount, deviceBlasInfos.data() + infoOffset, deviceBlasRangesPtr.data() + infoOffset);
+			}
+			if (compactDeviceBlas) {
+				VkMemoryBarrier memoryBarrier = {
+					.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+					.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+					.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+				};
+				vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+				vkCmdWriteAccelerationStructuresProperties(cmdBuf, (uint32)deviceBlas.size(), deviceBlas.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, compactedSizeQueryPool, 0);
+			}
+			uint64 blasBuildSemaphoreValue = vk->submitGraphicsCmdBuf(cmdBuf);
+
+			// Host builds run on the job system while the GPU works through the device batches.
+			double hostBuildTime = 0;
+			if (!hostBlasIndices.empty()) {
+				auto hostBuildStartTime = std::chrono::steady_clock::now();
+				buildHostBlas(vk, hostBlasIndices, blasInfos, blasSizes, blasRanges);
+				hostBuildTime = secondsSince(hostBuildStartTime);
+			}
+			vk->waitSemaphore(vk->graphicsTimeline, blasBuildSemaphoreValue);
+			if (scratchBuffer) {
+				vk->destroyBuffer(scratchBuffer);
+				scratchBuffer = VK_NULL_HANDLE;
+			}
+			printf("blas build: %s, %u device meshes, %u host meshes, host %.1f ms, total %.1f ms\n",
+				blasBuildModeNames[(int)buildMode], (uint32)deviceBlasIndices.size(), (uint32)hostBlasIndices.size(), hostBuildTime * 1000, secondsSince(blasBuildStartTime) * 1000);
+
+			if (options.compactBlas) {
+				std::vector<uint64> compactedSizes(blas.size());
+				if (compactDeviceBlas) {
+					std::vector<uint64> deviceCompactedSizes(deviceBlas.size());
+					vkGetQueryPoolResults(vk->device, compactedSizeQueryPool, 0, (uint32)deviceBlas.size(), deviceCompactedSizes.size() * sizeof(uint64), deviceCompactedSizes.data(), sizeof(uint64), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+					for (size_t i = 0; i < deviceBlasIndices.size(); i++) {
+						compactedSizes[deviceBlasIndices[i]] = deviceCompactedSizes[i];
+					}
+					vkDestroyQueryPool(vk->device, compactedSizeQueryPool, nullptr);
+				}
+				if (!hostBlasIndices.empty()) {
+					std::vector<VkAccelerationStructureKHR> hostBlas;
+					for (uint32 meshIndex : hostBlasIndices) {
+						hostBlas.push_back(blas[meshIndex]);
+					}
+					std::vector<uint64> hostCompactedSizes(hostBlas.size());
+					vkWriteAccelerationStructuresProperties(vk->device, (uint32)hostBlas.size(), hostBlas.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, hostCompactedSizes.size() * sizeof(uint64), hostCompactedSizes.data(), sizeof(uint64));
+					for (size_t i = 0; i < hostBlasIndices.size(); i++) {
+						compactedSizes[hostBlasIndices[i]] = hostCompactedSizes[i];
+					}
+				}
+				compactBlasBuffer(vk, compactedSizes, blasSizes);
+			}
+		}
+	}
+
+	std::vector<uint64> hashMeshes() {
+		std::vector<uint64> meshHashes(meshes.size());
+		TaskGraph graph(jobSystem);
+		for (uint32 meshIndex = 0; meshIndex < meshes.size(); meshIndex++) {
+			graph.add([this, meshIndex, &meshHashes] {
+				auto& mesh = meshes[meshIndex];
+				uint64 hash = hashBytes(&mesh.geometryCount, sizeof(mesh.geometryCount));
+				for (uint32 geometryIndex = mesh.geometryOffset; geometryIndex < mesh.geometryOffset + mesh.geometryCount; geometryIndex++) {
+					auto& geometry = geometries[geometryIndex];
+					auto& geometryInfo = geometryInfos[geometryIndex];
+					hash = hashBytes(&geometryInfo, sizeof(GeometryInfo), hash);
+					hash = hashBytes(&materials[geometry.materialIndex].alphaMask, sizeof(uint32), hash);
+					hash = hashBytes(vertices.data() + geometry.vertexOffset, geometryInfo.vertexCount * sizeof(Vertex), hash);
+					hash = hashBytes(&geometry.indexStride, sizeof(uint32), hash);
+					hash = hashBytes(indices.data() + geometry.indexOffset, geometryInfo.indexCount * geometry.indexStride * sizeof(uint16), hash);
+				}
+				meshHashes[meshIndex] = hash;
+			});
+		}
+		graph.wait();
+		return meshHashes;
+	}
+
+	bool loadBlasCache(Vulkan* vk, const std::filesystem::path& cachePath, std::span<const uint64> meshHashes) {
+		auto loadStartTime = std::chrono::steady_clock::now();
+		FileMapping mapping;
+		if (!mapping.map(cachePath)) {
+			return false;
+		}
+		BlasCacheHeader* header = (BlasCacheHeader*)mapping.data;
+		bool valid = mapping.size >= sizeof(BlasCacheHeader) &&
+			!memcmp(header->magic, blasCacheMagic, sizeof(blasCacheMagic)) &&
+			header->version == blasCacheVersion &&
+			header->blasCount == meshHashes.size() &&
+			!memcmp(header->driverUUID, vk->physicalDeviceIDProperties.driverUUID, VK_UUID_SIZE);
+		for (SceneCacheSection* section : { &header->entries, &header->data }) {
+			valid = valid && section->offset <= mapping.size && section->size <= mapping.size - section->offset;
+		}
+		valid = valid && header->entries.size == header->blasCount * sizeof(BlasCacheEntry);
+		std::span<const BlasCacheEntry> entries;
+		if (valid) {
+			entries = std::span((const BlasCacheEntry*)(mapping.data + header->entries.offset), header->blasCount);
+			for (size_t i = 0; valid && i < entries.size(); i++) {
+				const BlasCacheEntry& entry = entries[i];
+				valid = entry.meshHash == meshHashes[i] && entry.offset <= header->data.size && entry.size <= header->data.size - entry.offset && entry.size >= blasSerializedHeaderSize;
+				if (valid) {
+					VkAccelerationStructureVersionInfoKHR versionInfo = {
+						.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR,
+						.pVersionData = mapping.data + header->data.offset + entry.offset
+					};
+					VkAccelerationStructureCompatibilityKHR compatibility;
+					vkGetDeviceAccelerationStructureCompatibility(vk->device, &versionInfo, &compatibility);
+					valid = compatibility == VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR;
+				}
+			}
+		}
+		if (!valid) {
+			printf("blas cache: \"%s\" is stale or incompatible, rebuilding\n", cachePath.generic_string().c_str());
+			mapping.unmap();
+			return false;
+		}
+
+		std::vector<uint64> deserializedSizes(entries.size());
+		uint64 stagingBufferSize = 0;
+		uint64 blasBufferSize = 0;
+		for (size_t i = 0; i < entries.size(); i++) {
+			const uint8* blob = mapping.data + header->data.offset + entries[i].offset;
+			memcpy(&deserializedSizes[i], blob + 2 * VK_UUID_SIZE + sizeof(uint64), sizeof(uint64));
+			stagingBufferSize += align(entries[i].size, vkAccelerationStructureAlignment);
+			blasBufferSize += align(deserializedSizes[i], vkAccelerationStructureAlignment);
+		}
+		auto [stagingBuffer, stagingBufferPtr] = vk->createBuffer(&vk->hostAccelerationStructuresMemory, stagingBufferSize + vkAccelerationStructureAlignment,
+			VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+		VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+			.buffer = stagingBuffer
+		};
+		VkDeviceAddress stagingBufferDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
+		uint64 stagingBufferOffset = align(stagingBufferDeviceAddress, vkAccelerationStructureAlignment) - stagingBufferDeviceAddress;
+		blasBuffer = vk->createBuffer(&vk->gpuBuffersMemory, blasBufferSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT).first;
+		hostBlasBuffer = VK_NULL_HANDLE;
+		VkCommandBuffer cmdBuf = vk->beginGraphicsCmdBuf();
+		uint64 blasBufferOffset = 0;
+		for (size_t i = 0; i < entries.size(); i++) {
+			parallelMemcpy(jobSystem, stagingBufferPtr + stagingBufferOffset, mapping.data + header->data.offset + entries[i].offset, entries[i].size);
+			VkAccelerationStructureCreateInfoKHR blasCreateInfo = {
+				.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+				.buffer = blasBuffer,
+				.offset = blasBufferOffset,
+				.size = deserializedSizes[i],
+				.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
+			};
+			VkAccelerationStructureKHR as;
+			vkCreateAccelerationStructure(vk->device, &blasCreateInfo, nullptr, &as);
+			blas.push_back(as);
+			VkCopyMemoryToAccelerationStructureInfoKHR copyInfo = {
+				.sType = VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR,
+				.src = { .deviceAddress = stagingBufferDeviceAddress + stagingBufferOffset },
+				.dst = as,
+				.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR
+			};
+			vkCmdCopyMemoryToAccelerationStructure(cmdBuf, &copyInfo);
+			stagingBufferOffset += align(entries[i].size, vkAccelerationStructureAlignment);
+			blasBufferOffset += align(deserializedSizes[i], vkAccelerationStructureAlignment);
+		}
+		vk->waitSemaphore(vk->graphicsTimeline, vk->submitGraphicsCmdBuf(cmdBuf));
+		vk->destroyBuffer(stagingBuffer);
+		mapping.unmap();
+		printf("blas cache: loaded %u blas, %.2f MB in %.1f ms\n", (uint32)blas.size(), blasBufferSize / (double)1_mb, secondsSince(loadStartTime) * 1000);
+		return true;
+	}
+
+	void writeBlasCache(Vulkan* vk, const std::filesystem::path& cachePath, std::span<const uint64> meshHashes) {
+		VkQueryPoolCreateInfo queryPoolCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+			.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR,
+			.queryCount = (uint32)blas.size()
+		};
+		VkQueryPool serializationSizeQueryPool;
+		vkCreateQueryPool(vk->device, &queryPoolCreateInfo, nullptr, &serializationSizeQueryPool);
+		VkCommandBuffer cmdBuf = vk->beginGraphicsCmdBuf();
+		VkMemoryBarrier memoryBarrier = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+			.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+		};
+		vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+		vkCmdResetQueryPool(cmdBuf, serializationSizeQueryPool, 0, (uint32)blas.size());
+		vkCmdWriteAccelerationStructuresProperties(cmdBuf, (uint32)blas.size(), blas.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, serializationSizeQueryPool, 0);
+		vk->waitSemaphore(vk->graphicsTimeline, vk->submitGraphicsCmdBuf(cmdBuf));
+		std::vector<uint64> serializedSizes(blas.size());
+		vkGetQueryPoolResults(vk->device, serializationSizeQueryPool, 0, (uint32)blas.size(), serializedSizes.size() * sizeof(uint64), serializedSizes.data(), sizeof(uint64), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+		vkDestroyQueryPool(vk->device, serializationSizeQueryPool, nullptr);
+
+		uint64 serializeBufferSize = 0;
+		for (uint64 size : serializedSizes) {
+			serializeBufferSize += align(size, vkAccelerationStructureAlignment);
+		}
+		auto [serializeBuffer, serializeBufferPtr] = vk->createBuffer(&vk->hostAccelerationStructuresMemory, serializeBufferSize + vkAccelerationStructureAlignment,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+		VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+			.buffer = serializeBuffer
+		};
+		VkDeviceAddress serializeBufferDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
+		uint64 serializeBufferBaseOffset = align(serializeBufferDeviceAddress, vkAccelerationStructureAlignment) - serializeBufferDeviceAddress;
+		cmdBuf = vk->beginGraphicsCmdBuf();
+		uint64 serializeBufferOffset = serializeBufferBaseOffset;
+		for (size_t i = 0; i < blas.size(); i++) {
+			VkCopyAccelerationStructureToMemoryInfoKHR copyInfo = {
+				.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR,
+				.src = blas[i],
+				.dst = { .deviceAddress = serializeBufferDeviceAddress + serializeBufferOffset },
+				.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR
+			};
+			vkCmdCopyAccelerationStructureToMemory(cmdBuf, &copyInfo);
+			serializeBufferOffset += align(serializedSizes[i], vkAccelerationStructureAlignment);
+		}
+		VkMemoryBarrier serializeBarrier = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_HOST_READ_BIT
+		};
+		vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &serializeBarrier, 0, nullptr, 0, nullptr);
+		vk->waitSemaphore(vk->graphicsTimeline, vk->submitGraphicsCmdBuf(cmdBuf));
+
+		std::vector<BlasCacheEntry> entries(blas.size());
+		uint64 dataSize = 0;
+		for (size_t i = 0; i < blas.size(); i++) {
+			entries[i] = { .meshHash = meshHashes[i], .offset = dataSize, .size = serializedSizes[i] };
+			dataSize += serializedSizes[i];
+		}
+		BlasCacheHeader header = {
+			.version = blasCacheVersion,
+			.blasCount = (uint32)blas.size(),
+			.entries = { .offset = sizeof(BlasCacheHeader), .size = entries.size() * sizeof(BlasCacheEntry) },
+			.data = { .offset = sizeof(BlasCacheHeader) + entries.size() * sizeof(BlasCacheEntry), .size = dataSize }
+		};
+		memcpy(header.magic, blasCacheMagic, sizeof(blasCacheMagic));
+		memcpy(header.driverUUID, vk->physicalDeviceIDProperties.driverUUID, VK_UUID_SIZE);
+		std::ofstream file(cachePath, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (file.is_open()) {
+			file.write((const char*)&header, sizeof(header));
+			file.write((const char*)entries.data(), entries.size() * sizeof(BlasCacheEntry));
+			serializeBufferOffset = serializeBufferBaseOffset;
+			for (size_t i = 0; i < blas.size(); i++) {
+				file.write((const char*)serializeBufferPtr + serializeBufferOffset, serializedSizes[i]);
+				serializeBufferOffset += align(serializedSizes[i], vkAccelerationStructureAlignment);
+			}
+			bool good = file.good();
+			file.close();
+			if (!good) {
+				std::error_code error;
+				std::filesystem::remove(cachePath, error);
+			}
+			else {
+				printf("blas cache: wrote %u blas, %.2f MB\n", (uint32)blas.size(), dataSize / (double)1_mb);
+			}
+		}
+		vk->destroyBuffer(serializeBuffer);
+	}
+
+	// The TLAS is sized for instanceCapacity instances and built with ALLOW_UPDATE so it can be refitted in place.
+	void createInstanceBuffers(Vulkan* vk, uint32 capacity) {
+		instanceCapacity = capacity;
+		instancesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, capacity * sizeof(PackedInstance), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).first;
+		tlasBuildInstancesBuffer = vk->createBuffer(
+			&vk->gpuBuffersMemory, capacity * sizeof(VkAccelerationStructureInstanceKHR),
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR
+		).first;
+
+		VkAccelerationStructureGeometryKHR tlasGeometry = {
+			.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+			.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
+			.geometry = {
+				.instances = {
+					.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
+					.arrayOfPointers = VK_FALSE,
+				}
+			}
+		};
+		VkAccelerationStructureBuildGeometryInfoKHR tlasInfo = {
+			.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+			.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
+			.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+			.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+			.geometryCount = 1,
+			.pGeometries = &tlasGeometry,
+		};
+		VkAccelerationStructureBuildSizesInfoKHR tlasSize = {
+			.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR
+		};
+		vkGetAccelerationStructureBuildSizes(vk->device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &tlasInfo, &capacity, &tlasSize);
+
+		tlasBuffer = vk->createBuffer(&vk->gpuBuffersMemory, tlasSize.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR).first;
+		VkAccelerationStructureCreateInfoKHR tlasCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+			.buffer = tlasBuffer,
+			.size = tlasSize.accelerationStructureSize,
+			.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR
+		};
+		vkCreateAccelerationStructure(vk->device, &tlasCreateInfo, nullptr, &tlas);
+
+		uint64 scratchBufferSize = std::max(tlasSize.buildScratchSize, tlasSize.updateScratchSize) + vk->accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment;
+		tlasScratchBuffer = vk->createBuffer(&vk->gpuBuffersMemory, scratchBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT).first;
+	}
+
+	void recordTlasBuild(Vulkan* vk, VkCommandBuffer cmdBuf, bool update) {
+		VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+			.buffer = tlasBuildInstancesBuffer
+		};
+		VkDeviceAddress instancesDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
+		bufferDeviceAddressInfo.buffer = tlasScratchBuffer;
+		VkDeviceAddress scratchDeviceAddress = align(vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo), vk->accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment);
+		VkAccelerationStructureGeometryKHR tlasGeometry = {
+			.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+			.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
+			.geometry = {
+				.instances = {
+					.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
+					.arrayOfPointers = VK_FALSE,
+					.data = { .deviceAddress = instancesDeviceAddress }
+				}
+			}
+		};
+		VkAccelerationStructureBuildGeometryInfoKHR tlasInfo = {
+			.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+			.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
+			.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+			.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+			.srcAccelerationStructure = update ? tlas : VK_NULL_HANDLE,
+			.dstAccelerationStructure = tlas,
+			.geometryCount = 1,
+			.pGeometries = &tlasGeometry,
+			.scratchData = { .deviceAddress = scratchDeviceAddress }
+		};
+		VkAccelerationStructureBuildRangeInfoKHR tlasRange = { .primitiveCount = (uint32)tlasInstances.size() };
+		VkAccelerationStructureBuildRangeInfoKHR* tlasRangePtr = &tlasRange;
+		vkCmdBuildAccelerationStructures(cmdBuf, 1, &tlasInfo, &tlasRangePtr);
+		if (update) {
+			tlasRefitCount += 1;
+			tlasUpdateCount += 1;
+		}
+		else {
+			tlasBuiltInstanceCount = (uint32)tlasInstances.size();
+			tlasRefitCount = 0;
+			tlasRebuildCount += 1;
+			std::fill(instanceMovedFlags.begin(), instanceMovedFlags.end(), 0);
+			movedInstanceCount = 0;
+		}
+	}
+
+	bool meshHasAlphaMask(uint32 meshIndex) {
+		auto& mesh = meshes[meshIndex];
+		for (uint32 geometryIndex = mesh.geometryOffset; geometryIndex < mesh.geometryOffset + mesh.geometryCount; geometryIndex++) {
+			if (materials[geometries[geometryIndex].materialIndex].alphaMask) {
+				return true;
 			}
 		}
+		return false;
 	}
 
-	void buildVkResources(Vulkan* vk) {
-		std::vector<VkAccelerationStructureBuildGeometryInfoKHR> blasInfos;
-		std::vector<VkAccelerationStructureBuildSizesInfoKHR> blasSizes;
-		std::vector<std::vector<VkAccelerationStructureGeometryKHR>> blasGeometries;
-		std::vector<std::vector<VkAccelerationStructureBuildRangeInfoKHR>> blasRanges;
-		std::vector<std::vector<PrimitiveVerticesData>> primitiveVerticesData;
-		uint64 verticesBufferSize = 0;
-		uint64 indicesBufferSize = 0;
-		uint64 geometriesBufferSize = 0;
-		{
-			uint64 blasBufferSize = 0;
-			for (auto& model : models) {
-				for (size_t meshIndex = 0; meshIndex < model.gltfData->meshes_count; meshIndex++) {
-					auto& mesh = model.gltfData->meshes[meshIndex];
-					std::vector<VkAccelerationStructureGeometryKHR> geometries(mesh.primitives_count);
-					std::vector<VkAccelerationStructureBuildRangeInfoKHR> ranges(mesh.primitives_count);
-					std::vector<PrimitiveVerticesData> verticesData(mesh.primitives_count);
-					for (size_t primitiveIndex = 0; primitiveIndex < mesh.primitives_count; primitiveIndex++) {
-						auto& primitive = mesh.primitives[primitiveIndex];
-						cgltf_accessor* indices = primitive.indices;
-						cgltf_accessor* positions = nullptr;
-						cgltf_accessor* normals = nullptr;
-						cgltf_accessor* uvs = nullptr;
-						assert(primitive.type == cgltf_primitive_type_triangles);
-						assert(indices->component_type == cgltf_component_type_r_16u);
-						assert(indices->type == cgltf_type_scalar);
-						assert(indices->count % 3 == 0);
-						assert(indices->stride == 2);
-						assert(indices->buffer_view->buffer->data);
-						for (size_t attribIndex = 0; attribIndex < primitive.attributes_count; attribIndex++) {
-							auto& attribute = primitive.attributes[attribIndex];
-							if (attribute.type == cgltf_attribute_type_position) {
-								assert(attribute.data->component_type == cgltf_component_type_r_32f);
-								assert(attribute.data->type == cgltf_type_vec3);
-								assert(attribute.data->buffer_view->buffer->data);
-								positions = attribute.data;
-							}
-							if (attribute.type == cgltf_attribute_type_normal) {
-								assert(attribute.data->component_type == cgltf_component_type_r_32f);
-								assert(attribute.data->type == cgltf_type_vec3);
-								assert(attribute.data->buffer_view->buffer->data);
-								normals = attribute.data;
-							}
-							if (attribute.type == cgltf_attribute_type_texcoord) {
-								assert(attribute.data->component_type == cgltf_component_type_r_32f);
-								assert(attribute.data->type == cgltf_type_vec2);
-								assert(attribute.data->buffer_view->buffer->data);
-								uvs = attribute.data;
-							}
-						}
-						assert(positions);
-						assert(normals);
-						//assert(uvs);
-
-						geometries[primitiveIndex] = {
-							.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
-							.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
-							.geometry = {
-								.triangles = {
-									.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
-									.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
-									.maxVertex = (uint32)(positions->count),
-									.indexType = VK_INDEX_TYPE_UINT16,
-								}
-							}
-						};
+	// Instance indices are stable: removed instances stay in the TLAS with a zero mask until addInstance reuses the slot.
+	uint32 addInstance(uint32 meshIndex, const XMMATRIX& transform, uint8 mask = 0xff) {
+		assert(meshIndex < meshes.size());
+		uint32 instanceIndex;
+		if (!freeInstanceSlots.empty()) {
+			instanceIndex = freeInstanceSlots.back();
+			freeInstanceSlots.pop_back();
+		}
+		else {
+			instanceIndex = (uint32)instances.size();
+			instances.push_back({});
+			instanceMeshIndices.push_back(0);
+			tlasInstances.push_back({});
+			instanceDirtyFlags.push_back(0);
+			instanceMovedFlags.push_back(0);
+		}
+		instances[instanceIndex].geometryOffset = meshes[meshIndex].geometryOffset;
+		instanceMeshIndices[instanceIndex] = meshIndex;
+		tlasInstances[instanceIndex] = {
+			.instanceCustomIndex = instanceIndex,
+			.mask = mask,
+			.instanceShaderBindingTableRecordOffset = meshHasAlphaMask(meshIndex) ? 1u : 0u,
+			.accelerationStructureReference = blasDeviceAddresses[meshIndex]
+		};
+		setInstanceTransform(instanceIndex, transform);
+		return instanceIndex;
+	}
 
-						ranges[primitiveIndex] = {
-							.primitiveCount = (uint32)(indices->count / 3)
-						};
+	void removeInstance(uint32 instanceIndex) {
+		assert(instanceIndex < instances.size() && tlasInstances[instanceIndex].mask != 0);
+		tlasInstances[instanceIndex].mask = 0;
+		freeInstanceSlots.push_back(instanceIndex);
+		markInstanceDirty(instanceIndex);
+	}
 
-						verticesData[primitiveIndex] = PrimitiveVerticesData{ .indices = indices, .positions = positions, .normals = normals, .uvs = uvs };
+	void setInstanceTransform(uint32 instanceIndex, const XMMATRIX& transform) {
+		Instance& instance = instances[instanceIndex];
+		memcpy(instance.transform, transform.r, sizeof(transform));
+		XMMATRIX transformT = XMMatrixTranspose(transform);
+		memcpy(tlasInstances[instanceIndex].transform.matrix, transformT.r, 12 * sizeof(float));
+		if (!instanceMovedFlags[instanceIndex]) {
+			instanceMovedFlags[instanceIndex] = 1;
+			movedInstanceCount += 1;
+		}
+		markInstanceDirty(instanceIndex);
+	}
 
-						verticesBufferSize += positions->count * sizeof(struct Vertex);
-						indicesBufferSize += indices->count * sizeof(uint16);
-						geometriesBufferSize += sizeof(struct Geometry);
-					}
+	void setInstanceMask(uint32 instanceIndex, uint8 mask) {
+		tlasInstances[instanceIndex].mask = mask;
+		markInstanceDirty(instanceIndex);
+	}
 
-					VkAccelerationStructureBuildGeometryInfoKHR blasInfo = {
-						.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
-						.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
-						.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
-						.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
-						.geometryCount = (uint32)mesh.primitives_count,
-						.pGeometries = geometries.data()
-					};
-					std::vector<uint32> maxPrimitiveCounts(mesh.primitives_count);
-					for (size_t i = 0; i < maxPrimitiveCounts.size(); i++) {
-						maxPrimitiveCounts[i] = ranges[i].primitiveCount;
-					}
-					VkAccelerationStructureBuildSizesInfoKHR size = {
-						.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR
-					};
-					vkGetAccelerationStructureBuildSizes(vk->device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &blasInfo, maxPrimitiveCounts.data(), &size);
+	void markInstanceDirty(uint32 instanceIndex) {
+		if (!instanceDirtyFlags[instanceIndex]) {
+			instanceDirtyFlags[instanceIndex] = 1;
+			dirtyInstances.push_back(instanceIndex);
+		}
+	}
 
-					blasBufferSize += size.accelerationStructureSize;
+	// Uploads the dirty instance records through a per-frame host visible buffer and refits the TLAS.
+	// The TLAS is rebuilt instead when the instance count changed, after too many refits,
+	// or when too many instances moved since the last build for a refit to keep its quality.
+	void updateInstances(Vulkan* vk, VkCommandBuffer cmdBuf) {
+		for (VkBuffer buffer : retiredBuffers[vk->frameIndex]) {
+			vk->destroyBuffer(buffer);
+		}
+		retiredBuffers[vk->frameIndex].clear();
+		for (VkAccelerationStructureKHR as : retiredAccelerationStructures[vk->frameIndex]) {
+			vkDestroyAccelerationStructure(vk->device, as, nullptr);
+		}
+		retiredAccelerationStructures[vk->frameIndex].clear();
+		if (dirtyInstances.empty()) {
+			return;
+		}
 
-					blasInfos.push_back(blasInfo);
-					blasSizes.push_back(size);
-					blasGeometries.push_back(std::move(geometries));
-					blasRanges.push_back(std::move(ranges));
-					primitiveVerticesData.push_back(std::move(verticesData));
-				}
+		bool rebuild = tlasInstances.size() != tlasBuiltInstanceCount || tlasRefitCount >= tlasMaxRefitCount || movedInstanceCount > tlasInstances.size() * tlasRebuildMovedInstanceRatio;
+		if (tlasInstances.size() > instanceCapacity) {
+			retiredBuffers[vk->frameIndex].insert(retiredBuffers[vk->frameIndex].end(), { instancesBuffer, tlasBuildInstancesBuffer, tlasBuffer, tlasScratchBuffer });
+			retiredAccelerationStructures[vk->frameIndex].push_back(tlas);
+			createInstanceBuffers(vk, std::max((uint32)tlasInstances.size(), instanceCapacity * 2));
+			for (uint32 instanceIndex = 0; instanceIndex < tlasInstances.size(); instanceIndex++) {
+				markInstanceDirty(instanceIndex);
 			}
+			rebuild = true;
+		}
 
-			VkBufferUsageFlags bufferUsageFlags =
-				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-				VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
-			verticesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, verticesBufferSize, bufferUsageFlags).first;
-			indicesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, indicesBufferSize, bufferUsageFlags).first;
-			geometriesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, geometriesBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).first;
-			blasBuffer = vk->createBuffer(&vk->gpuBuffersMemory, blasBufferSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR).first;
-
-			uint64 blasBufferOffset = 0;
-			for (size_t i = 0; i < blasInfos.size(); i++) {
-				auto& info = blasInfos[i];
-				auto& size = blasSizes[i];
-				VkAccelerationStructureCreateInfoKHR blasCreateInfo = {
-					.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
-					.buffer = blasBuffer,
-					.offset = blasBufferOffset,
-					.size = size.accelerationStructureSize,
-					.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
-				};
-				vkCreateAccelerationStructure(vk->device, &blasCreateInfo, nullptr, &info.dstAccelerationStructure);
-				blas.push_back(info.dstAccelerationStructure);
-				blasBufferOffset += size.accelerationStructureSize;
+		auto& uploadBuffer = instanceUploadBuffers[vk->frameIndex];
+		uint64 uploadSize = dirtyInstances.size() * (sizeof(PackedInstance) + sizeof(VkAccelerationStructureInstanceKHR));
+		if (uploadBuffer.capacity < uploadSize) {
+			if (uploadBuffer.buffer) {
+				vk->destroyBuffer(uploadBuffer.buffer);
 			}
+			uploadBuffer.capacity = std::max(uploadSize, uploadBuffer.capacity * 2);
+			std::tie(uploadBuffer.buffer, uploadBuffer.mappedPtr) = vk->createBuffer(&vk->uniformBuffersMemory, uploadBuffer.capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
 		}
-
-		std::vector<Material> materialsBufferData;
-		uint64 materialsBufferSize = 0;
-		std::vector<std::vector<uint32>> geometryMaterialIndices;
-		{
-			for (auto& model : models) {
-				for (size_t meshIndex = 0; meshIndex < model.gltfData->meshes_count; meshIndex++) {
-					auto& gltfMesh = model.gltfData->meshes[meshIndex];
-					std::vector<uint32> materialIndices(gltfMesh.primitives_count);
-					for (size_t indexIndex = 0; indexIndex < materialIndices.size(); indexIndex++) {
-						auto& index = materialIndices[indexIndex];
-						index = (uint32)(materialsBufferData.size() + std::distance(model.gltfData->materials, gltfMesh.primitives[indexIndex].material));
-					}
-					geometryMaterialIndices.push_back(std::move(materialIndices));
-				}
-				for (size_t materialIndex = 0; materialIndex < model.gltfData->materials_count; materialIndex++) {
-					auto& gltfMaterial = model.gltfData->materials[materialIndex];
-					Material material = {};
-					memcpy(material.emissiveFactor, gltfMaterial.emissive_factor, 12);
-					if (gltfMaterial.has_pbr_metallic_roughness) {
-						memcpy(material.baseColorFactor, gltfMaterial.pbr_metallic_roughness.base_color_factor, 12);
-						if (gltfMaterial.pbr_metallic_roughness.base_color_texture.texture) {
-							uint64 textureIndex = std::distance(model.gltfData->images, gltfMaterial.pbr_metallic_roughness.base_color_texture.texture->image);
-							material.baseColorTextureIndex = (uint32)(textures.size() + textureIndex);
-						}
-						else {
-							material.baseColorTextureIndex = UINT32_MAX;
-						}
-					}
-					materialsBufferData.push_back(material);
-				}
-				for (auto& image : model.images) {
-					VkImageUsageFlags flags = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-					auto vkImageAndView = vk->createImage2DAndView(&vk->gpuTexturesMemory, image.width, image.height, image.format, VK_IMAGE_ASPECT_COLOR_BIT, flags);
-					textures.push_back(vkImageAndView);
-				}
+		std::sort(dirtyInstances.begin(), dirtyInstances.end());
+		std::vector<VkBufferCopy> instanceCopies;
+		std::vector<VkBufferCopy> tlasInstanceCopies;
+		uint64 tlasInstancesUploadOffset = dirtyInstances.size() * sizeof(PackedInstance);
+		for (size_t i = 0; i < dirtyInstances.size(); i++) {
+			uint32 instanceIndex = dirtyInstances[i];
+			instanceDirtyFlags[instanceIndex] = 0;
+			PackedInstance packedInstance = packInstance(instances[instanceIndex]);
+			memcpy(uploadBuffer.mappedPtr + i * sizeof(PackedInstance), &packedInstance, sizeof(PackedInstance));
+			memcpy(uploadBuffer.mappedPtr + tlasInstancesUploadOffset + i * sizeof(VkAccelerationStructureInstanceKHR), &tlasInstances[instanceIndex], sizeof(VkAccelerationStructureInstanceKHR));
+			if (i > 0 && dirtyInstances[i - 1] + 1 == instanceIndex) {
+				instanceCopies.back().size += sizeof(PackedInstance);
+				tlasInstanceCopies.back().size += sizeof(VkAccelerationStructureInstanceKHR);
+			}
+			else {
+				instanceCopies.push_back({ i * sizeof(PackedInstance), instanceIndex * sizeof(PackedInstance), sizeof(PackedInstance) });
+				tlasInstanceCopies.push_back({ tlasInstancesUploadOffset + i * sizeof(VkAccelerationStructureInstanceKHR), instanceIndex * sizeof(VkAccelerationStructureInstanceKHR), sizeof(VkAccelerationStructureInstanceKHR) });
 			}
-			materialsBufferSize = materialsBufferData.size() * sizeof(materialsBufferData[0]);
-			materialsBuffer = vk->createBuffer(&vk->gpuBuffersMemory, materialsBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).first;
 		}
+		dirtyInstances.clear();
 
-		VkAccelerationStructureBuildGeometryInfoKHR tlasInfo;
-		VkAccelerationStructureBuildSizesInfoKHR tlasSize;
-		VkAccelerationStructureGeometryKHR tlasGeometry;
-		VkAccelerationStructureBuildRangeInfoKHR tlasRange;
-		std::vector<VkAccelerationStructureInstanceKHR> tlasBuildInstances;
-		std::vector<Instance> instancesBufferData;
-		uint64 instancesBufferSize = 0;
-		{
-			for (uint64 blasOffset = 0; auto & model : models) {
-				std::stack<cgltf_node*> nodes;
-				std::stack<XMMATRIX> transforms;
-				for (size_t nodeIndex = 0; nodeIndex < model.gltfData->scene->nodes_count; nodeIndex++) {
-					cgltf_node* node = model.gltfData->scene->nodes[nodeIndex];
-					nodes.push(node);
-					transforms.push(getNodeTransformMat(node));
-				}
-				while (!nodes.empty()) {
-					cgltf_node* node = nodes.top();
-					XMMATRIX transform = transforms.top();
-					nodes.pop();
-					transforms.pop();
-					if (node->mesh) {
-						uint64 blasIndex = blasOffset + std::distance(model.gltfData->meshes, node->mesh);
-						VkAccelerationStructureDeviceAddressInfoKHR asDeviceAddressInfo = {
-							.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
-							.accelerationStructure = blas[blasIndex]
-						};
-						VkAccelerationStructureInstanceKHR tlasInstance = {
-							.mask = 0xff,
-							.accelerationStructureReference = vkGetAccelerationStructureDeviceAddress(vk->device, &asDeviceAddressInfo)
-						};
-						XMMATRIX transformT = XMMatrixTranspose(transform);
-						memcpy(tlasInstance.transform.matrix, transformT.r, 12 * sizeof(float));
-						tlasBuildInstances.push_back(tlasInstance);
+		VkMemoryBarrier memoryBarrier = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+			.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR
+		};
+		vkCmdPipelineBarrier(cmdBuf,
+			VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+			VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+			0, 1, &memoryBarrier, 0, nullptr, 0, nullptr
+		);
+		vkCmdCopyBuffer(cmdBuf, uploadBuffer.buffer, instancesBuffer, (uint32)instanceCopies.size(), instanceCopies.data());
+		vkCmdCopyBuffer(cmdBuf, uploadBuffer.buffer, tlasBuildInstancesBuffer, (uint32)tlasInstanceCopies.size(), tlasInstanceCopies.data());
+		memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(cmdBuf,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+			0, 1, &memoryBarrier, 0, nullptr, 0, nullptr
+		);
+		recordTlasBuild(vk, cmdBuf, !rebuild);
+		memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+		memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+		vkCmdPipelineBarrier(cmdBuf,
+			VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+			0, 1, &memoryBarrier, 0, nullptr, 0, nullptr
+		);
+		vk->accumulatedFrameCount = 0;
+	}
 
-						Instance instance;
-						memcpy(instance.transform, transform.r, sizeof(transform));
-						XMMATRIX transformIT = XMMatrixTranspose(XMMatrixInverse(nullptr, transform));
-						memcpy(instance.transformIT, transformIT.r, sizeof(transformIT));
-						instance.geometryOffset = 0;
-						for (uint64 i = 0; i < blasIndex; i++) {
-							instance.geometryOffset += blasInfos[i].geometryCount;
+	// Builds the given BLASes on the cpu as one deferred operation joined by the job system.
+	void buildHostBlas(Vulkan* vk, std::span<const uint32> meshIndices, std::span<VkAccelerationStructureBuildGeometryInfoKHR> blasInfos,
+		std::span<const VkAccelerationStructureBuildSizesInfoKHR> blasSizes, std::span<const std::vector<VkAccelerationStructureBuildRangeInfoKHR>> blasRanges) {
+		uint64 scratchAlignment = vk->accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment;
+		uint64 scratchSize = 0;
+		for (uint32 meshIndex : meshIndices) {
+			scratchSize += align(blasSizes[meshIndex].buildScratchSize, scratchAlignment);
+		}
+		std::vector<uint8> scratch(scratchSize + scratchAlignment);
+		uint8* scratchPtr = align(scratch.data(), scratchAlignment);
+		std::vector<VkAccelerationStructureBuildGeometryInfoKHR> infos;
+		std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> rangesPtr;
+		for (uint32 meshIndex : meshIndices) {
+			blasInfos[meshIndex].scratchData.hostAddress = scratchPtr;
+			scratchPtr += align(blasSizes[meshIndex].buildScratchSize, scratchAlignment);
+			infos.push_back(blasInfos[meshIndex]);
+			rangesPtr.push_back(blasRanges[meshIndex].data());
+		}
+
+		// The driver splits the deferred build into work that any number of threads can join,
+		// so every worker of the job system joins until the operation reports there is nothing left for it.
+		VkDeferredOperationKHR deferredOperation;
+		assert(vkCreateDeferredOperation(vk->device, nullptr, &deferredOperation) == VK_SUCCESS);
+		VkResult result = vkBuildAccelerationStructures(vk->device, deferredOperation, (uint32)infos.size(), infos.data(), rangesPtr.data());
+		if (result == VK_OPERATION_DEFERRED_KHR) {
+			uint32 concurrency = std::clamp(vkGetDeferredOperationMaxConcurrency(vk->device, deferredOperation), 1u, jobSystem->queueCount);
+			TaskGraph graph(jobSystem);
+			for (uint32 i = 0; i < concurrency; i++) {
+				graph.add([vk, deferredOperation] {
+					while (true) {
+						VkResult joinResult = vkDeferredOperationJoin(vk->device, deferredOperation);
+						if (joinResult == VK_SUCCESS || joinResult == VK_THREAD_DONE_KHR) {
+							break;
 						}
-						instancesBufferData.push_back(instance);
+						assert(joinResult == VK_THREAD_IDLE_KHR);
+						std::this_thread::yield();
 					}
-					for (size_t childIndex = 0; childIndex < node->children_count; childIndex++) {
-						cgltf_node* childNode = node->children[childIndex];
-						nodes.push(childNode);
-						transforms.push(getNodeTransformMat(childNode) * transform);
-					}
-				}
-				blasOffset += model.gltfData->meshes_count;
+				});
 			}
+			graph.wait();
+			result = vkGetDeferredOperationResult(vk->device, deferredOperation);
+		} else if (result == VK_OPERATION_NOT_DEFERRED_KHR) {
+			// The driver may finish a small build synchronously instead of deferring it.
+			result = vkGetDeferredOperationResult(vk->device, deferredOperation);
+		}
+		assert(result == VK_SUCCESS);
+		vkDestroyDeferredOperation(vk->device, deferredOperation, nullptr);
+	}
 
-			tlasGeometry = {
-				.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
-				.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
-				.geometry = {
-					.instances = {
-						.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
-						.arrayOfPointers = VK_FALSE,
-					}
-				}
-			};
-			tlasInfo = {
-				.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
-				.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
-				.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
-				.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
-				.dstAccelerationStructure = nullptr,
-				.geometryCount = 1,
-				.pGeometries = &tlasGeometry,
-			};
-			tlasRange = { .primitiveCount = (uint32)tlasBuildInstances.size() };
-
-			uint32 tlasBuildInstanceCount = (uint32)tlasBuildInstances.size();
-			tlasSize = {
-				.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR
-			};
-			vkGetAccelerationStructureBuildSizes(vk->device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &tlasInfo, &tlasBuildInstanceCount, &tlasSize);
-
-			instancesBufferSize = instancesBufferData.size() * sizeof(instancesBufferData[0]);
-			instancesBuffer = vk->createBuffer(&vk->gpuBuffersMemory, instancesBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).first;
-			tlasBuffer = vk->createBuffer(&vk->gpuBuffersMemory, tlasSize.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR).first;
-			VkAccelerationStructureCreateInfoKHR tlasCreateInfo = {
+	// Copies every BLAS into a tightly packed buffer at its compacted size, then releases the originals.
+	void compactBlasBuffer(Vulkan* vk, std::span<const uint64> compactedSizes, std::span<const VkAccelerationStructureBuildSizesInfoKHR> blasSizes) {
+		uint64 compactedBufferSize = 0;
+		for (uint64 size : compactedSizes) {
+			compactedBufferSize += align(size, vkAccelerationStructureAlignment);
+		}
+		VkBuffer compactedBuffer = vk->createBuffer(&vk->gpuBuffersMemory, compactedBufferSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT).first;
+		std::vector<VkAccelerationStructureKHR> compactedBlas(blas.size());
+		VkCommandBuffer cmdBuf = vk->beginGraphicsCmdBuf();
+		uint64 compactedBufferOffset = 0;
+		for (size_t i = 0; i < blas.size(); i++) {
+			VkAccelerationStructureCreateInfoKHR blasCreateInfo = {
 				.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
-				.buffer = tlasBuffer,
-				.size = tlasSize.accelerationStructureSize,
-				.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR
+				.buffer = compactedBuffer,
+				.offset = compactedBufferOffset,
+				.size = compactedSizes[i],
+				.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
 			};
-			vkCreateAccelerationStructure(vk->device, &tlasCreateInfo, nullptr, &tlasInfo.dstAccelerationStructure);
-			tlas = tlasInfo.dstAccelerationStructure;
-		}
-
-		VkBuffer tlasBuildInstancesBuffer;
-		uint64 tlasBuildInstancesBufferSize = tlasBuildInstances.size() * sizeof(tlasBuildInstances[0]);
-		{
-			tlasBuildInstancesBuffer = vk->createBuffer(
-				&vk->gpuBuffersMemory, tlasBuildInstancesBufferSize,
-				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR
-			).first;
-
-			VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
-				.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-				.buffer = tlasBuildInstancesBuffer
+			vkCreateAccelerationStructure(vk->device, &blasCreateInfo, nullptr, &compactedBlas[i]);
+			VkCopyAccelerationStructureInfoKHR copyInfo = {
+				.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+				.src = blas[i],
+				.dst = compactedBlas[i],
+				.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR
 			};
-			tlasGeometry.geometry.instances.data.deviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
+			vkCmdCopyAccelerationStructure(cmdBuf, &copyInfo);
+			compactedBufferOffset += align(compactedSizes[i], vkAccelerationStructureAlignment);
 		}
-
-		VkBuffer scratchBuffer;
-		{
-			uint64 scratchBufferAlignment = vk->accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment;
-			uint64 scratchBufferSize = 0;
-			for (auto& size : blasSizes) {
-				scratchBufferSize += align(size.buildScratchSize, scratchBufferAlignment);
-			}
-			scratchBufferSize += align(tlasSize.buildScratchSize, scratchBufferAlignment);
-			scratchBuffer = vk->createBuffer(&vk->gpuBuffersMemory, scratchBufferSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT).first;
-
-			VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
-				.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-				.buffer = scratchBuffer
-			};
-			VkDeviceAddress	scratchBufferDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
-			scratchBufferDeviceAddress = align(scratchBufferDeviceAddress, scratchBufferAlignment);
-			for (size_t infoIndex = 0; infoIndex < blasInfos.size(); infoIndex++) {
-				auto& info = blasInfos[infoIndex];
-				info.scratchData.deviceAddress = scratchBufferDeviceAddress;
-				scratchBufferDeviceAddress = align(scratchBufferDeviceAddress + blasSizes[infoIndex].buildScratchSize, scratchBufferAlignment);
+		vk->waitSemaphore(vk->graphicsTimeline, vk->submitGraphicsCmdBuf(cmdBuf));
+		for (auto& as : blas) {
+			vkDestroyAccelerationStructure(vk->device, as, nullptr);
+		}
+		for (VkBuffer buffer : { blasBuffer, hostBlasBuffer }) {
+			if (buffer) {
+				vk->destroyBuffer(buffer);
 			}
-			tlasInfo.scratchData.deviceAddress = scratchBufferDeviceAddress;
 		}
-		{
-			uint64 stageBufferSize =
-				verticesBufferSize + indicesBufferSize + geometriesBufferSize +
-				materialsBufferSize + instancesBufferSize + tlasBuildInstancesBufferSize;
-			for (auto& model : models) {
-				for (auto& image : model.images) {
-					stageBufferSize = align(stageBufferSize, 16);
-					stageBufferSize += image.size;
-				}
-			}
-			assert(stageBufferSize < vk->stagingBuffersMemory.capacity);
-			uint8* stageBufferPtr = nullptr;
-			vkMapMemory(vk->device, vk->stagingBuffersMemory.memory, 0, stageBufferSize, 0, (void**)&stageBufferPtr);
-			uint8* verticesBufferPtr = stageBufferPtr;
-			uint8* indicesBufferPtr = verticesBufferPtr + verticesBufferSize;
-			uint8* geometriesBufferPtr = indicesBufferPtr + indicesBufferSize;
-			uint8* materialsBufferPtr = geometriesBufferPtr + geometriesBufferSize;
-			uint8* instancesBufferPtr = materialsBufferPtr + materialsBufferSize;
-			uint8* tlasBuildInstancesBufferPtr = instancesBufferPtr + instancesBufferSize;
-			uint8* texturesPtr = align(tlasBuildInstancesBufferPtr + tlasBuildInstancesBufferSize, 16);
-
-			VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {
-				.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-				.buffer = verticesBuffer
-			};
-			VkDeviceAddress vertexBufferDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
-			bufferDeviceAddressInfo.buffer = indicesBuffer;
-			VkDeviceAddress indexBufferDeviceAddress = vkGetBufferDeviceAddress(vk->device, &bufferDeviceAddressInfo);
+		blas = std::move(compactedBlas);
+		blasBuffer = compactedBuffer;
+		hostBlasBuffer = VK_NULL_HANDLE;
+
+		uint64 blasBufferSize = 0;
+		std::vector<uint32> meshIndices(blasSizes.size());
+		for (uint32 i = 0; i < blasSizes.size(); i++) {
+			blasBufferSize += align(blasSizes[i].accelerationStructureSize, vkAccelerationStructureAlignment);
+			meshIndices[i] = i;
+		}
+		printf("blas compaction: %.2f MB -> %.2f MB, %.1f%% saved\n", blasBufferSize / (double)1_mb, compactedBufferSize / (double)1_mb, 100.0 * (1.0 - (double)compactedBufferSize / blasBufferSize));
+		auto savedSize = [&](uint32 i) { return blasSizes[i].accelerationStructureSize - compactedSizes[i]; };
+		std::sort(meshIndices.begin(), meshIndices.end(), [&](uint32 a, uint32 b) { return savedSize(a) > savedSize(b); });
+		const uint32 reportedMeshCount = 10;
+		for (uint32 i = 0; i < std::min((uint32)meshIndices.size(), reportedMeshCount); i++) {
+			uint32 meshIndex = meshIndices[i];
+			printf("    mesh %u: %.1f KB -> %.1f KB\n", meshIndex, blasSizes[meshIndex].accelerationStructureSize / (double)1_kb, compactedSizes[meshIndex] / (double)1_kb);
+		}
+		if (meshIndices.size() > reportedMeshCount) {
+			printf("    (%u more meshes)\n", (uint32)meshIndices.size() - reportedMeshCount);
+		}
+	}
 
-			Geometry geometryData = { .vertexOffset = 0, .indexOffset = 0 };
-			for (size_t blasIndex = 0; blasIndex < blasGeometries.size(); blasIndex++) {
-				auto& geometries = blasGeometries[blasIndex];
-				for (size_t geometryIndex = 0; geometryIndex < geometries.size(); geometryIndex++) {
-					auto& geometry = geometries[geometryIndex];
-					auto& verticesData = primitiveVerticesData[blasIndex][geometryIndex];
-					uint64 verticesSize = verticesData.positions->count * sizeof(struct Vertex);
-					uint64 indicesSize = verticesData.indices->count * sizeof(uint16);
-					uint8* positions = (uint8*)(verticesData.positions->buffer_view->buffer->data) + verticesData.positions->offset + verticesData.positions->buffer_view->offset;
-					uint8* normals = (uint8*)(verticesData.normals->buffer_view->buffer->data) + verticesData.normals->offset + verticesData.normals->buffer_view->offset;
-					uint8* uvs = nullptr;
-					if (verticesData.uvs) {
-						uvs = (uint8*)(verticesData.uvs->buffer_view->buffer->data) + verticesData.uvs->offset + verticesData.uvs->buffer_view->offset;
-					}
-					for (uint64 i = 0; i < verticesData.positions->count; i++) {
-						memcpy(verticesBufferPtr + i * sizeof(struct Vertex), positions + i * verticesData.positions->stride, 12);
-						memcpy(verticesBufferPtr + i * sizeof(struct Vertex) + 16, normals + i * verticesData.normals->stride, 12);
-						if (uvs) {
-							memcpy(verticesBufferPtr + i * sizeof(struct Vertex) + 32, uvs + i * verticesData.uvs->stride, 8);
-						}
-					}
-					uint8* indices = (uint8*)(verticesData.indices->buffer_view->buffer->data) + verticesData.indices->offset + verticesData.indices->buffer_view->offset;
-					memcpy(indicesBufferPtr, indices, indicesSize);
-					verticesBufferPtr += verticesSize;
-					indicesBufferPtr += indicesSize;
+	// Runs once per frame after the frame's fence wait, so this frame's feedback buffer holds what the hit shaders
+	// requested vkMaxFrameInFlight frames ago. Loads submitted last frame were acquired by this frame's command buffer
+	// and get swapped into the bindless texture array, then the next batch is staged on the job system.
+	void updateTextureStreaming(Vulkan* vk) {
+		for (auto& [image, view] : retiredTextures[vk->frameIndex]) {
+			vkDestroyImageView(vk->device, view, nullptr);
+			vk->destroyImage(image);
+		}
+		retiredTextures[vk->frameIndex].clear();
+		if (streamedTextures.empty()) {
+			return;
+		}
 
-					geometry.geometry.triangles.vertexData.deviceAddress = vertexBufferDeviceAddress;
-					geometry.geometry.triangles.vertexStride = sizeof(struct Vertex);
-					geometry.geometry.triangles.indexData.deviceAddress = indexBufferDeviceAddress;
-					vertexBufferDeviceAddress += verticesSize;
-					indexBufferDeviceAddress += indicesSize;
+		uint32* feedback = (uint32*)textureFeedbackBuffers[vk->frameIndex].mappedPtr;
+		for (uint32 imageIndex = 0; imageIndex < streamedTextures.size(); imageIndex++) {
+			if (feedback[imageIndex] > 0) {
+				const Image& image = images[imageIndex];
+				StreamedTexture& texture = streamedTextures[imageIndex];
+				float level = 64.0f - feedback[imageIndex] / 16.0f + 0.5f * log2f((float)image.width * image.height);
+				texture.requestedLevel = (uint32)std::clamp(floorf(level), 0.0f, (float)(image.mipLevels - 1));
+				texture.requestFrame = vk->frameCount;
+			}
+		}
+		memset(feedback, 0, streamedTextures.size() * sizeof(uint32));
 
-					geometryData.materialIndex = geometryMaterialIndices[blasIndex][geometryIndex];
-					memcpy(geometriesBufferPtr, &geometryData, sizeof(geometryData));
-					geometriesBufferPtr += sizeof(geometryData);
-					geometryData.vertexOffset += (uint32)verticesData.positions->count;
-					geometryData.indexOffset += (uint32)verticesData.indices->count;
-				}
+		for (auto& load : uploadedTextureLoads) {
+			StreamedTexture& texture = streamedTextures[load.imageIndex];
+			if (load.tail) {
+				texture.tail = load.image;
 			}
-			memcpy(materialsBufferPtr, materialsBufferData.data(), materialsBufferSize);
-			memcpy(instancesBufferPtr, instancesBufferData.data(), instancesBufferData.size() * sizeof(instancesBufferData[0]));
-			memcpy(tlasBuildInstancesBufferPtr, tlasBuildInstances.data(), tlasBuildInstancesBufferSize);
-			for (auto& model : models) {
-				for (auto& image : model.images) {
-					memcpy(texturesPtr, image.data, image.size);
-					texturesPtr = align(texturesPtr + image.size, 16);
+			else {
+				if (texture.detail.first) {
+					retiredTextures[vk->frameIndex].push_back(texture.detail);
 				}
+				texture.detail = load.image;
 			}
-			vkUnmapMemory(vk->device, vk->stagingBuffersMemory.memory);
+			texture.residentLevel = load.level;
+			texture.loading = false;
+			textures[load.imageIndex] = load.image;
 		}
-		{
-			auto& cmdBuf = vk->frames[vk->frameIndex].graphicsCmdBuf;
-			VkCommandBufferBeginInfo cmdBufferBeginInfo = {
-				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-				.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
-			};
-			vkResetCommandBuffer(cmdBuf, 0);
-			vkBeginCommandBuffer(cmdBuf, &cmdBufferBeginInfo);
-
-			std::pair<VkBuffer, uint64> bufferInfos[] = {
-				{ verticesBuffer, verticesBufferSize },
-				{ indicesBuffer, indicesBufferSize },
-				{ geometriesBuffer, geometriesBufferSize },
-				{ materialsBuffer, materialsBufferSize },
-				{ instancesBuffer, instancesBufferSize },
-				{ tlasBuildInstancesBuffer, tlasBuildInstancesBufferSize }
-			};
-			uint64 stagingBufferOffset = 0;
-			for (auto& bufferInfo : bufferInfos) {
-				VkBufferCopy bufferCopy = {
-					.srcOffset = stagingBufferOffset,
-					.size = bufferInfo.second
-				};
-				vkCmdCopyBuffer(cmdBuf, vk->stagingBuffer, bufferInfo.first, 1, &bufferCopy);
-				stagingBufferOffset += bufferInfo.second;
-			}
-
-			std::vector<VkImageMemoryBarrier> imageBarriers(textures.size());
-			for (size_t barrierIndex = 0; barrierIndex < imageBarriers.size(); barrierIndex++) {
-				imageBarriers[barrierIndex] = {
+		uploadedTextureLoads.clear();
+
+		if (textureLoadGraph && textureLoadGraph->unfinishedTaskCount == 0) {
+			VkCommandBuffer cmdBuf = vk->beginUploadCmdBuf();
+			std::vector<VkImage> loadImages;
+			std::vector<VkImageMemoryBarrier> barriers;
+			for (auto& load : textureLoads) {
+				loadImages.push_back(load.image.first);
+				barriers.push_back(VkImageMemoryBarrier{
 					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
 					.srcAccessMask = 0,
 					.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
 					.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 					.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-					.srcQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.dstQueueFamilyIndex = vk->graphicsComputeQueueFamilyIndex,
-					.image = textures[barrierIndex].first,
-					.subresourceRange = {
-						.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-						.baseMipLevel = 0,
-						.levelCount = 1,
-						.baseArrayLayer = 0,
-						.layerCount = 1
-					}
-				};
+					.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.image = load.image.first,
+					.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, 1 }
+				});
 			}
-			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, (uint32)imageBarriers.size(), imageBarriers.data());
-
-			stagingBufferOffset = align(stagingBufferOffset, 16);
-			uint64 textureIndex = 0;
-			for (auto& model : models) {
-				for (auto& image : model.images) {
+			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, (uint32)barriers.size(), barriers.data());
+			for (auto& load : textureLoads) {
+				const Image& image = images[load.imageIndex];
+				uint64 offset = 0;
+				for (uint32 level = load.level; level < image.mipLevels; level++) {
+					uint32 width = std::max(image.width >> level, 1u);
+					uint32 height = std::max(image.height >> level, 1u);
 					VkBufferImageCopy imageCopy = {
-						.bufferOffset = stagingBufferOffset,
-						.imageSubresource = {
-							.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-							.mipLevel = 0,
-							.baseArrayLayer = 0,
-							.layerCount = 1
-						},
-						.imageOffset = { 0, 0, 0 },
-						.imageExtent = { image.width, image.height, 1 }
+						.bufferOffset = load.stagingOffset + offset,
+						.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - load.level, 0, 1 },
+						.imageExtent = { width, height, 1 }
 					};
-					vkCmdCopyBufferToImage(cmdBuf, vk->stagingBuffer, textures[textureIndex].first, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &imageCopy);
-					stagingBufferOffset = align(stagingBufferOffset + image.size, 16);
-					textureIndex++;
+					vkCmdCopyBufferToImage(cmdBuf, vk->stagingBuffer, load.image.first, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &imageCopy);
+					offset += imageMipSize(image.format, width, height);
 				}
 			}
+			vk->releaseUploads(cmdBuf, loadImages, {});
+			vk->submitUploadCmdBuf(cmdBuf);
+			uploadedTextureLoads = std::move(textureLoads);
+			textureLoads.clear();
+			textureLoadGraph.reset();
+		}
+		if (!textureLoadGraph) {
+			scheduleTextureLoads(vk);
+		}
+	}
 
-			VkMemoryBarrier memoryBarrier = {
-				.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-				.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-				.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
-			};
-			for (auto& barrier : imageBarriers) {
-				barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-				barrier.dstAccessMask = 0;
-				barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-				barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	// Missing tails load first, then the textures furthest from their requested mip. Each load is the whole chain from
+	// its first mip down, which the staging ring receives from the cache mapping on the job system.
+	void scheduleTextureLoads(Vulkan* vk) {
+		std::vector<std::pair<uint32, uint32>> candidates; // image index, level
+		for (uint32 imageIndex = 0; imageIndex < streamedTextures.size(); imageIndex++) {
+			const Image& image = images[imageIndex];
+			StreamedTexture& texture = streamedTextures[imageIndex];
+			if (texture.loading) {
+				continue;
 			}
-			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, (uint32)imageBarriers.size(), imageBarriers.data());
-
-			std::vector<VkAccelerationStructureBuildRangeInfoKHR*> blasRangesPtr(blasRanges.size());
-			for (size_t i = 0; i < blasRangesPtr.size(); i++) {
-				blasRangesPtr[i] = blasRanges[i].data();
+			if (!texture.tail.first) {
+				candidates.push_back({ imageIndex, texture.tailLevel });
 			}
-			vkCmdBuildAccelerationStructures(cmdBuf, (uint32)blasInfos.size(), blasInfos.data(), blasRangesPtr.data());
-
-			memoryBarrier = {
-				.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-				.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
-				.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
-			};
-			vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr
-			);
-			VkAccelerationStructureBuildRangeInfoKHR* tlasRangePtr = &tlasRange;
-			vkCmdBuildAccelerationStructures(cmdBuf, 1, &tlasInfo, &tlasRangePtr);
-
-			vkEndCommandBuffer(cmdBuf);
+			else if (texture.requestedLevel < texture.residentLevel && texture.requestFrame + textureStreamingEvictFrames > vk->frameCount) {
+				uint32 level = texture.requestedLevel;
+				while (image.size - imageMipChainSize(image.format, image.width, image.height, level) > textureStreamingMaxLoadSize) level++;
+				if (level < texture.residentLevel) {
+					candidates.push_back({ imageIndex, level });
+				}
+			}
+		}
+		auto priority = [this](std::pair<uint32, uint32> candidate) {
+			const StreamedTexture& texture = streamedTextures[candidate.first];
+			return texture.tail.first ? texture.residentLevel - candidate.second : UINT32_MAX;
+		};
+		std::sort(candidates.begin(), candidates.end(), [&](auto a, auto b) { return priority(a) > priority(b); });
+
+		uint64 batchSize = 0;
+		for (auto [imageIndex, level] : candidates) {
+			const Image& image = images[imageIndex];
+			StreamedTexture& texture = streamedTextures[imageIndex];
+			uint64 offset = imageMipChainSize(image.format, image.width, image.height, level);
+			uint64 size = image.size - offset;
+			if (batchSize + size > textureStreamingBatchSize) {
+				continue;
+			}
+			bool tail = !texture.tail.first;
+			uint64 replacedSize = texture.detail.first ? image.size - imageMipChainSize(image.format, image.width, image.height, texture.residentLevel) : 0;
+			if (!tail && !evictTextures(vk, textureStreamingResidentSize + size - replacedSize, imageIndex)) {
+				continue;
+			}
+			Vulkan::StagingAllocation staging = vk->stagingAlloc(size);
+			if (!staging.ptr) {
+				break;
+			}
+			auto imageAndView = vk->createImage2DAndView(&vk->gpuTexturesMemory, std::max(image.width >> level, 1u), std::max(image.height >> level, 1u), image.format,
+				VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, image.mipLevels - level);
+			textureStreamingResidentSize += size - replacedSize;
+			texture.loading = true;
+			textureLoads.push_back(TextureLoad{ .imageIndex = imageIndex, .level = level, .tail = tail, .image = imageAndView, .stagingOffset = staging.offset });
+			if (!textureLoadGraph) {
+				textureLoadGraph = std::make_unique<TaskGraph>(jobSystem);
+			}
+			for (uint64 chunk = 0; chunk < size; chunk += streamingLoaderChunkSize) {
+				textureLoadGraph->add([dst = staging.ptr + chunk, src = image.data + offset + chunk, chunkSize = std::min(streamingLoaderChunkSize, size - chunk)] {
+					memcpy(dst, src, chunkSize);
+				});
+			}
+			batchSize += size;
+		}
+	}
 
-			VkSubmitInfo queueSubmitInfo = {
-				.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-				.commandBufferCount = 1,
-				.pCommandBuffers = &cmdBuf
-			};
-			vkQueueSubmit(vk->graphicsQueue, 1, &queueSubmitInfo, nullptr);
-			vkQueueWaitIdle(vk->graphicsQueue);
+	// Drops textures that were not requested lately back to their tails, largest first, until residentSize fits the budget.
+	bool evictTextures(Vulkan* vk, uint64 residentSize, uint32 keepImageIndex) {
+		if (residentSize <= textureStreamingBudget) {
+			return true;
+		}
+		std::vector<std::pair<uint64, uint32>> evictable; // detail size, image index
+		for (uint32 imageIndex = 0; imageIndex < streamedTextures.size(); imageIndex++) {
+			const StreamedTexture& texture = streamedTextures[imageIndex];
+			if (texture.detail.first && !texture.loading && imageIndex != keepImageIndex && texture.requestFrame + textureStreamingEvictFrames <= vk->frameCount) {
+				const Image& image = images[imageIndex];
+				evictable.push_back({ image.size - imageMipChainSize(image.format, image.width, image.height, texture.residentLevel), imageIndex });
+			}
 		}
+		std::sort(evictable.begin(), evictable.end(), std::greater<>());
+		for (auto [size, imageIndex] : evictable) {
+			if (residentSize <= textureStreamingBudget) {
+				break;
+			}
+			StreamedTexture& texture = streamedTextures[imageIndex];
+			retiredTextures[vk->frameIndex].push_back(texture.detail);
+			texture.detail = {};
+			texture.residentLevel = texture.tailLevel;
+			textures[imageIndex] = texture.tail;
+			residentSize -= size;
+			textureStreamingResidentSize -= size;
+		}
+		return residentSize <= textureStreamingBudget;
 	}
 
 	void drawCommands(Vulkan* vk, uint windowWidth, uint windowHeight) {
@@ -2057,12 +6665,18 @@ struct Scene {
 				XMMATRIX screenToWorldMat;
 				XMVECTOR eyePos;
 				uint32 accumulatedFrameCount;
+				uint32 rayFlags;
+				float pixelSpreadAngle;
+				uint32 frameCount;
 			} constantsBuffer = {
 				XMMatrixInverse(nullptr, camera.viewProjMat),
 				camera.position,
-				vk->accumulatedFrameCount
+				vk->accumulatedFrameCount,
+				alphaMaskEnabled ? 0u : 1u, // RAY_FLAG_FORCE_OPAQUE skips the any-hit shaders
+				atanf(2.0f / (XMVectorGetY(camera.projMat.r[1]) * windowHeight)), // projMat[1][1] is 1 / tan(fovY / 2)
+				(uint32)vk->frameCount
 			};
-			memcpy(vkFrame.uniformBuffersMappedPtr + vkFrame.rayTracingConstantBufferMemoryOffset, &constantsBuffer, sizeof(constantsBuffer));
+			memcpy(vkFrame.rayTracingConstantBufferMappedPtr, &constantsBuffer, sizeof(constantsBuffer));
 
 			VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
 				.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
@@ -2090,6 +6704,8 @@ struct Scene {
 			VkDescriptorBufferInfo geometriesBufferInfo = { .buffer = geometriesBuffer, .range = VK_WHOLE_SIZE };
 			VkDescriptorBufferInfo materialsBufferInfo = { .buffer = materialsBuffer, .range = VK_WHOLE_SIZE };
 			VkDescriptorBufferInfo instancesBufferInfo = { .buffer = instancesBuffer, .range = VK_WHOLE_SIZE };
+			VkDescriptorBufferInfo triangleLodsBufferInfo = { .buffer = triangleLodsBuffer, .range = VK_WHOLE_SIZE };
+			VkDescriptorBufferInfo textureFeedbackBufferInfo = { .buffer = textureFeedbackBuffers[vk->frameIndex].buffer, .range = VK_WHOLE_SIZE };
 			VkDescriptorBufferInfo constantsBufferInfo = { .buffer = vkFrame.rayTracingConstantBuffer, .range = VK_WHOLE_SIZE };
 			VkDescriptorImageInfo textureSamplerInfo = { .sampler = vk->trilinearSampler };
 			std::vector<VkDescriptorImageInfo> textureImageInfos(vk->pathTraceDescriptorSet0TextureCount);
@@ -2117,6 +6733,8 @@ struct Scene {
 				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &geometriesBufferInfo },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &materialsBufferInfo },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &instancesBufferInfo },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &triangleLodsBufferInfo },
+				{.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .pBufferInfo = &textureFeedbackBufferInfo },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .pBufferInfo = &constantsBufferInfo },
 				{.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER, .pImageInfo = &textureSamplerInfo },
 				{.descriptorCount = (uint32)textureImageInfos.size(), .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, .pImageInfo = textureImageInfos.data() }
@@ -2151,6 +6769,8 @@ struct Scene {
 				0, nullptr, 0, nullptr, countof(imageMemoryBarriers), imageMemoryBarriers
 			);
 
+			vkCmdResetQueryPool(vkFrame.graphicsCmdBuf, vkFrame.pathTraceQueryPool, 0, 2);
+			vkCmdWriteTimestamp(vkFrame.graphicsCmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, vkFrame.pathTraceQueryPool, 0);
 			vkCmdTraceRays(vkFrame.graphicsCmdBuf,
 				&vk->pathTraceSBTBufferRayGenDeviceAddress,
 				&vk->pathTraceSBTBufferMissDeviceAddress,
@@ -2158,6 +6778,16 @@ struct Scene {
 				&vk->pathTraceSBTBufferCallableDeviceAddress,
 				windowWidth, windowHeight, 1
 			);
+			vkCmdWriteTimestamp(vkFrame.graphicsCmdBuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, vkFrame.pathTraceQueryPool, 1);
+			vkFrame.pathTraceTimestampsWritten = true;
+			vkFrame.pathTraceAlphaMask = alphaMaskEnabled;
+
+			VkMemoryBarrier feedbackBarrier = {
+				.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+				.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+				.dstAccessMask = VK_ACCESS_HOST_READ_BIT
+			};
+			vkCmdPipelineBarrier(vkFrame.graphicsCmdBuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &feedbackBarrier, 0, nullptr, 0, nullptr);
 
 			imageMemoryBarriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
 			imageMemoryBarriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -2202,8 +6832,232 @@ void imguiInit() {
 	io.FontGlobalScale = 1.5f;
 }
 
+void memoryAllocatorStress() {
+	struct Allocation {
+		uint64 offset;
+		uint64 size;
+		bool linear;
+	};
+	const uint64 capacity = 1_gb;
+	const uint64 granularity = 1_kb;
+	const uint32 opCount = 4000000;
+	TLSFAllocator allocator;
+	allocator.init(capacity, granularity);
+	std::vector<Allocation> allocations;
+	std::mt19937_64 random(0);
+	std::uniform_real_distribution<double> sizeLog2Distribution(8.0, 24.0);
+	uint64 failureCount = 0;
+	double peakFragmentation = 0.0;
+	double fragmentationSum = 0.0;
+	uint32 fragmentationSampleCount = 0;
+	auto validate = [&] {
+		assert(allocator.validate());
+		std::sort(allocations.begin(), allocations.end(), [](auto& a, auto& b) { return a.offset < b.offset; });
+		for (size_t i = 1; i < allocations.size(); i++) {
+			assert(allocations[i - 1].offset + allocations[i - 1].size <= allocations[i].offset);
+			if (allocations[i - 1].linear != allocations[i].linear) {
+				assert(((allocations[i - 1].offset + allocations[i - 1].size - 1) & ~(granularity - 1)) < (allocations[i].offset & ~(granularity - 1)));
+			}
+		}
+	};
+	auto startTime = std::chrono::high_resolution_clock::now();
+	for (uint32 op = 0; op < opCount; op++) {
+		// Phases bias towards allocation then towards free, so occupancy sweeps between empty and full.
+		bool allocPhase = (op / 200000) % 2 == 0;
+		bool alloc = allocations.empty() || (random() % 100) < (allocPhase ? 60u : 40u);
+		if (alloc) {
+			uint64 size = (uint64)std::exp2(sizeLog2Distribution(random));
+			uint64 alignment = 1ull << (8 + random() % 9);
+			bool linear = random() % 2;
+			uint64 offset = allocator.allocate(size, alignment, linear);
+			if (offset == TLSFAllocator::invalidOffset) {
+				failureCount += 1;
+			}
+			else {
+				assert(offset % alignment == 0 && offset + size <= capacity);
+				allocations.push_back({ offset, size, linear });
+			}
+		}
+		else {
+			size_t index = random() % allocations.size();
+			allocator.free(allocations[index].offset);
+			allocations[index] = allocations.back();
+			allocations.pop_back();
+		}
+		if (op % 100000 == 0) {
+			validate();
+		}
+		if (op % 1000 == 0) {
+			double fragmentation = allocator.stats().fragmentation();
+			peakFragmentation = std::max(peakFragmentation, fragmentation);
+			fragmentationSum += fragmentation;
+			fragmentationSampleCount += 1;
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	validate();
+	TLSFAllocator::Stats stats = allocator.stats();
+	printf("memory allocator stress: %u ops in %.1f ms, %.1f ns/op, %llu failed allocations\n", opCount, seconds * 1000.0, seconds * 1e9 / opCount, failureCount);
+	printf("memory allocator stress: %u live allocations, %.1f MB used, %u free blocks, largest free block %.1f MB\n",
+		stats.allocationCount, stats.usedSize / (double)1_mb, stats.freeBlockCount, stats.largestFreeBlock / (double)1_mb);
+	printf("memory allocator stress: fragmentation final %.3f, average %.3f, peak %.3f\n",
+		stats.fragmentation(), fragmentationSum / fragmentationSampleCount, peakFragmentation);
+
+	for (uint32 i = 0; i < 200; i++) {
+		for (uint32 j = 0; j < 1000 && !allocations.empty(); j++) {
+			size_t index = random() % allocations.size();
+			allocator.free(allocations[index].offset);
+			allocations[index] = allocations.back();
+			allocations.pop_back();
+		}
+		validate();
+	}
+	stats = allocator.stats();
+	assert(stats.allocationCount == 0 && stats.usedSize == 0 && stats.freeBlockCount == 1 && stats.largestFreeBlock == capacity);
+	printf("memory allocator stress: passed\n");
+}
+
+// Measures the conversion kernels at every SIMD level the CPU supports on the vertex and RGB image data of a glTF file,
+// and the BC1/BC7 encoders on the first few images, checking each level against the scalar output.
+void conversionBenchmark(const std::filesystem::path& gltfPath) {
+	const uint32 repeatCount = 20;
+	std::string gltfPathStr = gltfPath.generic_string();
+	cgltf_options gltfOptions = gltfMappedFileOptions();
+	cgltf_data* gltfData = nullptr;
+	assert(cgltf_parse_file(&gltfOptions, gltfPathStr.c_str(), &gltfData) == cgltf_result_success);
+	assert(cgltf_load_buffers(&gltfOptions, gltfData, gltfPathStr.c_str()) == cgltf_result_success);
+	std::vector<std::pair<VertexStreams, uint64>> primitives;
+	uint64 vertexCount = 0;
+	for (size_t meshIndex = 0; meshIndex < gltfData->meshes_count; meshIndex++) {
+		for (size_t primitiveIndex = 0; primitiveIndex < gltfData->meshes[meshIndex].primitives_count; primitiveIndex++) {
+			PrimitiveVerticesData primitiveData = getPrimitiveVerticesData(gltfData->meshes[meshIndex].primitives[primitiveIndex]);
+			VertexStreams streams = {
+				.positions = accessorData(primitiveData.positions),
+				.positionStride = primitiveData.positions->stride,
+				.normals = accessorData(primitiveData.normals),
+				.normalStride = primitiveData.normals->stride,
+				.uvs = primitiveData.uvs ? accessorData(primitiveData.uvs) : nullptr,
+				.uvStride = primitiveData.uvs ? primitiveData.uvs->stride : 0
+			};
+			primitives.push_back({ streams, primitiveData.positions->count });
+			vertexCount += primitiveData.positions->count;
+		}
+	}
+	std::vector<std::vector<uint8>> rgbImages;
+	std::vector<std::pair<uint32, uint32>> rgbImageSizes;
+	uint64 pixelCount = 0;
+	for (size_t imageIndex = 0; imageIndex < gltfData->images_count; imageIndex++) {
+		std::filesystem::path imagePath = gltfPath.parent_path() / gltfData->images[imageIndex].uri;
+		int width, height, comp;
+		stbi_uc* data = stbi_load(imagePath.generic_string().c_str(), &width, &height, &comp, 0);
+		if (data && comp == 3) {
+			rgbImages.emplace_back(data, data + (uint64)width * height * 3);
+			rgbImageSizes.push_back({ (uint32)width, (uint32)height });
+			pixelCount += (uint64)width * height;
+		}
+		stbi_image_free(data);
+	}
+	printf("conversion benchmark: \"%s\", %u primitives, %llu vertices, %u rgb images, %.1f MPixels, cpu %s\n",
+		gltfPathStr.c_str(), (uint32)primitives.size(), vertexCount, (uint32)rgbImages.size(), pixelCount / 1e6, simdLevelNames[(int)cpuSimdLevel]);
+
+	std::vector<Vertex> referenceVertices(vertexCount);
+	std::vector<Vertex> vertices(vertexCount);
+	std::vector<PackedVertex> referencePackedVertices(vertexCount);
+	std::vector<PackedVertex> packedVertices(vertexCount);
+	std::vector<std::vector<uint8>> referenceRGBAImages;
+	std::vector<uint8> rgbaImage;
+	const uint32 compressImageCount = 4;
+	std::vector<std::vector<uint8>> referenceBlocks;
+	std::vector<uint8> blocks;
+	uint64 compressPixelCount = 0;
+	for (int level = 0; level <= (int)cpuSimdLevel; level++) {
+		auto interleaveStartTime = std::chrono::steady_clock::now();
+		for (uint32 repeat = 0; repeat < repeatCount; repeat++) {
+			Vertex* vertex = vertices.data();
+			for (auto& [streams, count] : primitives) {
+				interleaveVertices(vertex, streams, count, (SimdLevel)level);
+				vertex += count;
+			}
+		}
+		double interleaveTime = secondsSince(interleaveStartTime);
+
+		auto packStartTime = std::chrono::steady_clock::now();
+		for (uint32 repeat = 0; repeat < repeatCount; repeat++) {
+			packVertices(packedVertices.data(), vertices.data(), vertexCount, (SimdLevel)level);
+		}
+		double packTime = secondsSince(packStartTime);
+
+		double expandTime = 0;
+		for (size_t imageIndex = 0; imageIndex < rgbImages.size(); imageIndex++) {
+			auto& rgbImage = rgbImages[imageIndex];
+			rgbaImage.resize(rgbImage.size() / 3 * 4);
+			for (uint32 repeat = 0; repeat < repeatCount; repeat++) {
+				memcpy(rgbaImage.data(), rgbImage.data(), rgbImage.size());
+				auto expandStartTime = std::chrono::steady_clock::now();
+				expandRGBToRGBA(rgbaImage.data(), rgbImage.size() / 3, (SimdLevel)level);
+				expandTime += secondsSince(expandStartTime);
+			}
+			if (level == 0) {
+				referenceRGBAImages.push_back(rgbaImage);
+			}
+			else {
+				assert(rgbaImage == referenceRGBAImages[imageIndex]);
+			}
+		}
+
+		double compressTimes[2] = {};
+		const VkFormat compressFormats[2] = { VK_FORMAT_BC1_RGB_SRGB_BLOCK, VK_FORMAT_BC7_SRGB_BLOCK };
+		for (uint32 imageIndex = 0; imageIndex < std::min((uint32)rgbImages.size(), compressImageCount); imageIndex++) {
+			auto [width, height] = rgbImageSizes[imageIndex];
+			for (uint32 formatIndex = 0; formatIndex < 2; formatIndex++) {
+				blocks.resize((width + 3) / 4 * ((height + 3) / 4) * blockCompressedSize(compressFormats[formatIndex]));
+				auto compressStartTime = std::chrono::steady_clock::now();
+				compressImageBlocks(blocks.data(), referenceRGBAImages[imageIndex].data(), width, height, 4, compressFormats[formatIndex], 0, (height + 3) / 4, (SimdLevel)level);
+				compressTimes[formatIndex] += secondsSince(compressStartTime);
+				if (level == 0) {
+					referenceBlocks.push_back(blocks);
+				}
+				else {
+					assert(blocks == referenceBlocks[imageIndex * 2 + formatIndex]);
+				}
+			}
+			if (level == 0) {
+				compressPixelCount += (uint64)width * height;
+			}
+		}
+
+		if (level == 0) {
+			referenceVertices = vertices;
+			referencePackedVertices = packedVertices;
+		}
+		else {
+			assert(!memcmp(vertices.data(), referenceVertices.data(), vertexCount * sizeof(Vertex)));
+			assert(!memcmp(packedVertices.data(), referencePackedVertices.data(), vertexCount * sizeof(PackedVertex)));
+		}
+		auto gbPerSecond = [](uint64 size, double seconds) { return seconds > 0 ? size * repeatCount / seconds / 1e9 : 0.0; };
+		auto mPixelsPerSecond = [](uint64 count, double seconds) { return seconds > 0 ? count / seconds / 1e6 : 0.0; };
+		printf("    %-7s interleave %6.2f GB/s, pack %6.2f GB/s, rgb to rgba %6.2f GB/s, bc1 %6.2f MPixels/s, bc7 %6.2f MPixels/s (single thread)\n", simdLevelNames[level],
+			gbPerSecond(vertexCount * sizeof(Vertex), interleaveTime),
+			gbPerSecond(vertexCount * sizeof(Vertex), packTime),
+			gbPerSecond(pixelCount * 4, expandTime),
+			mPixelsPerSecond(compressPixelCount, compressTimes[0]),
+			mPixelsPerSecond(compressPixelCount, compressTimes[1]));
+	}
+	cgltf_free(gltfData);
+}
+
 int main(int argc, char** argv) {
 	setCurrentDirToExeDir();
+	if (std::any_of(argv, argv + argc, [](char* arg) { return !strcmp(arg, "-memoryAllocatorStress"); })) {
+		memoryAllocatorStress();
+		return 0;
+	}
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-conversionBenchmark")) {
+			conversionBenchmark(i + 1 < argc && argv[i + 1][0] != '-' ? argv[i + 1] : "../../assets/sponza/Sponza.gltf");
+			return 0;
+		}
+	}
 	assert(SetProcessDpiAwareness(PROCESS_PER_MONITOR_DPI_AWARE) == S_OK);
 	assert(SDL_Init(SDL_INIT_VIDEO) == 0);
 
@@ -2223,8 +7077,68 @@ int main(int argc, char** argv) {
 
 	imguiInit();
 	ImGuiIO& imguiIO = ImGui::GetIO();
-	Vulkan* vk = Vulkan::create(window, std::any_of(argv, argv + argc, [](char* arg) { return !strcmp(arg, "-vkValidation"); }));
-	Scene* scene = Scene::create("../../assets/cornell box.json", vk);
+	auto hasArg = [argc, argv](const char* name) { return std::any_of(argv, argv + argc, [name](char* arg) { return !strcmp(arg, name); }); };
+	auto argValue = [argc, argv](const char* name) -> const char* {
+		for (int i = 0; i + 1 < argc; i++) {
+			if (!strcmp(argv[i], name)) return argv[i + 1];
+		}
+		return nullptr;
+	};
+	Vulkan* vk = Vulkan::create(window, hasArg("-vkValidation"));
+	JobSystem* jobSystem = JobSystem::create();
+	const char* scenePath = "../../assets/cornell box.json";
+	SceneLoadOptions sceneLoadOptions = {
+		.compactBlas = !hasArg("-noBlasCompaction"),
+		.blasScratchBudget = argValue("-blasScratchBudgetMB") ? std::stoull(argValue("-blasScratchBudgetMB")) * 1_mb : 64_mb,
+		.blasCache = !hasArg("-noBlasCache"),
+		.partitionBlas = !hasArg("-noBlasPartition"),
+		.optimizeMeshes = !hasArg("-noMeshOptimization"),
+		.compressTextures = !hasArg("-noTextureCompression"),
+		.asyncReads = !hasArg("-noAsyncReads"),
+		.directStagingReads = !hasArg("-noDirectStagingReads"),
+		.textureStreamingBudget = argValue("-textureStreamingBudgetMB") ? std::stoull(argValue("-textureStreamingBudgetMB")) * 1_mb : 0
+	};
+	if (const char* mode = argValue("-blasBuildMode")) {
+		for (uint32 i = 0; i < countof(blasBuildModeNames); i++) {
+			if (!strcmp(mode, blasBuildModeNames[i])) sceneLoadOptions.blasBuildMode = (BlasBuildMode)i;
+		}
+	}
+	if (const char* mode = argValue("-mipGeneration")) {
+		for (uint32 i = 0; i < countof(mipGenerationNames); i++) {
+			if (!strcmp(mode, mipGenerationNames[i])) sceneLoadOptions.mipGeneration = (MipGeneration)i;
+		}
+	}
+	if (const char* share = argValue("-blasHostBuildShare")) {
+		sceneLoadOptions.blasHostBuildShare = std::stod(share);
+	}
+	if (hasArg("-blasBuildBenchmark")) {
+		for (BlasBuildMode mode : { BlasBuildMode::Device, BlasBuildMode::Host, BlasBuildMode::Mixed }) {
+			if (mode != BlasBuildMode::Device && !vk->accelerationStructureHostCommands) {
+				continue;
+			}
+			SceneLoadOptions benchmarkSceneLoadOptions = sceneLoadOptions;
+			benchmarkSceneLoadOptions.blasBuildMode = mode;
+			benchmarkSceneLoadOptions.blasCache = false;
+			Scene* benchmarkScene = Scene::create(scenePath, vk, jobSystem, benchmarkSceneLoadOptions);
+			benchmarkScene->destroy(vk);
+			delete benchmarkScene;
+		}
+	}
+	if (hasArg("-sceneLoadBenchmark")) {
+		SceneLoadOptions coldSceneLoadOptions = sceneLoadOptions;
+		coldSceneLoadOptions.rebuildCache = true;
+		Scene* coldScene = Scene::create(scenePath, vk, jobSystem, coldSceneLoadOptions);
+		coldScene->destroy(vk);
+		delete coldScene;
+		vk->printMemoryReport();
+	}
+	Scene* scene = Scene::create(scenePath, vk, jobSystem, sceneLoadOptions);
+	vk->printMemoryReport();
+
+	bool spinInstance = false;
+	float spinAngle = 0;
+	XMMATRIX spinInstanceTransform = scene->instances.empty() ? XMMatrixIdentity() : XMMATRIX(&scene->instances[0].transform[0][0]);
+	double pathTraceTimes[2] = {}; // [0]: forced opaque, [1]: alpha mask any-hit
 
 	SDL_Event event;
 	bool running = true;
@@ -2278,9 +7192,31 @@ int main(int argc, char** argv) {
 		}
 
 		ImGui::Begin("test");
+		ImGui::Text("instances: %u, tlas updates: %llu, tlas rebuilds: %llu", (uint32)scene->instances.size(), scene->tlasUpdateCount, scene->tlasRebuildCount);
+		if (!scene->instances.empty()) {
+			ImGui::Checkbox("spin instance 0", &spinInstance);
+		}
+		if (scene->alphaMaskGeometryCount > 0) {
+			if (ImGui::Checkbox("alpha mask (any-hit)", &scene->alphaMaskEnabled)) {
+				vk->accumulatedFrameCount = 0;
+			}
+			ImGui::Text("alpha masked geometries: %u", scene->alphaMaskGeometryCount);
+			ImGui::Text("trace rays: %.3f ms alpha masked, %.3f ms forced opaque", pathTraceTimes[1], pathTraceTimes[0]);
+		}
+		else {
+			ImGui::Text("trace rays: %.3f ms", pathTraceTimes[1]);
+		}
+		if (!scene->streamedTextures.empty()) {
+			ImGui::Text("streamed textures: %.1f of %.1f MB resident", scene->textureStreamingResidentSize / (double)1_mb, scene->textureStreamingBudget / (double)1_mb);
+		}
 		ImGui::End();
 		ImGui::Render();
 
+		if (spinInstance) {
+			spinAngle += imguiIO.DeltaTime;
+			scene->setInstanceTransform(0, XMMatrixRotationY(spinAngle) * spinInstanceTransform);
+		}
+
 		auto& vkFrame = vk->frames[vk->frameIndex];
 
 		unsigned swapChainImageIndex;
@@ -2289,6 +7225,15 @@ int main(int argc, char** argv) {
 		vkWaitForFences(vk->device, 1, &vkFrame.queueFence, true, UINT64_MAX);
 		vkResetFences(vk->device, 1, &vkFrame.queueFence);
 		vkResetDescriptorPool(vk->device, vkFrame.descriptorPool, 0);
+		if (vkFrame.pathTraceTimestampsWritten) {
+			uint64 timestamps[2];
+			if (vkGetQueryPoolResults(vk->device, vkFrame.pathTraceQueryPool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+				double time = (timestamps[1] - timestamps[0]) * vk->timestampPeriod / 1e6;
+				double& average = pathTraceTimes[vkFrame.pathTraceAlphaMask];
+				average = average == 0 ? time : average * 0.95 + time * 0.05;
+			}
+			vkFrame.pathTraceTimestampsWritten = false;
+		}
 
 		VkCommandBufferBeginInfo cmdBufBeginInfo = {
 			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -2296,6 +7241,9 @@ int main(int argc, char** argv) {
 		};
 		vkResetCommandBuffer(vkFrame.graphicsCmdBuf, 0);
 		vkBeginCommandBuffer(vkFrame.graphicsCmdBuf, &cmdBufBeginInfo);
+		uint64 waitUploadSemaphoreValue = vk->acquireUploads(vkFrame.graphicsCmdBuf);
+		scene->updateInstances(vk, vkFrame.graphicsCmdBuf);
+		scene->updateTextureStreaming(vk);
 
 		scene->drawCommands(vk, windowWidth, windowHeight);
 
@@ -2410,8 +7358,8 @@ int main(int argc, char** argv) {
 				const ImDrawList& dlist = *drawData->CmdLists[cmdListIndex];
 				uint64 verticesSize = dlist.VtxBuffer.Size * sizeof(ImDrawVert);
 				uint64 indicesSize = dlist.IdxBuffer.Size * sizeof(ImDrawIdx);
-				memcpy(vkFrame.uniformBuffersMappedPtr + vkFrame.imguiVertBufferMemoryOffset + vertBufferOffset, dlist.VtxBuffer.Data, verticesSize);
-				memcpy(vkFrame.uniformBuffersMappedPtr + vkFrame.imguiIndexBufferMemoryOffset + indexBufferOffset, dlist.IdxBuffer.Data, indicesSize);
+				memcpy(vkFrame.imguiVertBufferMappedPtr + vertBufferOffset, dlist.VtxBuffer.Data, verticesSize);
+				memcpy(vkFrame.imguiIndexBufferMappedPtr + indexBufferOffset, dlist.IdxBuffer.Data, indicesSize);
 				uint64 vertIndex = vertBufferOffset / sizeof(ImDrawVert);
 				uint64 indexIndex = indexBufferOffset / sizeof(ImDrawIdx);
 				for (int i = 0; i < dlist.CmdBuffer.Size; i++) {
@@ -2437,12 +7385,21 @@ int main(int argc, char** argv) {
 		vkCmdEndRenderPass(vkFrame.graphicsCmdBuf);
 		vkEndCommandBuffer(vkFrame.graphicsCmdBuf);
 
-		VkPipelineStageFlags pipelineStageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		VkSemaphore waitSemaphores[] = { vkFrame.swapChainImageSemaphore, vk->uploadTimeline.semaphore };
+		uint64 waitSemaphoreValues[] = { 0, waitUploadSemaphoreValue };
+		VkPipelineStageFlags pipelineStageFlags[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+		uint32 waitSemaphoreCount = waitUploadSemaphoreValue ? 2 : 1;
+		VkTimelineSemaphoreSubmitInfo timelineSubmitInfo = {
+			.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+			.waitSemaphoreValueCount = waitSemaphoreCount,
+			.pWaitSemaphoreValues = waitSemaphoreValues
+		};
 		VkSubmitInfo submitInfo = {
 			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-			.waitSemaphoreCount = 1,
-			.pWaitSemaphores = &vkFrame.swapChainImageSemaphore,
-			.pWaitDstStageMask = &pipelineStageFlags,
+			.pNext = &timelineSubmitInfo,
+			.waitSemaphoreCount = waitSemaphoreCount,
+			.pWaitSemaphores = waitSemaphores,
+			.pWaitDstStageMask = pipelineStageFlags,
 			.commandBufferCount = 1,
 			.pCommandBuffers = &vkFrame.graphicsCmdBuf,
 			.signalSemaphoreCount = 1,
@@ -2466,5 +7423,6 @@ int main(int argc, char** argv) {
 		vk->frameIndex = vk->frameCount % vkMaxFrameInFlight;
 	}
 
+	jobSystem->destroy();
 	return 0;
 }
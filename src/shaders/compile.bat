@@ -15,7 +15,7 @@ echo Compiling Slang shaders
 %slang% imgui.slang -target spirv -entry fragmentShader -o %outDir%\imgui_frag.spv
 %slang% pathTrace.slang -target spirv -entry rayGenShader -o %outDir%\pathTrace_rgen.spv
 %slang% pathTrace.slang -target spirv -entry missShader -o %outDir%\pathTrace_rmiss.spv
-%slang% pathTrace.slang -target spirv -entry anyhitShader -o %outDir%\pathTrace_rahit.spv
+%slang% pathTrace.slang -target spirv -entry alphaMaskAnyHitShader -o %outDir%\pathTrace_alphaMask_rahit.spv
 %slang% pathTrace.slang -target spirv -entry primaryRayClosestHitShader -o %outDir%\pathTrace_primary_rchit.spv
 %slang% pathTrace.slang -target spirv -entry closestHitShader -o %outDir%\pathTrace_rchit.spv
 